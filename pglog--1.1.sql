@@ -0,0 +1,239 @@
+/* pglog/pglog--1.1.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION pglog" to load this file. \quit
+
+CREATE FUNCTION pglog_handler()
+RETURNS fdw_handler
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pglog_validator(text[], oid)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FOREIGN DATA WRAPPER pglog
+  HANDLER pglog_handler
+  VALIDATOR pglog_validator;
+
+CREATE SERVER pglog_server
+  FOREIGN DATA WRAPPER pglog;
+
+CREATE TYPE pglog_severity AS ENUM (
+	'DEBUG',
+	'INFO',
+	'NOTICE',
+	'WARNING',
+	'ERROR',
+	'LOG',
+	'FATAL',
+	'PANIC',
+	'???'
+);
+
+CREATE FOREIGN TABLE pglog
+(
+  log_time timestamp(3) with time zone,
+  user_name text,
+  database_name text,
+  process_id integer,
+  connection_from text,
+  session_id text,
+  session_line_num bigint,
+  command_tag text,
+  session_start_time timestamp with time zone,
+  virtual_transaction_id text,
+  transaction_id bigint,
+  error_severity pglog_severity,
+  sql_state_code text,
+  message text,
+  detail text,
+  hint text,
+  internal_query text,
+  internal_query_pos integer,
+  context text,
+  query text,
+  query_pos integer,
+  location text,
+  application_name text,
+  message_fingerprint bigint,
+  query_fingerprint bigint
+) SERVER pglog_server;
+
+CREATE FUNCTION pglog_get_scan_progress(
+  OUT pid integer,
+  OUT relid oid,
+  OUT start_time timestamp with time zone,
+  OUT current_segment text,
+  OUT segments_done integer,
+  OUT segments_total integer,
+  OUT bytes_done bigint,
+  OUT bytes_total bigint,
+  OUT rows_emitted bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE VIEW pglog_scan_progress AS
+  SELECT * FROM pglog_get_scan_progress();
+
+CREATE FUNCTION pglog_severity_counts(
+  since timestamp with time zone DEFAULT '-infinity',
+  until timestamp with time zone DEFAULT 'infinity',
+  bucket text DEFAULT 'minute',
+  OUT error_severity pglog_severity,
+  OUT bucket_start timestamp with time zone,
+  OUT events bigint,
+  OUT first_log_time timestamp with time zone,
+  OUT last_log_time timestamp with time zone)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+-- Reads the spool directly, bypassing the privileges on the pglog table
+REVOKE ALL ON FUNCTION pglog_severity_counts(timestamp with time zone,
+  timestamp with time zone, text) FROM PUBLIC;
+
+CREATE FUNCTION pglog_rollup(
+  since timestamp with time zone DEFAULT '-infinity',
+  until timestamp with time zone DEFAULT 'infinity',
+  OUT minute timestamp with time zone,
+  OUT database_name text,
+  OUT user_name text,
+  OUT error_severity pglog_severity,
+  OUT sql_state_code text,
+  OUT events bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+-- Reads the spool directly, bypassing the privileges on the pglog table
+REVOKE ALL ON FUNCTION pglog_rollup(timestamp with time zone,
+  timestamp with time zone) FROM PUBLIC;
+
+CREATE FUNCTION pglog_top_errors(
+  k integer DEFAULT 10,
+  OUT window_start timestamp with time zone,
+  OUT fingerprint bigint,
+  OUT error_severity pglog_severity,
+  OUT message text,
+  OUT events bigint,
+  OUT max_overcount bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+-- Exposes normalized messages of every database
+REVOKE ALL ON FUNCTION pglog_top_errors(integer) FROM PUBLIC;
+
+CREATE FUNCTION pglog_distinct_estimates(
+  since timestamp with time zone DEFAULT '-infinity',
+  until timestamp with time zone DEFAULT 'infinity',
+  min_severity pglog_severity DEFAULT 'ERROR',
+  OUT sessions bigint,
+  OUT clients bigint,
+  OUT relative_error double precision)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+-- Reads the spool directly, bypassing the privileges on the pglog table
+REVOKE ALL ON FUNCTION pglog_distinct_estimates(timestamp with time zone,
+  timestamp with time zone, pglog_severity) FROM PUBLIC;
+
+CREATE FUNCTION pglog_message_fingerprint(message text)
+RETURNS bigint
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION pglog_query_fingerprint(query text)
+RETURNS bigint
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+-- Keeps a foreign table per day, pglog_YYYYMMDD, for the given number of
+-- days up to tomorrow, and the pglog_days view over all of them
+CREATE FUNCTION pglog_partition_days(days integer DEFAULT 7)
+RETURNS void
+LANGUAGE plpgsql
+AS $$
+DECLARE
+  parent regclass := 'pglog'::regclass;
+  nsp_oid oid;
+  nsp name;
+  columns text;
+  options text;
+  first_day date := current_date - (days - 1);
+  last_day date := current_date + 1;
+  day date;
+  child record;
+  branches text := '';
+BEGIN
+  IF days < 1 THEN
+    RAISE EXCEPTION 'days must be at least 1';
+  END IF;
+
+  SELECT n.oid, n.nspname INTO nsp_oid, nsp
+    FROM pg_class c JOIN pg_namespace n ON n.oid = c.relnamespace
+   WHERE c.oid = parent;
+
+  -- Children have the columns and the options of pglog
+  SELECT string_agg(format('%I %s', attname,
+                           format_type(atttypid, atttypmod)), ', '
+                    ORDER BY attnum)
+    INTO columns
+    FROM pg_attribute
+   WHERE attrelid = parent AND attnum > 0 AND NOT attisdropped;
+
+  SELECT coalesce(string_agg(format('%I %L', split_part(o, '=', 1),
+                                    substr(o, strpos(o, '=') + 1)), ', '), '')
+    INTO options
+    FROM pg_foreign_table, unnest(ftoptions) o
+   WHERE ftrelid = parent
+     AND split_part(o, '=', 1) NOT IN ('since', 'until');
+
+  -- Drop the view first, it depends on the days going away
+  EXECUTE format('DROP VIEW IF EXISTS %I.pglog_days', nsp);
+
+  FOR child IN
+    SELECT c.relname
+      FROM pg_class c
+     WHERE c.relnamespace = nsp_oid
+       AND c.relkind = 'f'
+       AND c.relname ~ '^pglog_[0-9]{8}$'
+       AND to_date(substr(c.relname, 7), 'YYYYMMDD')
+           NOT BETWEEN first_day AND last_day
+  LOOP
+    EXECUTE format('DROP FOREIGN TABLE %I.%I', nsp, child.relname);
+  END LOOP;
+
+  FOR day IN
+    SELECT d::date FROM generate_series(first_day, last_day, '1 day') d
+  LOOP
+    IF NOT EXISTS (SELECT 1 FROM pg_class
+                    WHERE relnamespace = nsp_oid
+                      AND relname = 'pglog_' || to_char(day, 'YYYYMMDD')) THEN
+      EXECUTE format('CREATE FOREIGN TABLE %I.%I (%s) SERVER pglog_server'
+                     ' OPTIONS (%ssince %L, until %L)',
+                     nsp, 'pglog_' || to_char(day, 'YYYYMMDD'), columns,
+                     CASE WHEN options = '' THEN '' ELSE options || ', ' END,
+                     to_char(day::timestamptz AT TIME ZONE 'UTC',
+                             'YYYY-MM-DD HH24:MI:SS') || '+00',
+                     to_char((day + 1)::timestamptz AT TIME ZONE 'UTC',
+                             'YYYY-MM-DD HH24:MI:SS') || '+00');
+    END IF;
+
+    IF branches <> '' THEN
+      branches := branches || ' UNION ALL ';
+    END IF;
+    branches := branches || format('SELECT * FROM %I.%I', nsp,
+                                   'pglog_' || to_char(day, 'YYYYMMDD'));
+  END LOOP;
+
+  EXECUTE format('CREATE VIEW %I.pglog_days AS %s', nsp, branches);
+END;
+$$;
+
+-- Creates and drops tables
+REVOKE ALL ON FUNCTION pglog_partition_days(integer) FROM PUBLIC;
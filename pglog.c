@@ -13,19 +13,36 @@
  */
 #include "postgres.h"
 
+#include "pglog_cache.h"
+#include "pglog_dedup.h"
+#include "pglog_filter.h"
 #include "pglog_helpers.h"
+#include "pglog_hll.h"
+#include "pglog_mover.h"
+#include "pglog_progress.h"
+#include "pglog_ratelimit.h"
+#include "pglog_rollup.h"
+#include "pglog_shed.h"
 #include "pglog_spool.h"
+#include "pglog_syncscan.h"
+#include "pglog_topk.h"
 
+#include "access/reloptions.h"
 #include "access/sysattr.h"
 #include "catalog/pg_foreign_table.h"
 #include "commands/defrem.h"
 #include "commands/explain.h"
 #include "commands/vacuum.h"
+#include "executor/executor.h"
+#include "executor/instrument.h"
 #include "foreign/fdwapi.h"
 #include "foreign/foreign.h"
 #include "miscadmin.h"
 #include "nodes/makefuncs.h"
 #include "postmaster/syslogger.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "utils/builtins.h"
 #include "utils/guc.h"
 #include "utils/memutils.h"
 #include "utils/rel.h"
@@ -36,8 +53,23 @@ PG_MODULE_MAGIC;
  * SQL functions
  */
 extern Datum pglog_handler(PG_FUNCTION_ARGS);
+extern Datum pglog_validator(PG_FUNCTION_ARGS);
 
 PG_FUNCTION_INFO_V1(pglog_handler);
+PG_FUNCTION_INFO_V1(pglog_validator);
+
+/*
+ * Valid options for a pglog foreign table
+ */
+static const char *const valid_options[] = {
+	"directory", /* spool directories, instead of pglog.directory */
+	"stream", /* only stream read */
+	"format", /* pglog, or csvlog for the csv files of log_destination */
+	"scope", /* all, or current_database */
+	"since", /* first log_time returned */
+	"until", /* log_time returned are before */
+	NULL
+};
 
 /*
  * Module load and unload functions
@@ -46,6 +78,11 @@ PG_FUNCTION_INFO_V1(pglog_handler);
 void _PG_init(void);
 void _PG_fini(void);
 
+/* Saved hook values in case of unload */
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+static void pglog_shmem_startup(void);
+
 /*
  * FDW callback routines
  */
@@ -65,6 +102,25 @@ static void pglogBeginForeignScan(ForeignScanState *node, int eflags);
 static TupleTableSlot *pglogIterateForeignScan(ForeignScanState *node);
 static void pglogReScanForeignScan(ForeignScanState *node);
 static void pglogEndForeignScan(ForeignScanState *node);
+static void pglogExplainForeignScan(ForeignScanState *node,
+						ExplainState *es);
+static void pglogFindSegments(ForeignScanState *node);
+
+/*
+ * Indexes of the items stored in the fdw_private list of a pglog
+ * ForeignScan plan node.
+ */
+enum PgLogScanPrivateIndex
+{
+	/* Scan options (a list of DefElem: convert_selectively and streams) */
+	PgLogScanPrivateOptions,
+	/* Segments found at plan time (a list of String nodes) */
+	PgLogScanPrivateSegments,
+	/* Comparisons of log_time to the expressions of fdw_exprs (an IntList) */
+	PgLogScanPrivateTimeOps,
+	/* Segments and streams skipped at plan time (an IntList) */
+	PgLogScanPrivatePruning
+};
 
 /*
  * Foreign-data wrapper handler function: return a struct with pointers
@@ -77,14 +133,11 @@ pglog_handler(PG_FUNCTION_ARGS)
 
 	elog(DEBUG1,"Entering function %s",__func__);
 
-	/* Check if logging_collector is on and CSV is enabled */
-	if (! Pglog_directory || strlen(Pglog_directory) == 0 || ! Pglog_spooling_enabled)
-		ereport(ERROR,
-			(errcode(ERRCODE_FDW_INVALID_HANDLE),
-			errmsg("Cannot instantiate the 'pglog' extension handler"),
-			errhint("'pglog' requires you to set 'pglog.directory' to the path of a writable directory")
-		));
-
+	/*
+	 * Whether pglog.directory is usable is only checked for the tables
+	 * reading it, as others may have a directory option (see
+	 * get_table_options).
+	 */
 
 	/* Set handlers */
 	fdwroutine->GetForeignRelSize = pglogGetForeignRelSize;
@@ -94,10 +147,128 @@ pglog_handler(PG_FUNCTION_ARGS)
 	fdwroutine->IterateForeignScan = pglogIterateForeignScan;
 	fdwroutine->ReScanForeignScan = pglogReScanForeignScan;
 	fdwroutine->EndForeignScan = pglogEndForeignScan;
+	fdwroutine->ExplainForeignScan = pglogExplainForeignScan;
 
 	PG_RETURN_POINTER(fdwroutine);
 }
 
+/*
+ * Validate the generic options given to a FOREIGN DATA WRAPPER, SERVER,
+ * USER MAPPING or FOREIGN TABLE that uses pglog.
+ *
+ * Raise an ERROR if the option or its value is considered invalid.  Only
+ * foreign tables have options.
+ */
+Datum
+pglog_validator(PG_FUNCTION_ARGS)
+{
+	List	   *options_list = untransformRelOptions(PG_GETARG_DATUM(0));
+	Oid			catalog = PG_GETARG_OID(1);
+	TimestampTz since;
+	TimestampTz until;
+	bool		seen[lengthof(valid_options)];
+	ListCell   *cell;
+
+	memset(seen, 0, sizeof(seen));
+	TIMESTAMP_NOBEGIN(since);
+	TIMESTAMP_NOEND(until);
+
+	foreach(cell, options_list)
+	{
+		DefElem    *def = (DefElem *) lfirst(cell);
+		const char *value;
+		int			i;
+
+		for (i = 0; valid_options[i]; i++)
+			if (strcmp(def->defname, valid_options[i]) == 0)
+				break;
+
+		if (catalog != ForeignTableRelationId || valid_options[i] == NULL)
+		{
+			StringInfoData buf;
+
+			/* List the valid options in the hint, if any */
+			initStringInfo(&buf);
+			if (catalog == ForeignTableRelationId)
+			{
+				for (i = 0; valid_options[i]; i++)
+					appendStringInfo(&buf, "%s%s", (i > 0) ? ", " : "",
+									 valid_options[i]);
+			}
+
+			ereport(ERROR,
+					(errcode(ERRCODE_FDW_INVALID_OPTION_NAME),
+					 errmsg("invalid option \"%s\"", def->defname),
+					 buf.len > 0
+					 ? errhint("Valid options in this context are: %s",
+							   buf.data)
+				  : errhint("There are no valid options in this context.")));
+		}
+
+		if (seen[i])
+			ereport(ERROR,
+					(errcode(ERRCODE_SYNTAX_ERROR),
+					 errmsg("conflicting or redundant options")));
+		seen[i] = true;
+
+		value = defGetString(def);
+
+		if (strcmp(def->defname, "directory") == 0)
+		{
+			/* Reading arbitrary directories is for superusers only */
+			if (!superuser())
+				ereport(ERROR,
+						(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+						 errmsg("only superuser can change the directory of a pglog foreign table")));
+			if (pglog_split_directories(value) == NIL)
+				ereport(ERROR,
+						(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+						 errmsg("option \"directory\" must be a non-empty list of directories")));
+		}
+		else if (strcmp(def->defname, "stream") == 0)
+		{
+			if (value[0] == '\0' || value[0] == '.' || first_dir_separator(value))
+				ereport(ERROR,
+						(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+						 errmsg("invalid value for option \"stream\": \"%s\"",
+								value),
+						 errhint("Streams are named \"%s\", \"%s\", or \"%s\" followed by a database name.",
+								 PGLOG_STREAM_ERRORS, PGLOG_STREAM_EVENTS,
+								 PGLOG_STREAM_DATABASE_PREFIX)));
+		}
+		else if (strcmp(def->defname, "format") == 0)
+		{
+			if (strcmp(value, "pglog") != 0 && strcmp(value, "csvlog") != 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+						 errmsg("invalid value for option \"format\": \"%s\"",
+								value),
+						 errhint("Valid values are \"pglog\" and \"csvlog\".")));
+		}
+		else if (strcmp(def->defname, "scope") == 0)
+		{
+			if (strcmp(value, "all") != 0 &&
+				strcmp(value, "current_database") != 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+						 errmsg("invalid value for option \"scope\": \"%s\"",
+								value),
+						 errhint("Valid values are \"all\" and \"current_database\".")));
+		}
+		else if (strcmp(def->defname, "since") == 0)
+			since = parse_timestamptz_option(def);
+		else if (strcmp(def->defname, "until") == 0)
+			until = parse_timestamptz_option(def);
+	}
+
+	if (since >= until)
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+				 errmsg("option \"since\" must be earlier than option \"until\"")));
+
+	PG_RETURN_VOID();
+}
+
 /*
  * pglogGetForeignRelSize
  *		Obtain relation size estimates for a foreign table
@@ -108,6 +279,7 @@ pglogGetForeignRelSize(PlannerInfo *root,
 					  Oid foreigntableid)
 {
 	PgLogPlanState *fdw_private;
+	PgLogTimeWindow window;
 
 	elog(DEBUG1,"Entering function %s",__func__);
 
@@ -116,8 +288,15 @@ pglogGetForeignRelSize(PlannerInfo *root,
 	 * well get everything and not need to re-fetch it later in planning.
 	 */
 	fdw_private = (PgLogPlanState *) palloc(sizeof(PgLogPlanState));
-	fdw_private->i = 0;
-	fdw_private->filenames = initLogFileNames(Pglog_directory);
+	get_table_options(foreigntableid, &fdw_private->table);
+	fdw_private->stream_options = extract_stream_options(baserel,
+														 foreigntableid,
+														 &fdw_private->table);
+	window.lo = fdw_private->table.since;
+	window.hi = fdw_private->table.until;
+	fdw_private->filenames = initLogFileNames(&fdw_private->table,
+											  fdw_private->stream_options,
+											  &window, &fdw_private->pruning);
 	baserel->fdw_private = (void *) fdw_private;
 
 	/* Estimate relation size */
@@ -151,13 +330,17 @@ pglogGetForeignPaths(PlannerInfo *root,
 		coptions = list_make1(makeDefElem("convert_selectively",
 										  (Node *) columns));
 
+	/* Carry the stream options too, for the scan to skip the same streams */
+	coptions = list_concat(coptions,
+						   list_copy(fdw_private->stream_options));
+
 	/* Estimate costs */
 	estimate_costs(root, baserel, fdw_private,
 				   &startup_cost, &total_cost);
 
 	/*
 	 * Create a ForeignPath node and add it as only possible path.	We use the
-	 * fdw_private list of the path to carry the convert_selectively option;
+	 * fdw_private list of the path to carry the scan options;
 	 * it will be propagated into the fdw_private list of the Plan node.
 	 */
 	add_path(baserel, (Path *)
@@ -188,7 +371,12 @@ pglogGetForeignPlan(PlannerInfo *root,
 				   List *tlist,
 				   List *scan_clauses)
 {
+	PgLogPlanState *fdw_private = (PgLogPlanState *) baserel->fdw_private;
 	Index		scan_relid = baserel->relid;
+	List	   *segments = NIL;
+	List	   *time_exprs;
+	List	   *time_ops;
+	ListCell   *lc;
 
 	elog(DEBUG1,"Entering function %s",__func__);
 
@@ -201,17 +389,31 @@ pglogGetForeignPlan(PlannerInfo *root,
 	 */
 	scan_clauses = extract_actual_clauses(scan_clauses, false);
 
+	/*
+	 * Comparisons of log_time to values known when the scan begins, such as
+	 * parameters of a generic plan, are evaluated then to skip segments.
+	 * They remain in the qual list, to be checked for each row.
+	 */
+	time_exprs = extract_time_clauses(baserel, foreigntableid, &time_ops);
+
+	/* Remember the candidate segments, for EXPLAIN */
+	foreach(lc, fdw_private->filenames)
+		segments = lappend(segments, makeString((char *) lfirst(lc)));
+
 	/* Create the ForeignScan node */
 	return make_foreignscan(tlist,
 							scan_clauses,
 							scan_relid,
-							NIL,	/* no expressions to evaluate */
-							best_path->fdw_private);
+							time_exprs,
+							list_make4(best_path->fdw_private, segments,
+									   time_ops,
+									   list_make2_int(fdw_private->pruning.segments,
+													  fdw_private->pruning.streams)));
 }
 
 /*
  * pglogBeginForeignScan
- *		Initiate access to the log by creating CopyState
+ *		Initiate access to the log by opening the first segment
  */
 static void
 pglogBeginForeignScan(ForeignScanState *node, int eflags)
@@ -229,33 +431,93 @@ pglogBeginForeignScan(ForeignScanState *node, int eflags)
 
 	/* Initialise the execution state */
 	festate = (PgLogExecutionState *) palloc(sizeof(PgLogExecutionState));
-	festate->filenames = initLogFileNames(Pglog_directory);
-	festate->i = 0;
-
-	/* Forces CSV format */
-	festate->options = list_make1(makeDefElem("format", (Node *) makeString("csv")));
 
-	/* Add any options from the plan (currently only convert_selectively) */
-	festate->options = list_concat(festate->options, plan->fdw_private);
+	/* Options from the plan (convert_selectively and the streams to skip) */
+	festate->options = (List *) list_nth(plan->fdw_private,
+										 PgLogScanPrivateOptions);
+	festate->time_ops = (List *) list_nth(plan->fdw_private,
+										  PgLogScanPrivateTimeOps);
+	festate->time_exprs = (List *) ExecInitExpr((Expr *) plan->fdw_exprs,
+												(PlanState *) node);
 
-	/* Remember scan memory context */
-	festate->scan_cxt = CurrentMemoryContext;
+	/* Only pay for timing when EXPLAIN ANALYZE asked for it */
+	memset(&festate->stats, 0, sizeof(PgLogScanStats));
+	festate->stats.collect_timing = (node->ss.ps.instrument != NULL &&
+									 node->ss.ps.instrument->need_timer);
 
 	/*
-	 * Create CopyState from FDW options.  We always acquire all columns, so
-	 * as to match the expected ScanTupleSlot signature.
-	 * Starts from the first file in the list.
+	 * Create the scan memory contexts.  Per-file data is kept in segment_cxt,
+	 * per-block data in block_cxt and per-row data in row_cxt, all of which
+	 * are reset as the scan advances, so that the memory needed by a scan
+	 * does not grow with the size of the spool.
 	 */
-	festate->cstate = NULL;
-	BeginNextCopy(node->ss.ss_currentRelation, festate);
-	elog(DEBUG1,"Copy state %p",festate->cstate);
+	festate->scan_cxt = AllocSetContextCreate(CurrentMemoryContext,
+											  "pglog scan",
+											  ALLOCSET_DEFAULT_MINSIZE,
+											  ALLOCSET_DEFAULT_INITSIZE,
+											  ALLOCSET_DEFAULT_MAXSIZE);
+	festate->segment_cxt = AllocSetContextCreate(festate->scan_cxt,
+												 "pglog segment",
+												 ALLOCSET_DEFAULT_MINSIZE,
+												 ALLOCSET_DEFAULT_INITSIZE,
+												 ALLOCSET_DEFAULT_MAXSIZE);
+	festate->row_cxt = AllocSetContextCreate(festate->scan_cxt,
+											 "pglog row",
+											 ALLOCSET_SMALL_MINSIZE,
+											 ALLOCSET_SMALL_INITSIZE,
+											 ALLOCSET_DEFAULT_MAXSIZE);
+	festate->block_cxt = AllocSetContextCreate(festate->scan_cxt,
+											   "pglog block",
+											   ALLOCSET_DEFAULT_MINSIZE,
+											   ALLOCSET_DEFAULT_INITSIZE,
+											   ALLOCSET_DEFAULT_MAXSIZE);
 
 	/*
-	 * Save state in node->fdw_state.  We must save enough information to call
-	 * BeginCopyFrom() again.
+	 * Prepare the conversion of the needed columns, and open the first file
+	 * in the list.  Unneeded columns are always returned as NULL, so as to
+	 * match the expected ScanTupleSlot signature.
 	 */
-
+	BeginRowDecoding(node->ss.ss_currentRelation, festate);
 	node->fdw_state = (void *) festate;
+	pglogFindSegments(node);
+	festate->reader = NULL;
+	festate->rows_emitted = 0;
+	festate->progress_records = 0;
+	festate->report_progress =
+		pglog_progress_begin(RelationGetRelid(node->ss.ss_currentRelation),
+							 festate->filenames);
+	BeginNextSegment(festate);
+	if (festate->report_progress && festate->reader)
+		pglog_progress_segment(festate->reader->filename, 0,
+							   festate->stats.bytes_read);
+
+}
+
+/*
+ * pglogFindSegments
+ *		List the segments a scan has to read
+ *
+ *		The time window of the scan is computed from the comparisons of
+ *		log_time found at plan time, which may depend on parameters, so this
+ *		is done again on rescan.
+ */
+static void
+pglogFindSegments(ForeignScanState *node)
+{
+	PgLogExecutionState *festate = (PgLogExecutionState *) node->fdw_state;
+	PgLogTimeWindow window;
+	MemoryContext oldcontext;
+
+	eval_time_window(festate->time_exprs, festate->time_ops,
+					 node->ss.ps.ps_ExprContext,
+					 festate->table.since, festate->table.until, &window);
+
+	oldcontext = MemoryContextSwitchTo(festate->scan_cxt);
+	festate->filenames = initLogFileNames(&festate->table, festate->options,
+										  &window, &festate->pruning);
+	festate->i = 0;
+	festate->opened = NIL;
+	MemoryContextSwitchTo(oldcontext);
 }
 
 /*
@@ -271,9 +533,9 @@ pglogIterateForeignScan(ForeignScanState *node)
 	bool		found;
 	ErrorContextCallback errcallback;
 
-	/* Set up callback to identify error line number. */
-	errcallback.callback = CopyFromErrorCallback;
-	errcallback.arg = (void *) festate->cstate;
+	/* Set up callback to identify error record. */
+	errcallback.callback = ScanErrorCallback;
+	errcallback.arg = (void *) festate;
 	errcallback.previous = error_context_stack;
 	error_context_stack = &errcallback;
 
@@ -283,27 +545,31 @@ pglogIterateForeignScan(ForeignScanState *node)
 	 * ExecStoreVirtualTuple.  If we don't find another row in the file, we
 	 * just skip the last step, leaving the slot empty as required.
 	 *
-	 * We can pass ExprContext = NULL because we read all columns from the
-	 * file, so no need to evaluate default expressions.
-	 *
-	 * We can also pass tupleOid = NULL because we don't allow oids for
-	 * foreign tables.
+	 * Columns not needed by the query are left NULL.
 	 */
 	ExecClearTuple(slot);
 	found = GetNextRow(node->ss.ss_currentRelation, festate, slot);
-	if (found)
-		ExecStoreVirtualTuple(slot);
-	else if (! isLastLogFile(festate))
+	while (! found && ! isLastLogFile(festate))
 	{
 		/* We could have reached the end of a log file
 		 * We might have to start reading from the next
+		 * (skipping empty ones)
 		 */
-		elog(DEBUG1,"Reached end of file %s",festate->filenames[festate->i]);
+		elog(DEBUG1,"Reached end of file %s",
+			 (char *) list_nth(festate->filenames, festate->i));
 		festate->i++;
-		BeginNextCopy(node->ss.ss_currentRelation, festate);
+		BeginNextSegment(festate);
+		if (festate->report_progress)
+			pglog_progress_segment((char *) list_nth(festate->filenames,
+													 festate->i),
+								   festate->i, festate->stats.bytes_read);
 		found = GetNextRow(node->ss.ss_currentRelation, festate, slot);
-		if (found)
-			ExecStoreVirtualTuple(slot);
+	}
+	if (found)
+	{
+		ExecStoreVirtualTuple(slot);
+		festate->rows_emitted++;
+		ReportProgress(festate);
 	}
 
 	/* Remove error callback. */
@@ -322,9 +588,18 @@ pglogReScanForeignScan(ForeignScanState *node)
 	PgLogExecutionState *festate = (PgLogExecutionState *) node->fdw_state;
 	elog(DEBUG1,"Entering function %s",__func__);
 
-	/* Restart reading from the beginning (first file) */
-	festate->i = 0;
-	BeginNextCopy(node->ss.ss_currentRelation, festate);
+	/*
+	 * Restart reading from the beginning (first file), of the segments to
+	 * read with the current parameters
+	 */
+	pglogFindSegments(node);
+	festate->rows_emitted = 0;
+	if (festate->report_progress)
+		pglog_progress_rescan(festate->filenames, festate->stats.bytes_read);
+	BeginNextSegment(festate);
+	if (festate->report_progress && festate->reader)
+		pglog_progress_segment(festate->reader->filename, 0,
+							   festate->stats.bytes_read);
 }
 
 /*
@@ -339,7 +614,154 @@ pglogEndForeignScan(ForeignScanState *node)
 
 	/* if festate is NULL, we are in EXPLAIN; nothing to do */
 	if (festate)
-		EndCopyFrom(festate->cstate);
+	{
+		EndSegment(festate);
+		if (festate->report_progress)
+			pglog_progress_end();
+
+		/* Release everything allocated by the scan at once */
+		MemoryContextDelete(festate->scan_cxt);
+	}
+}
+
+/*
+ * pglogExplainForeignScan
+ *		Produce extra output for EXPLAIN
+ */
+static void
+pglogExplainForeignScan(ForeignScanState *node, ExplainState *es)
+{
+	ForeignScan *plan = (ForeignScan *) node->ss.ps.plan;
+	PgLogExecutionState *festate = (PgLogExecutionState *) node->fdw_state;
+	List	   *options;
+	List	   *segments;
+	List	   *time_ops;
+	List	   *pruning;
+	List	   *columns = NIL;
+	bool		selective = false;
+	ListCell   *lc;
+	ListCell   *lc2;
+
+	options = (List *) list_nth(plan->fdw_private, PgLogScanPrivateOptions);
+	segments = (List *) list_nth(plan->fdw_private, PgLogScanPrivateSegments);
+	time_ops = (List *) list_nth(plan->fdw_private, PgLogScanPrivateTimeOps);
+	pruning = (List *) list_nth(plan->fdw_private, PgLogScanPrivatePruning);
+
+	/* Segments that were candidates at plan time */
+	ExplainPropertyLong("Spool Segments", list_length(segments), es);
+	if (es->verbose)
+	{
+		List	   *names = NIL;
+
+		foreach(lc, segments)
+			names = lappend(names, strVal(lfirst(lc)));
+		ExplainPropertyList("Segment Files", names, es);
+	}
+
+	/*
+	 * Segments skipped, by the time window or by stream: at plan time, or
+	 * when the scan ran, once the comparisons of log_time were evaluated
+	 */
+	if (festate == NULL)
+	{
+		ExplainPropertyLong("Segments Pruned by Time",
+							linitial_int(pruning), es);
+		ExplainPropertyLong("Streams Pruned", lsecond_int(pruning), es);
+	}
+	else
+	{
+		ExplainPropertyLong("Segments Listed",
+							list_length(festate->filenames), es);
+		ExplainPropertyLong("Segments Pruned by Time",
+							festate->pruning.segments, es);
+		ExplainPropertyLong("Streams Pruned", festate->pruning.streams, es);
+	}
+
+	/* Comparisons of log_time used to skip segments */
+	if (time_ops != NIL)
+	{
+		List	   *context;
+
+		context = deparse_context_for_planstate((Node *) node, NIL,
+												es->rtable,
+												es->rtable_names);
+		ExplainPropertyList("Pushed Down",
+							deparse_time_clauses(plan->fdw_exprs, time_ops,
+												 context),
+							es);
+	}
+
+	/* Columns actually converted to datums */
+	foreach(lc, options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "convert_selectively") == 0)
+		{
+			selective = true;
+			foreach(lc2, (List *) def->arg)
+				columns = lappend(columns, strVal(lfirst(lc2)));
+			break;
+		}
+	}
+	if (!selective)
+		ExplainPropertyText("Projected Columns", "all", es);
+	else if (columns == NIL)
+		ExplainPropertyText("Projected Columns", "none (count only)", es);
+	else
+		ExplainPropertyList("Projected Columns", columns, es);
+
+	/* Values restricting the spool streams read */
+	foreach(lc, options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+		List	   *values = NIL;
+
+		if (strcmp(def->defname, "severities") != 0 &&
+			strcmp(def->defname, "databases") != 0)
+			continue;
+		foreach(lc2, (List *) def->arg)
+			values = lappend(values, strVal(lfirst(lc2)));
+		ExplainPropertyList(strcmp(def->defname, "severities") == 0 ?
+							"Stream Severities" : "Stream Databases",
+							values, es);
+	}
+
+	/* Counters are only available under EXPLAIN ANALYZE */
+	if (festate == NULL)
+		return;
+
+	ExplainPropertyLong("Segments Read", festate->stats.segments_read, es);
+	ExplainPropertyLong("Bytes Read", (long) festate->stats.bytes_read, es);
+	if (festate->count_only)
+		ExplainPropertyLong("Rows Counted",
+							(long) festate->stats.rows_counted, es);
+	else
+	{
+		ExplainPropertyLong("Rows Parsed",
+							(long) festate->stats.rows_parsed, es);
+		ExplainPropertyLong("Rows Rejected",
+							(long) festate->stats.rows_rejected, es);
+	}
+	if (festate->use_block_cache)
+		ExplainPropertyLong("Cached Blocks",
+							(long) festate->stats.cached_blocks, es);
+	if (festate->stats.collect_timing)
+	{
+		instr_time	parse_time = festate->stats.parse_time;
+
+		/* parse_time covers the whole record fetch, reads included */
+		INSTR_TIME_SUBTRACT(parse_time, festate->stats.io_time);
+		ExplainPropertyFloat("Parse Time",
+							 INSTR_TIME_GET_MILLISEC(parse_time),
+							 3, es);
+		ExplainPropertyFloat("I/O Time",
+							 INSTR_TIME_GET_MILLISEC(festate->stats.io_time),
+							 3, es);
+	}
+	ExplainPropertyLong("Peak Memory (kB)",
+						(long) ((festate->stats.peak_memory + 1023) / 1024),
+						es);
 }
 
 /*
@@ -349,8 +771,38 @@ void
 _PG_init(void)
 {
 	pglog_spool_init();
+	pglog_filter_init();
+	pglog_rollup_init();
+	pglog_topk_init();
+	pglog_dedup_init();
+	pglog_ratelimit_init();
+	pglog_shed_init();
+	pglog_cache_init();
 
 	EmitWarningsOnPlaceholders("pglog");
+
+	/*
+	 * Shared memory can only be requested while loading via
+	 * shared_preload_libraries; otherwise features using it are disabled.
+	 */
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	RequestAddinShmemSpace(pglog_progress_shmem_size());
+	RequestAddinShmemSpace(pglog_rollup_shmem_size());
+	RequestAddinShmemSpace(pglog_topk_shmem_size());
+	RequestAddinShmemSpace(pglog_hll_shmem_size());
+	RequestAddinShmemSpace(pglog_dedup_shmem_size());
+	RequestAddinShmemSpace(pglog_ratelimit_shmem_size());
+	RequestAddinShmemSpace(pglog_shed_shmem_size());
+	RequestAddinShmemSpace(pglog_cache_shmem_size());
+	RequestAddinShmemSpace(pglog_syncscan_shmem_size());
+	RequestAddinLWLocks(7);
+
+	pglog_mover_register();
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = pglog_shmem_startup;
 }
 
 /*
@@ -360,4 +812,30 @@ void
 _PG_fini(void)
 {
 	pglog_spool_fini();
+
+	shmem_startup_hook = prev_shmem_startup_hook;
+}
+
+/*
+ * Shared memory startup hook: allocate or attach to shared memory
+ */
+static void
+pglog_shmem_startup(void)
+{
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	pglog_progress_shmem_startup();
+	pglog_rollup_shmem_startup();
+	pglog_topk_shmem_startup();
+	pglog_hll_shmem_startup();
+	pglog_dedup_shmem_startup();
+	pglog_ratelimit_shmem_startup();
+	pglog_shed_shmem_startup();
+	pglog_cache_shmem_startup();
+	pglog_syncscan_shmem_startup();
+
+	LWLockRelease(AddinShmemInitLock);
 }
@@ -0,0 +1,550 @@
+/*-------------------------------------------------------------------------
+ *
+ * pglog_aggregate.c
+ *		  Aggregates computed inside the spool reader
+ *
+ * Counting events by severity and time bucket only needs two fields of each
+ * record, so it is done here on the raw fields, without building a tuple
+ * for each event and without going through the executor.
+ *
+ * The groups of a segment that is over never change, so they are kept in
+ * a sidecar file next to it, one per bucket width and session time zone,
+ * and merged instead of scanning the segment again when the whole segment
+ * falls in the requested range.
+ *
+ * Copyright (c) 2014, 2ndQuadrant Ltd
+ *
+ * IDENTIFICATION
+ *		  pglog/pglog_aggregate.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "pglog_helpers.h"
+#include "pglog_mover.h"
+#include "pglog_reader.h"
+#include "pglog_spool.h"
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "access/hash.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "pgtime.h"
+#include "storage/fd.h"
+#include "utils/builtins.h"
+#include "utils/datetime.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+
+/*
+ * Units accepted as bucket width, as understood by date_trunc()
+ */
+static const char *const bucket_units[] = {
+	"second",
+	"minute",
+	"hour",
+	"day",
+	"week",
+	"month",
+	"year",
+	NULL
+};
+
+/* Current time bucket, [start, end) */
+typedef struct pglogBucket
+{
+	text *units; /* date_trunc() units */
+	Interval *width; /* one unit */
+	bool valid; /* are start and end set? */
+	TimestampTz start;
+	TimestampTz end;
+} PgLogBucket;
+
+/* Hash table entry of pglog_severity_counts() */
+typedef struct pglogSeverityKey
+{
+	int severity; /* index in pglog_severity_labels */
+	TimestampTz bucket; /* start of the time bucket */
+} PgLogSeverityKey;
+
+typedef struct pglogSeverityEntry
+{
+	PgLogSeverityKey key; /* hash key of entry - MUST BE FIRST */
+	int64 events; /* number of events */
+	TimestampTz first; /* earliest log_time */
+	TimestampTz last; /* latest log_time */
+} PgLogSeverityEntry;
+
+/*
+ * Header of the file of the groups of a segment, followed by ngroups
+ * PgLogSeverityEntry
+ */
+typedef struct pglogPartialsHeader
+{
+	uint32 magic; /* PGLOG_PARTIALS_MAGIC */
+	uint32 ngroups; /* number of groups that follow */
+	uint64 dev; /* device of the segment counted */
+	uint64 ino; /* inode of the segment counted */
+	int64 size; /* size of the segment counted */
+	TimestampTz first; /* earliest log_time of the segment */
+	TimestampTz last; /* latest log_time of the segment */
+} PgLogPartialsHeader;
+
+#define PGLOG_PARTIALS_MAGIC 0x50474C53
+
+/* Number of columns returned by pglog_severity_counts() */
+#define PGLOG_SEVERITY_COUNTS_COLS 5
+
+/*
+ * SQL functions
+ */
+extern Datum pglog_severity_counts(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(pglog_severity_counts);
+
+static TimestampTz bucket_start(PgLogBucket *bucket, TimestampTz ts);
+static void count_events(HTAB *groups, PgLogSeverityKey *key, int64 events,
+			 TimestampTz first, TimestampTz last);
+static bool read_partials(const char *path, struct stat *st,
+			  TimestampTz since, TimestampTz until, HTAB *groups,
+			  bool *valid);
+static void write_partials(const char *path, struct stat *st,
+			   PgLogPartialsHeader *header, HTAB *partials);
+
+/*
+ * Return the start of the bucket containing ts
+ *
+ * date_trunc() is only called when ts leaves the current bucket.
+ */
+static TimestampTz
+bucket_start(PgLogBucket *bucket, TimestampTz ts)
+{
+	if (bucket->valid && ts >= bucket->start && ts < bucket->end)
+		return bucket->start;
+
+	bucket->start = DatumGetTimestampTz(DirectFunctionCall2(timestamptz_trunc,
+											PointerGetDatum(bucket->units),
+											TimestampTzGetDatum(ts)));
+	bucket->end = DatumGetTimestampTz(DirectFunctionCall2(timestamptz_pl_interval,
+											TimestampTzGetDatum(bucket->start),
+											PointerGetDatum(bucket->width)));
+	bucket->valid = true;
+
+	return bucket->start;
+}
+
+/*
+ * Add events to a group
+ */
+static void
+count_events(HTAB *groups, PgLogSeverityKey *key, int64 events,
+			 TimestampTz first, TimestampTz last)
+{
+	PgLogSeverityEntry *entry;
+	bool		found;
+
+	entry = (PgLogSeverityEntry *) hash_search(groups, key, HASH_ENTER,
+											   &found);
+	if (!found)
+	{
+		entry->events = 0;
+		entry->first = first;
+		entry->last = last;
+	}
+	entry->events += events;
+	if (first < entry->first)
+		entry->first = first;
+	if (last > entry->last)
+		entry->last = last;
+}
+
+/*
+ * Merge the groups of a segment kept in its partials file
+ *
+ * *valid tells whether the file matches the segment as it is now.  The
+ * groups are only merged, and true returned, if every event of the
+ * segment is in [since, until).
+ */
+static bool
+read_partials(const char *path, struct stat *st, TimestampTz since,
+			  TimestampTz until, HTAB *groups, bool *valid)
+{
+	PgLogPartialsHeader header;
+	PgLogSeverityEntry *entries;
+	struct stat file_st;
+	FILE	   *file;
+	uint32		i;
+
+	*valid = false;
+	file = AllocateFile(path, PG_BINARY_R);
+	if (file == NULL)
+		return false;
+
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+		header.magic != PGLOG_PARTIALS_MAGIC ||
+		header.dev != (uint64) st->st_dev ||
+		header.ino != (uint64) st->st_ino ||
+		header.size != (int64) st->st_size ||
+		fstat(fileno(file), &file_st) != 0 ||
+		file_st.st_size != sizeof(header) +
+		(off_t) header.ngroups * sizeof(PgLogSeverityEntry))
+	{
+		FreeFile(file);
+		return false;
+	}
+	*valid = true;
+
+	if (header.ngroups > 0 &&
+		(header.first < since || header.last >= until))
+	{
+		FreeFile(file);
+		return false;
+	}
+
+	/* Read every group before merging any, in case the file is short */
+	entries = (PgLogSeverityEntry *)
+		palloc(Max(header.ngroups, 1) * sizeof(PgLogSeverityEntry));
+	if (fread(entries, sizeof(PgLogSeverityEntry), header.ngroups,
+			  file) != header.ngroups)
+	{
+		FreeFile(file);
+		pfree(entries);
+		*valid = false;
+		return false;
+	}
+	FreeFile(file);
+
+	for (i = 0; i < header.ngroups; i++)
+	{
+		if (entries[i].key.severity < 0 ||
+			entries[i].key.severity >= PGLOG_NUM_SEVERITIES)
+			continue;
+		count_events(groups, &entries[i].key, entries[i].events,
+					 entries[i].first, entries[i].last);
+	}
+	pfree(entries);
+
+	return true;
+}
+
+/*
+ * Keep the groups of a whole segment in its partials file
+ *
+ * The file is written under a temporary name and renamed, so that other
+ * backends never see it partly written.  It is only a cache: failures are
+ * not reported to the caller.
+ */
+static void
+write_partials(const char *path, struct stat *st,
+			   PgLogPartialsHeader *header, HTAB *partials)
+{
+	HASH_SEQ_STATUS hash_seq;
+	PgLogSeverityEntry *entry;
+	char		temp_path[MAXPGPATH];
+	FILE	   *file;
+	bool		ok;
+
+	snprintf(temp_path, sizeof(temp_path), "%s.%d", path, MyProcPid);
+	file = AllocateFile(temp_path, PG_BINARY_W);
+	if (file == NULL)
+	{
+		elog(DEBUG1, "could not create \"%s\": %m", temp_path);
+		return;
+	}
+
+	header->magic = PGLOG_PARTIALS_MAGIC;
+	header->ngroups = (uint32) hash_get_num_entries(partials);
+	header->dev = (uint64) st->st_dev;
+	header->ino = (uint64) st->st_ino;
+	header->size = (int64) st->st_size;
+	ok = (fwrite(header, sizeof(PgLogPartialsHeader), 1, file) == 1);
+
+	hash_seq_init(&hash_seq, partials);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (ok && fwrite(entry, sizeof(PgLogSeverityEntry), 1, file) != 1)
+			ok = false;
+	}
+
+	if (FreeFile(file) != 0)
+		ok = false;
+	if (ok && rename(temp_path, path) != 0)
+		ok = false;
+	if (!ok)
+	{
+		elog(DEBUG1, "could not write \"%s\": %m", path);
+		unlink(temp_path);
+	}
+}
+
+/*
+ * pglog_severity_counts
+ *		Count events by severity and time bucket
+ *
+ * Equivalent to
+ *		SELECT error_severity, date_trunc(bucket, log_time), count(*),
+ *			   min(log_time), max(log_time)
+ *		  FROM pglog WHERE log_time >= since AND log_time < until
+ *		 GROUP BY 1, 2
+ * but only the log_time and error_severity fields of each record are looked
+ * at, and no tuple is built until the groups are returned.
+ *
+ * Segments that are over are counted whole once, and their groups reused
+ * from their partials file by later calls whose range covers them.
+ */
+Datum
+pglog_severity_counts(PG_FUNCTION_ARGS)
+{
+	TimestampTz since = PG_GETARG_TIMESTAMPTZ(0);
+	TimestampTz until = PG_GETARG_TIMESTAMPTZ(1);
+	char	   *units = text_to_cstring(PG_GETARG_TEXT_PP(2));
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	MemoryContext segment_cxt;
+	HASHCTL		ctl;
+	HTAB	   *groups;
+	HASH_SEQ_STATUS hash_seq;
+	PgLogSeverityEntry *entry;
+	PgLogTimeCache time_cache;
+	PgLogBucket bucket;
+	PgLogScanStats stats;
+	Datum		severity_values[PGLOG_NUM_SEVERITIES];
+	bool		severity_done[PGLOG_NUM_SEVERITIES];
+	FmgrInfo	severity_in;
+	Oid			severity_ioparam;
+	Oid			in_func_oid;
+	PgLogTableOptions table;
+	PgLogTimeWindow window;
+	List	   *filenames;
+	ListCell   *lc;
+	char		width[32];
+	char		partials_suffix[64];
+	const char *tzname;
+	int			fast_length = 0;
+	int			i;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Check the bucket width */
+	for (i = 0; bucket_units[i] != NULL; i++)
+		if (pg_strcasecmp(units, bucket_units[i]) == 0)
+			break;
+	if (bucket_units[i] == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid bucket \"%s\"", units),
+				 errhint("Valid buckets are \"second\", \"minute\", \"hour\", "
+						 "\"day\", \"week\", \"month\" and \"year\".")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* Set up the bucket */
+	memset(&bucket, 0, sizeof(PgLogBucket));
+	bucket.units = cstring_to_text(bucket_units[i]);
+	snprintf(width, sizeof(width), "1 %s", bucket_units[i]);
+	bucket.width = DatumGetIntervalP(DirectFunctionCall3(interval_in,
+											CStringGetDatum(width),
+											ObjectIdGetDatum(InvalidOid),
+											Int32GetDatum(-1)));
+	memset(&time_cache, 0, sizeof(PgLogTimeCache));
+	memset(&stats, 0, sizeof(PgLogScanStats));
+
+	/*
+	 * Buckets wider than a minute depend on the session time zone, so it is
+	 * part of the name of the partials files with the bucket width
+	 */
+	tzname = pg_get_timezone_name(session_timezone);
+	snprintf(partials_suffix, sizeof(partials_suffix), ".%s-%08x.counts",
+			 bucket_units[i],
+			 DatumGetUInt32(hash_any((const unsigned char *) tzname,
+									 strlen(tzname))));
+
+	/* Segments of the fast tier are about to be moved: never keep theirs */
+	if (pglog_fast_tier_enabled())
+		fast_length = strlen(Pglog_fast_directory);
+
+	/* Create the groups hash table */
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(PgLogSeverityKey);
+	ctl.entrysize = sizeof(PgLogSeverityEntry);
+	ctl.hash = tag_hash;
+	ctl.hcxt = CurrentMemoryContext;
+	groups = hash_create("pglog severity counts", 256, &ctl,
+						 HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+	segment_cxt = AllocSetContextCreate(CurrentMemoryContext,
+										"pglog segment",
+										ALLOCSET_DEFAULT_MINSIZE,
+										ALLOCSET_DEFAULT_INITSIZE,
+										ALLOCSET_DEFAULT_MAXSIZE);
+
+	/* Scan all segments, looking only at the two leading fields needed */
+	get_table_options(InvalidOid, &table);
+	window.lo = since;
+	window.hi = until;
+	filenames = initLogFileNames(&table, NIL, &window, NULL);
+	foreach(lc, filenames)
+	{
+		const char *filename = (const char *) lfirst(lc);
+		PgLogReader *reader;
+		PgLogPartialsHeader header;
+		HTAB	   *partials = NULL;
+		char		partials_path[MAXPGPATH];
+		struct stat st;
+
+		MemoryContextSwitchTo(segment_cxt);
+
+		/* Reuse or keep the groups of a segment that is over */
+		if (isClosedSegment(filename) &&
+			!(fast_length > 0 &&
+			  strncmp(filename, Pglog_fast_directory, fast_length) == 0 &&
+			  filename[fast_length] == '/') &&
+			stat(filename, &st) == 0)
+		{
+			bool		valid;
+
+			snprintf(partials_path, sizeof(partials_path), "%s%s",
+					 filename, partials_suffix);
+			if (read_partials(partials_path, &st, since, until, groups,
+							  &valid))
+			{
+				MemoryContextSwitchTo(oldcontext);
+				MemoryContextReset(segment_cxt);
+				continue;
+			}
+
+			if (!valid)
+			{
+				ctl.hcxt = segment_cxt;
+				partials = hash_create("pglog severity partials", 256, &ctl,
+									   HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+				memset(&header, 0, sizeof(PgLogPartialsHeader));
+			}
+		}
+
+		reader = pglog_reader_open(filename, PGLOG_NUM_FIELDS, &stats);
+
+		while (pglog_reader_next(reader))
+		{
+			PgLogSeverityKey key;
+			TimestampTz log_time;
+
+			CHECK_FOR_INTERRUPTS();
+
+			pglog_reader_split(reader, PGLOG_FIELD_ERROR_SEVERITY + 1);
+			if (reader->nfields <= PGLOG_FIELD_ERROR_SEVERITY ||
+				reader->fields[PGLOG_FIELD_LOG_TIME] == NULL)
+				continue;
+
+			log_time = parse_log_time(&time_cache,
+									  reader->fields[PGLOG_FIELD_LOG_TIME]);
+			if (partials == NULL && (log_time < since || log_time >= until))
+				continue;
+
+			memset(&key, 0, sizeof(PgLogSeverityKey));
+			key.severity =
+				pglog_severity_index(reader->fields[PGLOG_FIELD_ERROR_SEVERITY]);
+			key.bucket = bucket_start(&bucket, log_time);
+
+			if (partials != NULL)
+			{
+				if (hash_get_num_entries(partials) == 0 ||
+					log_time < header.first)
+					header.first = log_time;
+				if (hash_get_num_entries(partials) == 0 ||
+					log_time > header.last)
+					header.last = log_time;
+				count_events(partials, &key, 1, log_time, log_time);
+				if (log_time < since || log_time >= until)
+					continue;
+			}
+
+			count_events(groups, &key, 1, log_time, log_time);
+		}
+
+		pglog_reader_close(reader);
+
+		/* Unless it changed while being read, keep the groups of the segment */
+		if (partials != NULL)
+		{
+			struct stat end_st;
+
+			if (stat(filename, &end_st) == 0 &&
+				end_st.st_dev == st.st_dev && end_st.st_ino == st.st_ino &&
+				end_st.st_size == st.st_size)
+				write_partials(partials_path, &st, &header, partials);
+			hash_destroy(partials);
+		}
+
+		MemoryContextSwitchTo(oldcontext);
+		MemoryContextReset(segment_cxt);
+	}
+	MemoryContextDelete(segment_cxt);
+
+	/* Severities are returned as pglog_severity values */
+	getTypeInputInfo(tupdesc->attrs[0]->atttypid, &in_func_oid,
+					 &severity_ioparam);
+	fmgr_info(in_func_oid, &severity_in);
+	memset(severity_done, 0, sizeof(severity_done));
+
+	hash_seq_init(&hash_seq, groups);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum		values[PGLOG_SEVERITY_COUNTS_COLS];
+		bool		nulls[PGLOG_SEVERITY_COUNTS_COLS];
+		int			severity = entry->key.severity;
+
+		if (!severity_done[severity])
+		{
+			severity_values[severity] =
+				InputFunctionCall(&severity_in,
+								  (char *) pglog_severity_labels[severity],
+								  severity_ioparam, -1);
+			severity_done[severity] = true;
+		}
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = severity_values[severity];
+		values[1] = TimestampTzGetDatum(entry->key.bucket);
+		values[2] = Int64GetDatum(entry->events);
+		values[3] = TimestampTzGetDatum(entry->first);
+		values[4] = TimestampTzGetDatum(entry->last);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	hash_destroy(groups);
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
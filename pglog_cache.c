@@ -0,0 +1,288 @@
+/*-------------------------------------------------------------------------
+ *
+ * pglog_cache.c
+ *		  Shared cache of decoded blocks of rows for pglog extension
+ *
+ * Scans of a table cut segments into blocks of PGLOG_BLOCK_SIZE raw bytes,
+ * and share the rows decoded from them, as MinimalTuples, through a cache
+ * of pglog.block_cache_size kilobytes of shared memory.  Blocks end at the
+ * first record past a multiple of PGLOG_BLOCK_SIZE, so every scan of a
+ * segment finds the same blocks, except for the first one of a scan that
+ * does not start at a block, such as a synchronized scan; a scan finding a
+ * block in the cache skips to the record following it without parsing
+ * anything.  As records are only ever
+ * appended to segments, a cached block never goes stale, and the last,
+ * incomplete block of a segment is never cached.
+ *
+ * The cache is made of PGLOG_BLOCK_CACHE_SLOT_SIZE slots, found through a
+ * hash table.  Victims are chosen by a clock sweep over the slots, as for
+ * shared buffers: a hit raises the usage count of its slot, which the sweep
+ * lowers until it finds one unused recently.  Rows are copied in and out of
+ * the slots under the cache lock, shared for lookups.
+ *
+ * Copyright (c) 2014, 2ndQuadrant Ltd
+ *
+ * IDENTIFICATION
+ *		  pglog/pglog_cache.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "pglog_cache.h"
+
+#include "miscadmin.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+
+/* GUC Variables */
+int			Pglog_block_cache_size = 0;
+
+/* Highest usage count of a slot */
+#define PGLOG_CACHE_MAX_USAGE 5
+
+/*
+ * A slot of the cache, and the block it holds
+ */
+typedef struct pglogCacheSlot
+{
+	PgLogBlockKey key; /* block held, if used */
+	bool used; /* does the slot hold a block? */
+	int usage; /* recent hits, lowered by the clock sweep */
+	int nrows; /* rows of the block */
+	int len; /* bytes of rows */
+	uint64 end_offset; /* offset of the record following the block */
+} PgLogCacheSlot;
+
+typedef struct pglogCacheEntry
+{
+	PgLogBlockKey key; /* hash key of entry - MUST BE FIRST */
+	int slot; /* index of the slot holding the block */
+} PgLogCacheEntry;
+
+/*
+ * Global shared state
+ */
+typedef struct pglogCacheShared
+{
+	LWLockId lock; /* protects the hash table and the slots */
+	int hand; /* next slot looked at by the clock sweep */
+	PgLogCacheSlot slots[1]; /* VARIABLE LENGTH ARRAY - MUST BE LAST */
+} PgLogCacheShared;
+
+/* Number of slots of the cache */
+#define PGLOG_CACHE_SLOTS \
+	((int) ((Size) Pglog_block_cache_size * 1024 / PGLOG_BLOCK_CACHE_SLOT_SIZE))
+
+/* Rows of slot i */
+#define SLOT_ROWS(i) \
+	(cache_rows + (Size) (i) * PGLOG_BLOCK_CACHE_SLOT_SIZE)
+
+/* Links to shared memory state */
+static PgLogCacheShared *cache_shared = NULL;
+static HTAB *cache_hash = NULL;
+static char *cache_rows = NULL;
+
+/*
+ * Define the block cache GUC
+ *
+ * Must be called before pglog_cache_shmem_size(), which depends on it.
+ */
+void
+pglog_cache_init(void)
+{
+	DefineCustomIntVariable("pglog.block_cache_size",
+							"Sets the amount of shared memory used to share decoded rows between scans.",
+							"Zero disables the block cache.",
+							&Pglog_block_cache_size,
+							0,
+							0,
+							INT_MAX / 1024,
+							PGC_POSTMASTER,
+							GUC_NOT_IN_SAMPLE | GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+}
+
+/*
+ * Shared memory needed for the cache
+ */
+Size
+pglog_cache_shmem_size(void)
+{
+	Size		size;
+
+	if (PGLOG_CACHE_SLOTS == 0)
+		return 0;
+
+	size = add_size(offsetof(PgLogCacheShared, slots),
+					mul_size(PGLOG_CACHE_SLOTS, sizeof(PgLogCacheSlot)));
+	size = add_size(MAXALIGN(size),
+					mul_size(PGLOG_CACHE_SLOTS, PGLOG_BLOCK_CACHE_SLOT_SIZE));
+	return add_size(size, hash_estimate_size(PGLOG_CACHE_SLOTS,
+											 sizeof(PgLogCacheEntry)));
+}
+
+/*
+ * Allocate or attach to the cache
+ *
+ * Called from the shared memory startup hook, holding AddinShmemInitLock.
+ */
+void
+pglog_cache_shmem_startup(void)
+{
+	bool		found;
+	HASHCTL		info;
+	Size		size;
+
+	if (PGLOG_CACHE_SLOTS == 0)
+		return;
+
+	size = MAXALIGN(add_size(offsetof(PgLogCacheShared, slots),
+							 mul_size(PGLOG_CACHE_SLOTS,
+									  sizeof(PgLogCacheSlot))));
+	cache_shared = ShmemInitStruct("pglog block cache",
+								   add_size(size,
+											mul_size(PGLOG_CACHE_SLOTS,
+													 PGLOG_BLOCK_CACHE_SLOT_SIZE)),
+								   &found);
+	cache_rows = (char *) cache_shared + size;
+	if (!found)
+	{
+		cache_shared->lock = LWLockAssign();
+		cache_shared->hand = 0;
+		memset(cache_shared->slots, 0,
+			   PGLOG_CACHE_SLOTS * sizeof(PgLogCacheSlot));
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(PgLogBlockKey);
+	info.entrysize = sizeof(PgLogCacheEntry);
+	info.hash = tag_hash;
+	cache_hash = ShmemInitHash("pglog block cache hash",
+							   PGLOG_CACHE_SLOTS,
+							   PGLOG_CACHE_SLOTS,
+							   &info,
+							   HASH_ELEM | HASH_FUNCTION);
+}
+
+/*
+ * Is there a block cache?
+ */
+bool
+pglog_cache_enabled(void)
+{
+	return cache_shared != NULL && MyProc != NULL;
+}
+
+/*
+ * Look a block up in the cache
+ *
+ * If found, a copy of its rows, palloc'd in CurrentMemoryContext, is
+ * returned in *rows, with their number in *nrows and the offset of the
+ * record following the block in *end_offset.
+ */
+bool
+pglog_cache_lookup(PgLogBlockKey *key, char **rows, int *nrows,
+				   uint64 *end_offset)
+{
+	PgLogCacheEntry *entry;
+	PgLogCacheSlot *slot;
+	char	   *copy = NULL;
+
+	if (!pglog_cache_enabled())
+		return false;
+
+	/* Allocate first, not to fail holding the lock */
+	copy = palloc(PGLOG_BLOCK_CACHE_SLOT_SIZE);
+
+	LWLockAcquire(cache_shared->lock, LW_SHARED);
+	entry = (PgLogCacheEntry *) hash_search(cache_hash, key, HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		slot = &cache_shared->slots[entry->slot];
+		memcpy(copy, SLOT_ROWS(entry->slot), slot->len);
+		*nrows = slot->nrows;
+		*end_offset = slot->end_offset;
+
+		/* Unlocked update: a lost increment only makes eviction sooner */
+		if (slot->usage < PGLOG_CACHE_MAX_USAGE)
+			slot->usage++;
+	}
+	LWLockRelease(cache_shared->lock);
+
+	if (entry == NULL)
+	{
+		pfree(copy);
+		return false;
+	}
+
+	*rows = copy;
+	return true;
+}
+
+/*
+ * Store the rows of a block in the cache, evicting a block if needed
+ *
+ * Blocks whose rows do not fit in a slot are not cached.
+ */
+void
+pglog_cache_store(PgLogBlockKey *key, const char *rows, int len, int nrows,
+				  uint64 end_offset)
+{
+	PgLogCacheEntry *entry;
+	PgLogCacheSlot *slot;
+	bool		found;
+
+	if (!pglog_cache_enabled() || len > PGLOG_BLOCK_CACHE_SLOT_SIZE)
+		return;
+
+	LWLockAcquire(cache_shared->lock, LW_EXCLUSIVE);
+
+	/* Another scan may have stored it meanwhile */
+	entry = (PgLogCacheEntry *) hash_search(cache_hash, key, HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		LWLockRelease(cache_shared->lock);
+		return;
+	}
+
+	/* Clock sweep, for a slot free or not used recently */
+	for (;;)
+	{
+		slot = &cache_shared->slots[cache_shared->hand];
+		if (!slot->used || slot->usage == 0)
+			break;
+		slot->usage--;
+		cache_shared->hand = (cache_shared->hand + 1) % PGLOG_CACHE_SLOTS;
+	}
+
+	if (slot->used)
+		hash_search(cache_hash, &slot->key, HASH_REMOVE, NULL);
+
+	entry = (PgLogCacheEntry *) hash_search(cache_hash, key, HASH_ENTER_NULL,
+											&found);
+	if (entry == NULL)
+	{
+		slot->used = false;
+		LWLockRelease(cache_shared->lock);
+		return;
+	}
+	entry->slot = cache_shared->hand;
+
+	slot->key = *key;
+	slot->used = true;
+	slot->usage = 1;
+	slot->nrows = nrows;
+	slot->len = len;
+	slot->end_offset = end_offset;
+	memcpy(SLOT_ROWS(cache_shared->hand), rows, len);
+
+	cache_shared->hand = (cache_shared->hand + 1) % PGLOG_CACHE_SLOTS;
+
+	LWLockRelease(cache_shared->lock);
+}
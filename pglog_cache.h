@@ -0,0 +1,60 @@
+/*-------------------------------------------------------------------------
+ *
+ * pglog_cache.h
+ *		  Shared cache of decoded blocks of rows for pglog extension
+ *
+ * Copyright (c) 2014, 2ndQuadrant Ltd
+ *
+ * IDENTIFICATION
+ *		  pglog/pglog_cache.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGLOG_CACHE_H
+#define PGLOG_CACHE_H
+
+#include "postgres.h"
+
+/* Raw bytes of a segment whose records make a block */
+#define PGLOG_BLOCK_SIZE 65536
+
+/* Space for the rows of a cached block; larger blocks are not cached */
+#define PGLOG_BLOCK_CACHE_SLOT_SIZE (2 * PGLOG_BLOCK_SIZE)
+
+/*
+ * Identity of a block of rows
+ *
+ * A block is made of the rows of the records starting from offset in the
+ * segment, up to the first record starting past the next multiple of
+ * PGLOG_BLOCK_SIZE.
+ * definition identifies the columns and options of the table the rows were
+ * decoded for, and generation the contents of the segment, as a hash of the
+ * first record, so that a reused inode is not mistaken for the segment.
+ */
+typedef struct pglogBlockKey
+{
+	uint64 dev; /* device of the segment */
+	uint64 ino; /* inode of the segment */
+	uint64 offset; /* offset of the first record of the block */
+	Oid dbid; /* database of the table */
+	Oid relid; /* table */
+	uint32 definition; /* hash of the columns and options of the table */
+	uint32 generation; /* hash of the first record of the block */
+} PgLogBlockKey;
+
+/* GUC Variables */
+extern PGDLLIMPORT int Pglog_block_cache_size;
+
+/* Initialization and shared memory setup */
+extern void pglog_cache_init(void);
+extern Size pglog_cache_shmem_size(void);
+extern void pglog_cache_shmem_startup(void);
+
+/* Called by scans */
+extern bool pglog_cache_enabled(void);
+extern bool pglog_cache_lookup(PgLogBlockKey *key, char **rows, int *nrows,
+				   uint64 *end_offset);
+extern void pglog_cache_store(PgLogBlockKey *key, const char *rows, int len,
+				  int nrows, uint64 end_offset);
+
+#endif
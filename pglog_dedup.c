@@ -0,0 +1,414 @@
+/*-------------------------------------------------------------------------
+ *
+ * pglog_dedup.c
+ *		  Write-time suppression of duplicate events for pglog extension
+ *
+ * When pglog.dedup_window is set, the first event of a given message
+ * fingerprint, database and user is written as usual and opens a window of
+ * that many seconds, during which the repeats of the same event are only
+ * counted.  Once the window is over, a single summary record carrying the
+ * number of repeats and the time of the first and last one is written in
+ * their place, by whichever backend writes an event next, or by the mover
+ * background worker within PGLOG_MOVER_SWEEP_SECS if none does.
+ *
+ * Windows are tracked in a shared hash table of pglog.dedup_max_entries
+ * entries; events that do not fit in it are never suppressed.  FATAL and
+ * PANIC events are never suppressed either.  Repeats are counted under a
+ * shared lock and the spinlock of their window, so that only opening and
+ * closing windows serializes the backends.
+ *
+ * Copyright (c) 2014, 2ndQuadrant Ltd
+ *
+ * IDENTIFICATION
+ *		  pglog/pglog_dedup.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "pglog_dedup.h"
+
+#include <sys/time.h>
+
+#include "libpq/libpq-be.h"
+#include "miscadmin.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+
+/* GUC Variables */
+int			Pglog_dedup_window = 0;
+int			Pglog_dedup_max_entries = 1024;
+
+/*
+ * Hash table key of a window
+ */
+typedef struct pglogDedupKey
+{
+	uint64 fingerprint; /* message fingerprint */
+	NameData database; /* database name, empty if none */
+	NameData user; /* user name, empty if none */
+} PgLogDedupKey;
+
+typedef struct pglogDedupEntry
+{
+	PgLogDedupKey key; /* hash key of entry - MUST BE FIRST */
+	pg_time_t window_end; /* repeats are suppressed until then */
+	slock_t mutex; /* protects the summary only */
+	PgLogDedupSummary summary; /* repeats suppressed so far */
+} PgLogDedupEntry;
+
+/*
+ * Global shared state
+ */
+typedef struct pglogDedupShared
+{
+	LWLockId lock; /* protects the hash table and its entries */
+	pg_time_t next_sweep; /* when to look for closed windows again */
+} PgLogDedupShared;
+
+/* Links to shared memory state */
+static PgLogDedupShared *dedup_shared = NULL;
+static HTAB *dedup_hash = NULL;
+
+/* Is this backend already checking an event? */
+static bool dedup_busy = false;
+
+static void sweep_windows(pg_time_t now, List **summaries);
+static void close_window(PgLogDedupEntry *entry, List **summaries);
+
+/*
+ * Define the deduplication GUCs
+ *
+ * Must be called before pglog_dedup_shmem_size(), which depends on them.
+ */
+void
+pglog_dedup_init(void)
+{
+	DefineCustomIntVariable("pglog.dedup_window",
+							"Sets the time during which repeats of an event are counted instead of written.",
+							"Zero disables suppression of duplicate events.",
+							&Pglog_dedup_window,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_NOT_IN_SAMPLE | GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pglog.dedup_max_entries",
+							"Sets the maximum number of events tracked for duplicate suppression.",
+							NULL,
+							&Pglog_dedup_max_entries,
+							1024,
+							64,
+							INT_MAX,
+							PGC_POSTMASTER,
+							GUC_NOT_IN_SAMPLE,
+							NULL,
+							NULL,
+							NULL);
+}
+
+/*
+ * Shared memory needed for the windows
+ */
+Size
+pglog_dedup_shmem_size(void)
+{
+	return add_size(MAXALIGN(sizeof(PgLogDedupShared)),
+					hash_estimate_size(Pglog_dedup_max_entries,
+									   sizeof(PgLogDedupEntry)));
+}
+
+/*
+ * Allocate or attach to the windows
+ *
+ * Called from the shared memory startup hook, holding AddinShmemInitLock.
+ */
+void
+pglog_dedup_shmem_startup(void)
+{
+	bool		found;
+	HASHCTL		info;
+
+	dedup_shared = ShmemInitStruct("pglog dedup",
+								   sizeof(PgLogDedupShared),
+								   &found);
+	if (!found)
+	{
+		dedup_shared->lock = LWLockAssign();
+		dedup_shared->next_sweep = 0;
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(PgLogDedupKey);
+	info.entrysize = sizeof(PgLogDedupEntry);
+	info.hash = tag_hash;
+	dedup_hash = ShmemInitHash("pglog dedup hash",
+							   Pglog_dedup_max_entries,
+							   Pglog_dedup_max_entries,
+							   &info,
+							   HASH_ELEM | HASH_FUNCTION);
+}
+
+/*
+ * Should an event be suppressed as a repeat?
+ *
+ * Returns true if the event falls in the window of an earlier identical
+ * event, in which case it has been counted and must not be written.  The
+ * summaries of the windows found closed, to be written before the event,
+ * are appended to *summaries, allocated in the current memory context.
+ */
+bool
+pglog_dedup_check(ErrorData *edata, uint64 fingerprint, List **summaries)
+{
+	PgLogDedupKey key;
+	PgLogDedupEntry *entry;
+	struct timeval tv;
+	bool		found;
+	bool		suppress = false;
+
+	/* Safety check, and no recursion from errors reported below */
+	if (Pglog_dedup_window <= 0 || !dedup_shared || MyProc == NULL ||
+		dedup_busy || edata->elevel >= FATAL)
+		return false;
+
+	gettimeofday(&tv, NULL);
+
+	memset(&key, 0, sizeof(PgLogDedupKey));
+	key.fingerprint = fingerprint;
+	if (MyProcPort && MyProcPort->database_name)
+		strlcpy(NameStr(key.database), MyProcPort->database_name, NAMEDATALEN);
+	if (MyProcPort && MyProcPort->user_name)
+		strlcpy(NameStr(key.user), MyProcPort->user_name, NAMEDATALEN);
+
+	dedup_busy = true;
+
+	/* Count a repeat using a shared lock, unless a sweep is due */
+	LWLockAcquire(dedup_shared->lock, LW_SHARED);
+
+	if (tv.tv_sec < dedup_shared->next_sweep)
+	{
+		entry = (PgLogDedupEntry *) hash_search(dedup_hash, &key,
+												HASH_FIND, NULL);
+		if (entry && entry->window_end > tv.tv_sec)
+		{
+			volatile PgLogDedupEntry *e = (volatile PgLogDedupEntry *) entry;
+
+			SpinLockAcquire(&e->mutex);
+			if (e->summary.repeats == 0)
+			{
+				e->summary.first_time = (pg_time_t) tv.tv_sec;
+				e->summary.first_msec = (int) (tv.tv_usec / 1000);
+			}
+			e->summary.last_time = (pg_time_t) tv.tv_sec;
+			e->summary.last_msec = (int) (tv.tv_usec / 1000);
+			e->summary.repeats++;
+			SpinLockRelease(&e->mutex);
+
+			LWLockRelease(dedup_shared->lock);
+			dedup_busy = false;
+			return true;
+		}
+	}
+
+	/* Need exclusive lock to close windows or to open a new one */
+	LWLockRelease(dedup_shared->lock);
+	LWLockAcquire(dedup_shared->lock, LW_EXCLUSIVE);
+
+	/* Close the windows that are over, at most once a second */
+	if (tv.tv_sec >= dedup_shared->next_sweep)
+		sweep_windows((pg_time_t) tv.tv_sec, summaries);
+
+	/*
+	 * The window could have been opened by someone else meanwhile.  The
+	 * table is not allowed to grow past its size, which would take shared
+	 * memory other modules rely on.
+	 */
+	entry = (PgLogDedupEntry *) hash_search(dedup_hash, &key,
+											HASH_FIND, &found);
+	if (entry == NULL &&
+		hash_get_num_entries(dedup_hash) < Pglog_dedup_max_entries)
+	{
+		entry = (PgLogDedupEntry *) hash_search(dedup_hash, &key,
+												HASH_ENTER_NULL, &found);
+		if (entry)
+			SpinLockInit(&entry->mutex);
+	}
+	if (found && entry->window_end > tv.tv_sec)
+	{
+		PgLogDedupSummary *summary = &entry->summary;
+
+		if (summary->repeats == 0)
+		{
+			summary->first_time = (pg_time_t) tv.tv_sec;
+			summary->first_msec = (int) (tv.tv_usec / 1000);
+		}
+		summary->last_time = (pg_time_t) tv.tv_sec;
+		summary->last_msec = (int) (tv.tv_usec / 1000);
+		summary->repeats++;
+		suppress = true;
+	}
+	else if (entry != NULL)
+	{
+		/* New event, or window not swept yet: open a new window */
+		if (found)
+			close_window(entry, summaries);
+
+		entry->window_end = (pg_time_t) tv.tv_sec + Pglog_dedup_window;
+		memset(&entry->summary, 0, sizeof(PgLogDedupSummary));
+		entry->summary.fingerprint = fingerprint;
+		entry->summary.database = key.database;
+		entry->summary.user = key.user;
+		entry->summary.elevel = edata->elevel;
+		entry->summary.sqlerrcode = edata->sqlerrcode;
+		if (edata->message)
+			strlcpy(entry->summary.message, edata->message,
+					PGLOG_DEDUP_MESSAGE_LEN);
+	}
+
+	LWLockRelease(dedup_shared->lock);
+
+	dedup_busy = false;
+
+	return suppress;
+}
+
+/*
+ * Close the windows that are over, if not done in the last second
+ *
+ * The summaries of the windows closed are appended to *summaries, allocated
+ * in the current memory context.  Windows are closed even once
+ * pglog.dedup_window has been set to 0, so that no summary is left behind.
+ */
+void
+pglog_dedup_sweep(List **summaries)
+{
+	struct timeval tv;
+
+	if (!dedup_shared || MyProc == NULL || dedup_busy)
+		return;
+
+	gettimeofday(&tv, NULL);
+
+	dedup_busy = true;
+
+	LWLockAcquire(dedup_shared->lock, LW_EXCLUSIVE);
+	if (tv.tv_sec >= dedup_shared->next_sweep)
+		sweep_windows((pg_time_t) tv.tv_sec, summaries);
+	LWLockRelease(dedup_shared->lock);
+
+	dedup_busy = false;
+}
+
+/*
+ * Put back summaries that could not be written, to be written later
+ *
+ * A summary is merged into the window of the same event if one is open.
+ * Otherwise it is kept in a window that is already over, for the next sweep
+ * to return it again.  It is lost if the table is full.
+ */
+void
+pglog_dedup_requeue(List *summaries)
+{
+	ListCell   *lc;
+
+	if (summaries == NIL || !dedup_shared || MyProc == NULL || dedup_busy)
+		return;
+
+	dedup_busy = true;
+
+	LWLockAcquire(dedup_shared->lock, LW_EXCLUSIVE);
+
+	foreach(lc, summaries)
+	{
+		PgLogDedupSummary *summary = (PgLogDedupSummary *) lfirst(lc);
+		PgLogDedupKey key;
+		PgLogDedupEntry *entry;
+
+		memset(&key, 0, sizeof(PgLogDedupKey));
+		key.fingerprint = summary->fingerprint;
+		key.database = summary->database;
+		key.user = summary->user;
+
+		entry = (PgLogDedupEntry *) hash_search(dedup_hash, &key,
+												HASH_FIND, NULL);
+		if (entry == NULL)
+		{
+			if (hash_get_num_entries(dedup_hash) >= Pglog_dedup_max_entries)
+				continue;
+			entry = (PgLogDedupEntry *) hash_search(dedup_hash, &key,
+													HASH_ENTER_NULL, NULL);
+			if (entry == NULL)
+				continue;
+			SpinLockInit(&entry->mutex);
+			entry->window_end = 0;
+			memcpy(&entry->summary, summary, sizeof(PgLogDedupSummary));
+		}
+		else if (entry->summary.repeats == 0)
+		{
+			entry->summary.repeats = summary->repeats;
+			entry->summary.first_time = summary->first_time;
+			entry->summary.first_msec = summary->first_msec;
+			entry->summary.last_time = summary->last_time;
+			entry->summary.last_msec = summary->last_msec;
+		}
+		else
+		{
+			/* The summary put back is older than the open window */
+			entry->summary.repeats += summary->repeats;
+			entry->summary.first_time = summary->first_time;
+			entry->summary.first_msec = summary->first_msec;
+		}
+	}
+
+	LWLockRelease(dedup_shared->lock);
+
+	dedup_busy = false;
+}
+
+/*
+ * Close the windows that are over, appending their summaries to *summaries
+ *
+ * Caller must hold the lock exclusively.
+ */
+static void
+sweep_windows(pg_time_t now, List **summaries)
+{
+	HASH_SEQ_STATUS hash_seq;
+	PgLogDedupEntry *entry;
+
+	hash_seq_init(&hash_seq, dedup_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (entry->window_end > now)
+			continue;
+		close_window(entry, summaries);
+		hash_search(dedup_hash, &entry->key, HASH_REMOVE, NULL);
+	}
+	dedup_shared->next_sweep = now + 1;
+}
+
+/*
+ * Append the summary of a window to *summaries, if anything was suppressed
+ *
+ * Caller must hold the lock exclusively, so no repeat is being counted.
+ */
+static void
+close_window(PgLogDedupEntry *entry, List **summaries)
+{
+	PgLogDedupSummary *summary;
+
+	if (entry->summary.repeats == 0)
+		return;
+
+	summary = (PgLogDedupSummary *) palloc(sizeof(PgLogDedupSummary));
+	memcpy(summary, &entry->summary, sizeof(PgLogDedupSummary));
+	*summaries = lappend(*summaries, summary);
+}
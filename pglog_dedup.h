@@ -0,0 +1,62 @@
+/*-------------------------------------------------------------------------
+ *
+ * pglog_dedup.h
+ *		  Write-time suppression of duplicate events for pglog extension
+ *
+ * Copyright (c) 2014, 2ndQuadrant Ltd
+ *
+ * IDENTIFICATION
+ *		  pglog/pglog_dedup.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGLOG_DEDUP_H
+#define PGLOG_DEDUP_H
+
+#include "postgres.h"
+
+#include "nodes/pg_list.h"
+#include "pgtime.h"
+
+/* Bytes of the message kept to describe suppressed repeats */
+#define PGLOG_DEDUP_MESSAGE_LEN 256
+
+/*
+ * Repeats of an event suppressed during a window, to be written as a
+ * single summary record
+ */
+typedef struct pglogDedupSummary
+{
+	uint64 fingerprint; /* message fingerprint */
+	NameData database; /* database name, empty if none */
+	NameData user; /* user name, empty if none */
+	int elevel; /* level of the first event */
+	int sqlerrcode; /* encoded SQLSTATE of the first event */
+	int64 repeats; /* number of events suppressed */
+	pg_time_t first_time; /* time of the first suppressed event */
+	int first_msec; /* milliseconds of first_time */
+	pg_time_t last_time; /* time of the last suppressed event */
+	int last_msec; /* milliseconds of last_time */
+	char message[PGLOG_DEDUP_MESSAGE_LEN]; /* message of the first event */
+} PgLogDedupSummary;
+
+/* GUC Variables */
+extern PGDLLIMPORT int Pglog_dedup_window;
+extern PGDLLIMPORT int Pglog_dedup_max_entries;
+
+/* Initialization and shared memory setup */
+extern void pglog_dedup_init(void);
+extern Size pglog_dedup_shmem_size(void);
+extern void pglog_dedup_shmem_startup(void);
+
+/* Called by the write path before writing an event */
+extern bool pglog_dedup_check(ErrorData *edata, uint64 fingerprint,
+				  List **summaries);
+
+/* Called periodically by the mover */
+extern void pglog_dedup_sweep(List **summaries);
+
+/* Called with the summaries that could not be written */
+extern void pglog_dedup_requeue(List *summaries);
+
+#endif
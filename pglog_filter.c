@@ -0,0 +1,678 @@
+/*-------------------------------------------------------------------------
+ *
+ * pglog_filter.c
+ *		  Write-time filter expressions for pglog extension
+ *
+ * pglog.filter holds a boolean expression deciding which events are
+ * written, on top of pglog.min_messages:
+ *
+ *		expr	:= expr OR expr | expr AND expr | NOT expr | ( expr )
+ *				 | field op value | field [NOT] IN ( value [, ...] )
+ *		field	:= severity | sqlstate | database | user | application
+ *				 | message
+ *		op		:= = | <> | != | < | <= | > | >= | ^=
+ *
+ * Values are quoted with single or double quotes; severities may also be
+ * written bare, and are compared in the order of the pglog_severity enum.
+ * The other fields are compared as strings, with ^= meaning "starts with".
+ *
+ * The expression is compiled by the check hook of the setting into a
+ * program for a small stack machine, stored in a single block as the GUC
+ * "extra" data, so the write path evaluates it without parsing nor
+ * allocating anything.
+ *
+ * Copyright (c) 2014, 2ndQuadrant Ltd
+ *
+ * IDENTIFICATION
+ *		  pglog/pglog_filter.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "pglog_filter.h"
+#include "pglog_spool.h"
+
+#include <ctype.h>
+
+#include "lib/stringinfo.h"
+#include "libpq/libpq-be.h"
+#include "miscadmin.h"
+#include "utils/guc.h"
+
+/* GUC Variables */
+char	   *Pglog_filter = NULL;
+
+/* Maximum depth of the evaluation stack */
+#define PGLOG_FILTER_MAX_DEPTH 32
+
+/* Instructions */
+typedef enum PgLogFilterOp
+{
+	PGLOG_FILTER_CMP,			/* push the result of a comparison */
+	PGLOG_FILTER_AND,			/* pop two results, push their AND */
+	PGLOG_FILTER_OR,			/* pop two results, push their OR */
+	PGLOG_FILTER_NOT			/* negate the top result */
+} PgLogFilterOp;
+
+/* Fields of an event that can be compared */
+typedef enum PgLogFilterField
+{
+	PGLOG_FILTER_SEVERITY,
+	PGLOG_FILTER_SQLSTATE,
+	PGLOG_FILTER_DATABASE,
+	PGLOG_FILTER_USER,
+	PGLOG_FILTER_APPLICATION,
+	PGLOG_FILTER_MESSAGE
+} PgLogFilterField;
+
+/* Comparison operators */
+typedef enum PgLogFilterCmp
+{
+	PGLOG_FILTER_EQ,
+	PGLOG_FILTER_NE,
+	PGLOG_FILTER_LT,
+	PGLOG_FILTER_LE,
+	PGLOG_FILTER_GT,
+	PGLOG_FILTER_GE,
+	PGLOG_FILTER_PREFIX
+} PgLogFilterCmp;
+
+static const char *const field_names[] = {
+	"severity",
+	"sqlstate",
+	"database",
+	"user",
+	"application",
+	"message"
+};
+
+typedef struct pglogFilterInstr
+{
+	uint8 op; /* a PgLogFilterOp */
+	uint8 field; /* a PgLogFilterField, for comparisons */
+	uint8 cmp; /* a PgLogFilterCmp, for comparisons */
+	int value; /* severity index, or offset of the string operand */
+	int len; /* length of the string operand */
+} PgLogFilterInstr;
+
+/*
+ * A compiled filter, followed by its string operands
+ */
+typedef struct pglogFilter
+{
+	int ninstrs; /* number of instructions */
+	int strings; /* offset of the string operands from the start */
+	PgLogFilterInstr instrs[1]; /* VARIABLE LENGTH ARRAY */
+} PgLogFilter;
+
+/*
+ * Parser state
+ */
+typedef enum PgLogFilterToken
+{
+	TOK_END,
+	TOK_IDENT,
+	TOK_STRING,
+	TOK_OP,
+	TOK_LPAREN,
+	TOK_RPAREN,
+	TOK_COMMA,
+	TOK_ERROR
+} PgLogFilterToken;
+
+typedef struct pglogFilterParser
+{
+	const char *p; /* next character to read */
+	const char *token_start; /* start of the current token */
+	PgLogFilterToken token; /* current token */
+	PgLogFilterCmp token_cmp; /* its operator, for TOK_OP */
+	StringInfoData token_text; /* its text, for TOK_IDENT and TOK_STRING */
+	const char *token_error; /* its error detail, for TOK_ERROR */
+	PgLogFilterInstr *instrs; /* program being built */
+	int ninstrs; /* instructions used */
+	int maxinstrs; /* instructions allocated */
+	StringInfoData strings; /* string operands */
+	const char *error; /* error detail, NULL if none */
+} PgLogFilterParser;
+
+/* Program in use, NULL if no filter */
+static PgLogFilter *filter_program = NULL;
+
+static bool guc_check_filter(char **newval, void **extra, GucSource source);
+static void guc_assign_filter(const char *newval, void *extra);
+static void next_token(PgLogFilterParser *ps);
+static bool is_keyword(PgLogFilterParser *ps, const char *keyword);
+static void emit(PgLogFilterParser *ps, PgLogFilterOp op, int field, int cmp,
+	 int value, int len);
+static bool parse_or(PgLogFilterParser *ps);
+static bool parse_and(PgLogFilterParser *ps);
+static bool parse_not(PgLogFilterParser *ps);
+static bool parse_primary(PgLogFilterParser *ps);
+static bool parse_value(PgLogFilterParser *ps, int field, int cmp);
+
+/*
+ * Define the filter GUC
+ */
+void
+pglog_filter_init(void)
+{
+	DefineCustomStringVariable("pglog.filter",
+							   "Sets the condition events must meet to be written.",
+							   "An empty string writes every event.",
+							   &Pglog_filter,
+							   "",
+							   PGC_SUSET,
+							   GUC_NOT_IN_SAMPLE,
+							   guc_check_filter,
+							   guc_assign_filter,
+							   NULL);
+}
+
+/*
+ * Should an event be written?
+ */
+bool
+pglog_filter_accept(ErrorData *edata)
+{
+	const PgLogFilter *f = filter_program;
+	const char *strings;
+	bool		stack[PGLOG_FILTER_MAX_DEPTH];
+	int			sp = 0;
+	int			severity = -1;
+	const char *sqlstate = NULL;
+	int			i;
+
+	if (f == NULL)
+		return true;
+
+	strings = (const char *) f + f->strings;
+
+	for (i = 0; i < f->ninstrs; i++)
+	{
+		const PgLogFilterInstr *instr = &f->instrs[i];
+		const char *value = NULL;
+		int			c = 0;
+
+		switch (instr->op)
+		{
+			case PGLOG_FILTER_AND:
+				sp--;
+				stack[sp - 1] = stack[sp - 1] && stack[sp];
+				continue;
+			case PGLOG_FILTER_OR:
+				sp--;
+				stack[sp - 1] = stack[sp - 1] || stack[sp];
+				continue;
+			case PGLOG_FILTER_NOT:
+				stack[sp - 1] = !stack[sp - 1];
+				continue;
+		}
+
+		/* A comparison: fetch the field, computed once per event */
+		switch (instr->field)
+		{
+			case PGLOG_FILTER_SEVERITY:
+				if (severity < 0)
+					severity = pglog_severity_index(pglog_error_severity(edata->elevel));
+				c = severity - instr->value;
+				break;
+			case PGLOG_FILTER_SQLSTATE:
+				if (sqlstate == NULL)
+					sqlstate = unpack_sql_state(edata->sqlerrcode);
+				value = sqlstate;
+				break;
+			case PGLOG_FILTER_DATABASE:
+				if (MyProcPort)
+					value = MyProcPort->database_name;
+				break;
+			case PGLOG_FILTER_USER:
+				if (MyProcPort)
+					value = MyProcPort->user_name;
+				break;
+			case PGLOG_FILTER_APPLICATION:
+				value = application_name;
+				break;
+			case PGLOG_FILTER_MESSAGE:
+				value = edata->message;
+				break;
+		}
+
+		if (instr->field != PGLOG_FILTER_SEVERITY)
+		{
+			if (value == NULL)
+				value = "";
+			if (instr->cmp == PGLOG_FILTER_PREFIX)
+				c = strncmp(value, strings + instr->value, instr->len);
+			else
+				c = strcmp(value, strings + instr->value);
+		}
+
+		switch (instr->cmp)
+		{
+			case PGLOG_FILTER_EQ:
+			case PGLOG_FILTER_PREFIX:
+				stack[sp++] = (c == 0);
+				break;
+			case PGLOG_FILTER_NE:
+				stack[sp++] = (c != 0);
+				break;
+			case PGLOG_FILTER_LT:
+				stack[sp++] = (c < 0);
+				break;
+			case PGLOG_FILTER_LE:
+				stack[sp++] = (c <= 0);
+				break;
+			case PGLOG_FILTER_GT:
+				stack[sp++] = (c > 0);
+				break;
+			case PGLOG_FILTER_GE:
+				stack[sp++] = (c >= 0);
+				break;
+		}
+	}
+
+	Assert(sp == 1);
+	return stack[0];
+}
+
+/*
+ * Compile the filter, handing the program to the assign hook as extra
+ */
+static bool
+guc_check_filter(char **newval, void **extra, GucSource source)
+{
+	PgLogFilterParser ps;
+	PgLogFilter *program;
+	Size		instrs_size;
+	Size		size;
+	int			depth = 0;
+	int			max_depth = 0;
+	int			i;
+
+	/* Skip whitespace to find out whether there is a filter at all */
+	ps.p = *newval;
+	while (isspace((unsigned char) *ps.p))
+		ps.p++;
+	if (*ps.p == '\0')
+	{
+		*extra = NULL;
+		return true;
+	}
+
+	ps.instrs = NULL;
+	ps.ninstrs = 0;
+	ps.maxinstrs = 0;
+	ps.error = NULL;
+	initStringInfo(&ps.token_text);
+	initStringInfo(&ps.strings);
+
+	next_token(&ps);
+	if (!parse_or(&ps) || ps.token == TOK_ERROR)
+	{
+		/*
+		 * The parser stops at the token it cannot use; if that token is not
+		 * even valid, the lexer knows better what went wrong.
+		 */
+		GUC_check_errdetail("%s", ps.token == TOK_ERROR ? ps.token_error :
+							ps.error);
+		return false;
+	}
+	if (ps.token != TOK_END)
+	{
+		GUC_check_errdetail("Syntax error at or near \"%s\".", ps.token_start);
+		return false;
+	}
+
+	/* Every instruction but NOT moves the stack pointer */
+	for (i = 0; i < ps.ninstrs; i++)
+	{
+		if (ps.instrs[i].op == PGLOG_FILTER_CMP)
+			depth++;
+		else if (ps.instrs[i].op != PGLOG_FILTER_NOT)
+			depth--;
+		max_depth = Max(max_depth, depth);
+	}
+	if (max_depth > PGLOG_FILTER_MAX_DEPTH)
+	{
+		GUC_check_errdetail("Filter expression is too complex.");
+		return false;
+	}
+
+	/* Flatten the program and its strings into a single block */
+	instrs_size = offsetof(PgLogFilter, instrs) +
+		ps.ninstrs * sizeof(PgLogFilterInstr);
+	size = instrs_size + ps.strings.len + 1;
+	program = (PgLogFilter *) malloc(size);
+	if (program == NULL)
+	{
+		GUC_check_errcode(ERRCODE_OUT_OF_MEMORY);
+		GUC_check_errmsg("out of memory");
+		return false;
+	}
+	program->ninstrs = ps.ninstrs;
+	program->strings = instrs_size;
+	memcpy(program->instrs, ps.instrs, ps.ninstrs * sizeof(PgLogFilterInstr));
+	memcpy((char *) program + instrs_size, ps.strings.data, ps.strings.len + 1);
+
+	*extra = program;
+	return true;
+}
+
+static void
+guc_assign_filter(const char *newval, void *extra)
+{
+	filter_program = (PgLogFilter *) extra;
+}
+
+/*
+ * Read the next token
+ */
+static void
+next_token(PgLogFilterParser *ps)
+{
+	const char *p = ps->p;
+
+	while (isspace((unsigned char) *p))
+		p++;
+
+	ps->token_start = p;
+	resetStringInfo(&ps->token_text);
+
+	if (*p == '\0')
+		ps->token = TOK_END;
+	else if (*p == '(')
+	{
+		ps->token = TOK_LPAREN;
+		p++;
+	}
+	else if (*p == ')')
+	{
+		ps->token = TOK_RPAREN;
+		p++;
+	}
+	else if (*p == ',')
+	{
+		ps->token = TOK_COMMA;
+		p++;
+	}
+	else if (*p == '\'' || *p == '"')
+	{
+		char		quote = *p++;
+
+		/* A doubled quote stands for itself */
+		ps->token = TOK_STRING;
+		for (;;)
+		{
+			if (*p == '\0')
+			{
+				ps->token = TOK_ERROR;
+				ps->token_error = "Unterminated quoted string.";
+				break;
+			}
+			if (*p == quote && p[1] == quote)
+				p++;
+			else if (*p == quote)
+			{
+				p++;
+				break;
+			}
+			appendStringInfoChar(&ps->token_text, *p++);
+		}
+	}
+	else if (isalpha((unsigned char) *p) || *p == '_')
+	{
+		ps->token = TOK_IDENT;
+		while (isalnum((unsigned char) *p) || *p == '_')
+			appendStringInfoChar(&ps->token_text,
+								 pg_tolower((unsigned char) *p++));
+	}
+	else
+	{
+		ps->token = TOK_OP;
+		if (p[0] == '<' && p[1] == '>')
+			ps->token_cmp = PGLOG_FILTER_NE, p += 2;
+		else if (p[0] == '!' && p[1] == '=')
+			ps->token_cmp = PGLOG_FILTER_NE, p += 2;
+		else if (p[0] == '<' && p[1] == '=')
+			ps->token_cmp = PGLOG_FILTER_LE, p += 2;
+		else if (p[0] == '>' && p[1] == '=')
+			ps->token_cmp = PGLOG_FILTER_GE, p += 2;
+		else if (p[0] == '^' && p[1] == '=')
+			ps->token_cmp = PGLOG_FILTER_PREFIX, p += 2;
+		else if (p[0] == '=')
+			ps->token_cmp = PGLOG_FILTER_EQ, p++;
+		else if (p[0] == '<')
+			ps->token_cmp = PGLOG_FILTER_LT, p++;
+		else if (p[0] == '>')
+			ps->token_cmp = PGLOG_FILTER_GT, p++;
+		else
+		{
+			ps->token = TOK_ERROR;
+			ps->token_error = "Unexpected character in filter expression.";
+		}
+	}
+
+	ps->p = p;
+}
+
+/* Is the current token the given keyword? */
+static bool
+is_keyword(PgLogFilterParser *ps, const char *keyword)
+{
+	return ps->token == TOK_IDENT && strcmp(ps->token_text.data, keyword) == 0;
+}
+
+/*
+ * Append an instruction to the program
+ */
+static void
+emit(PgLogFilterParser *ps, PgLogFilterOp op, int field, int cmp,
+	 int value, int len)
+{
+	PgLogFilterInstr *instr;
+
+	if (ps->ninstrs >= ps->maxinstrs)
+	{
+		ps->maxinstrs = Max(16, ps->maxinstrs * 2);
+		if (ps->instrs == NULL)
+			ps->instrs = palloc(ps->maxinstrs * sizeof(PgLogFilterInstr));
+		else
+			ps->instrs = repalloc(ps->instrs,
+								  ps->maxinstrs * sizeof(PgLogFilterInstr));
+	}
+
+	instr = &ps->instrs[ps->ninstrs++];
+	instr->op = op;
+	instr->field = field;
+	instr->cmp = cmp;
+	instr->value = value;
+	instr->len = len;
+}
+
+/* expr OR expr */
+static bool
+parse_or(PgLogFilterParser *ps)
+{
+	if (!parse_and(ps))
+		return false;
+	while (is_keyword(ps, "or"))
+	{
+		next_token(ps);
+		if (!parse_and(ps))
+			return false;
+		emit(ps, PGLOG_FILTER_OR, 0, 0, 0, 0);
+	}
+	return true;
+}
+
+/* expr AND expr */
+static bool
+parse_and(PgLogFilterParser *ps)
+{
+	if (!parse_not(ps))
+		return false;
+	while (is_keyword(ps, "and"))
+	{
+		next_token(ps);
+		if (!parse_not(ps))
+			return false;
+		emit(ps, PGLOG_FILTER_AND, 0, 0, 0, 0);
+	}
+	return true;
+}
+
+/* NOT expr */
+static bool
+parse_not(PgLogFilterParser *ps)
+{
+	if (is_keyword(ps, "not"))
+	{
+		next_token(ps);
+		if (!parse_not(ps))
+			return false;
+		emit(ps, PGLOG_FILTER_NOT, 0, 0, 0, 0);
+		return true;
+	}
+	return parse_primary(ps);
+}
+
+/* ( expr ), field op value, field [NOT] IN ( value [, ...] ) */
+static bool
+parse_primary(PgLogFilterParser *ps)
+{
+	int			field;
+	bool		negate = false;
+	bool		first = true;
+
+	if (ps->token == TOK_ERROR)
+		return false;
+
+	if (ps->token == TOK_LPAREN)
+	{
+		next_token(ps);
+		if (!parse_or(ps))
+			return false;
+		if (ps->token != TOK_RPAREN)
+		{
+			ps->error = "Missing closing parenthesis.";
+			return false;
+		}
+		next_token(ps);
+		return true;
+	}
+
+	if (ps->token != TOK_IDENT)
+	{
+		ps->error = "Field name expected.";
+		return false;
+	}
+	for (field = 0; field < lengthof(field_names); field++)
+		if (strcmp(ps->token_text.data, field_names[field]) == 0)
+			break;
+	if (field == lengthof(field_names))
+	{
+		ps->error = "Unknown field; valid fields are severity, sqlstate, database, user, application and message.";
+		return false;
+	}
+	next_token(ps);
+
+	if (ps->token == TOK_OP)
+	{
+		PgLogFilterCmp cmp = ps->token_cmp;
+
+		next_token(ps);
+		return parse_value(ps, field, cmp);
+	}
+
+	/* IN list, compiled as a series of ORs */
+	if (is_keyword(ps, "not"))
+	{
+		negate = true;
+		next_token(ps);
+	}
+	if (!is_keyword(ps, "in"))
+	{
+		ps->error = "Comparison operator or IN expected.";
+		return false;
+	}
+	next_token(ps);
+	if (ps->token != TOK_LPAREN)
+	{
+		ps->error = "IN must be followed by a parenthesized list.";
+		return false;
+	}
+	do
+	{
+		next_token(ps);
+		if (!parse_value(ps, field, PGLOG_FILTER_EQ))
+			return false;
+		if (!first)
+			emit(ps, PGLOG_FILTER_OR, 0, 0, 0, 0);
+		first = false;
+	} while (ps->token == TOK_COMMA);
+	if (ps->token != TOK_RPAREN)
+	{
+		ps->error = "Missing closing parenthesis.";
+		return false;
+	}
+	next_token(ps);
+
+	if (negate)
+		emit(ps, PGLOG_FILTER_NOT, 0, 0, 0, 0);
+	return true;
+}
+
+/*
+ * Compile the comparison of field with the value of the current token
+ */
+static bool
+parse_value(PgLogFilterParser *ps, int field, int cmp)
+{
+	if (field == PGLOG_FILTER_SEVERITY)
+	{
+		char	   *label = ps->token_text.data;
+		int			severity;
+		int			i;
+
+		if ((ps->token != TOK_IDENT && ps->token != TOK_STRING) ||
+			cmp == PGLOG_FILTER_PREFIX)
+		{
+			ps->error = "Severities can only be compared with =, <>, <, <=, > and >= to a severity name.";
+			return false;
+		}
+
+		for (i = 0; label[i] != '\0'; i++)
+			label[i] = pg_toupper((unsigned char) label[i]);
+		severity = pglog_severity_index(label);
+		if (strcmp(pglog_severity_labels[severity], label) != 0)
+		{
+			ps->error = "Unknown severity.";
+			return false;
+		}
+
+		emit(ps, PGLOG_FILTER_CMP, field, cmp, severity, 0);
+	}
+	else
+	{
+		if (ps->token != TOK_STRING)
+		{
+			ps->error = "Quoted string expected.";
+			return false;
+		}
+		if (cmp != PGLOG_FILTER_EQ && cmp != PGLOG_FILTER_NE &&
+			cmp != PGLOG_FILTER_PREFIX)
+		{
+			ps->error = "Strings can only be compared with =, <> and ^=.";
+			return false;
+		}
+
+		emit(ps, PGLOG_FILTER_CMP, field, cmp, ps->strings.len,
+			 ps->token_text.len);
+		appendBinaryStringInfo(&ps->strings, ps->token_text.data,
+							   ps->token_text.len + 1);
+	}
+
+	next_token(ps);
+	return true;
+}
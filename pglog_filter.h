@@ -0,0 +1,27 @@
+/*-------------------------------------------------------------------------
+ *
+ * pglog_filter.h
+ *		  Write-time filter expressions for pglog extension
+ *
+ * Copyright (c) 2014, 2ndQuadrant Ltd
+ *
+ * IDENTIFICATION
+ *		  pglog/pglog_filter.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGLOG_FILTER_H
+#define PGLOG_FILTER_H
+
+#include "postgres.h"
+
+/* GUC Variables */
+extern PGDLLIMPORT char *Pglog_filter;
+
+/* Initialization */
+extern void pglog_filter_init(void);
+
+/* Called by the write path for every event */
+extern bool pglog_filter_accept(ErrorData *edata);
+
+#endif
@@ -0,0 +1,354 @@
+/*-------------------------------------------------------------------------
+ *
+ * pglog_fingerprint.c
+ *		  Fingerprints of log messages for pglog extension
+ *
+ * Messages of the same kind differ only by the values embedded in them:
+ * quoted names and literals, numbers.  A fingerprint is a 64-bit FNV-1a hash
+ * of the message with those values replaced by placeholders, computed in a
+ * single pass and without allocating memory, so that it can be used from
+ * the write path.
+ *
+ * Statements are fingerprinted the same way, with constants replaced by
+ * placeholders, comments removed, whitespace collapsed and unquoted text
+ * folded to lower case, so that statements differing only by their
+ * constants or their layout share the same fingerprint.
+ *
+ * Copyright (c) 2014, 2ndQuadrant Ltd
+ *
+ * IDENTIFICATION
+ *		  pglog/pglog_fingerprint.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "pglog_fingerprint.h"
+
+#include <ctype.h>
+
+#include "fmgr.h"
+#include "utils/builtins.h"
+
+/* FNV-1a parameters for 64-bit hashes */
+#define FNV_OFFSET_BASIS	UINT64CONST(0xcbf29ce484222325)
+#define FNV_PRIME			UINT64CONST(0x100000001b3)
+
+/*
+ * Normalization state: running hash and optional normalized copy
+ */
+typedef struct pglogNormalizer
+{
+	uint64 hash; /* hash of the characters emitted so far */
+	char *out; /* normalized text, or NULL if not wanted */
+	int out_len; /* bytes of normalized text */
+	int out_size; /* size of out */
+	char last; /* last character emitted, '\0' if none */
+} PgLogNormalizer;
+
+static inline void
+emit(PgLogNormalizer *n, char c)
+{
+	n->hash = (n->hash ^ (unsigned char) c) * FNV_PRIME;
+	n->last = c;
+	if (n->out && n->out_len < n->out_size - 1)
+		n->out[n->out_len++] = c;
+}
+
+/* Can a literal start after character c? */
+#define IS_TOKEN_START(c)	(!isalnum((unsigned char) (c)) && (c) != '_')
+
+/* Can character c be part of an SQL identifier? */
+#define IS_IDENT_CHAR(c) \
+	(isalnum((unsigned char) (c)) || (c) == '_' || (c) == '$' || \
+	 IS_HIGHBIT_SET(c))
+
+/* Does character c of a normalized statement need spaces around it? */
+#define IS_WORD_CHAR(c) \
+	(IS_IDENT_CHAR(c) || (c) == '?' || (c) == '"' || (c) == '\'')
+
+/*
+ * SQL functions
+ */
+extern Datum pglog_message_fingerprint(PG_FUNCTION_ARGS);
+extern Datum pglog_query_fingerprint(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(pglog_message_fingerprint);
+PG_FUNCTION_INFO_V1(pglog_query_fingerprint);
+
+static const char *skip_quoted(const char *p, char quote, bool backslash);
+static const char *skip_dollar_quoted(const char *p);
+
+/*
+ * Fingerprint a message
+ *
+ * Double-quoted strings, single-quoted strings starting a word and numbers
+ * starting a word are replaced by '?'.  If normalized is not NULL, the
+ * normalized message is also copied there, truncated to normalized_len - 1
+ * bytes.
+ */
+uint64
+pglog_fingerprint_message(const char *message, char *normalized,
+						  int normalized_len)
+{
+	PgLogNormalizer n;
+	const char *p = message;
+
+	n.hash = FNV_OFFSET_BASIS;
+	n.out = normalized;
+	n.out_len = 0;
+	n.out_size = normalized_len;
+	n.last = '\0';
+
+	if (message == NULL)
+		p = "";
+
+	while (*p)
+	{
+		char		c = *p;
+		bool		token_start = (p == message || IS_TOKEN_START(p[-1]));
+
+		if (c == '"' || (c == '\'' && token_start))
+		{
+			const char *close = strchr(p + 1, c);
+
+			/* An unmatched quote is kept as it is */
+			if (close != NULL)
+			{
+				emit(&n, c);
+				emit(&n, '?');
+				emit(&n, c);
+				p = close + 1;
+				continue;
+			}
+		}
+		else if (isdigit((unsigned char) c) && token_start)
+		{
+			/* A dot is part of the number only if a digit follows it */
+			while (isdigit((unsigned char) *p) ||
+				   (*p == '.' && isdigit((unsigned char) p[1])))
+				p++;
+			emit(&n, '?');
+			continue;
+		}
+
+		emit(&n, c);
+		p++;
+	}
+
+	if (n.out)
+		n.out[n.out_len] = '\0';
+
+	return n.hash;
+}
+
+/*
+ * Return the position following the quoted string starting at p
+ *
+ * A doubled quote stands for itself; with backslash, backslashes escape the
+ * following character, as in E'' strings.  An unterminated string extends
+ * to the end of the text.
+ */
+static const char *
+skip_quoted(const char *p, char quote, bool backslash)
+{
+	p++;
+	while (*p)
+	{
+		if (backslash && *p == '\\' && p[1] != '\0')
+			p += 2;
+		else if (*p == quote && p[1] == quote)
+			p += 2;
+		else if (*p == quote)
+			return p + 1;
+		else
+			p++;
+	}
+	return p;
+}
+
+/*
+ * Return the position following the dollar-quoted string starting at p, or
+ * NULL if p does not start a dollar quote
+ */
+static const char *
+skip_dollar_quoted(const char *p)
+{
+	const char *tag_end = p + 1;
+	const char *close;
+	int			tag_len;
+
+	while (*tag_end && *tag_end != '$' &&
+		   (isalnum((unsigned char) *tag_end) || *tag_end == '_' ||
+			IS_HIGHBIT_SET(*tag_end)))
+		tag_end++;
+	if (*tag_end != '$' || isdigit((unsigned char) p[1]))
+		return NULL;
+
+	tag_len = tag_end - p + 1;
+	for (close = tag_end + 1; *close; close++)
+	{
+		if (*close == '$' && strncmp(close, p, tag_len) == 0)
+			return close + tag_len;
+	}
+	return close;
+}
+
+/*
+ * Fingerprint a statement
+ *
+ * String and numeric constants are replaced by '?' and comments are
+ * removed.  Whitespace is only kept, as a single space, between words, and
+ * everything but quoted identifiers is folded to lower case.  Parameter
+ * symbols such as $1 are kept.  If normalized is not NULL, the normalized
+ * statement is also copied there, truncated to normalized_len - 1 bytes.
+ */
+uint64
+pglog_fingerprint_query(const char *query, char *normalized,
+						int normalized_len)
+{
+	PgLogNormalizer n;
+	const char *p = query;
+	bool		pending_space = false;
+
+	n.hash = FNV_OFFSET_BASIS;
+	n.out = normalized;
+	n.out_len = 0;
+	n.out_size = normalized_len;
+	n.last = '\0';
+
+	if (query == NULL)
+		p = "";
+
+	while (*p)
+	{
+		char		c = *p;
+		bool		token_start = (p == query || !IS_IDENT_CHAR(p[-1]));
+
+		/* Whitespace and comments separate tokens */
+		if (isspace((unsigned char) c))
+		{
+			p++;
+			pending_space = true;
+			continue;
+		}
+		if (c == '-' && p[1] == '-')
+		{
+			while (*p && *p != '\n')
+				p++;
+			pending_space = true;
+			continue;
+		}
+		if (c == '/' && p[1] == '*')
+		{
+			int			depth = 1;
+
+			p += 2;
+			while (*p && depth > 0)
+			{
+				if (p[0] == '/' && p[1] == '*')
+				{
+					depth++;
+					p += 2;
+				}
+				else if (p[0] == '*' && p[1] == '/')
+				{
+					depth--;
+					p += 2;
+				}
+				else
+					p++;
+			}
+			pending_space = true;
+			continue;
+		}
+
+		/* Only words are kept apart, so that "a=1" is the same as "a = 1" */
+		if (pending_space && IS_WORD_CHAR(n.last) &&
+			(IS_WORD_CHAR(c) || c == '.'))
+			emit(&n, ' ');
+		pending_space = false;
+
+		if (c == '\'')
+		{
+			/* E'' strings, possibly written e'' */
+			bool		backslash = (p > query &&
+									 (p[-1] == 'E' || p[-1] == 'e') &&
+									 (p - 1 == query || !IS_IDENT_CHAR(p[-2])));
+
+			p = skip_quoted(p, '\'', backslash);
+			emit(&n, '?');
+		}
+		else if (c == '"')
+		{
+			/* Quoted identifiers are kept as they are */
+			const char *end = skip_quoted(p, '"', false);
+
+			while (p < end)
+				emit(&n, *p++);
+		}
+		else if (c == '$' && token_start && isdigit((unsigned char) p[1]))
+		{
+			/* Parameter symbol */
+			emit(&n, *p++);
+			while (isdigit((unsigned char) *p))
+				emit(&n, *p++);
+		}
+		else if (c == '$' && token_start && skip_dollar_quoted(p) != NULL)
+		{
+			p = skip_dollar_quoted(p);
+			emit(&n, '?');
+		}
+		else if (token_start &&
+				 (isdigit((unsigned char) c) ||
+				  (c == '.' && isdigit((unsigned char) p[1]))))
+		{
+			while (isdigit((unsigned char) *p) || *p == '.')
+				p++;
+			if ((*p == 'e' || *p == 'E') &&
+				(isdigit((unsigned char) p[1]) ||
+				 ((p[1] == '+' || p[1] == '-') &&
+				  isdigit((unsigned char) p[2]))))
+			{
+				p += 2;
+				while (isdigit((unsigned char) *p))
+					p++;
+			}
+			emit(&n, '?');
+		}
+		else
+		{
+			emit(&n, pg_ascii_tolower((unsigned char) c));
+			p++;
+		}
+	}
+
+	if (n.out)
+		n.out[n.out_len] = '\0';
+
+	return n.hash;
+}
+
+/*
+ * pglog_message_fingerprint
+ *		Fingerprint of a message, as stored in message_fingerprint
+ */
+Datum
+pglog_message_fingerprint(PG_FUNCTION_ARGS)
+{
+	char	   *message = text_to_cstring(PG_GETARG_TEXT_PP(0));
+
+	PG_RETURN_INT64((int64) pglog_fingerprint_message(message, NULL, 0));
+}
+
+/*
+ * pglog_query_fingerprint
+ *		Fingerprint of a statement, as stored in query_fingerprint
+ */
+Datum
+pglog_query_fingerprint(PG_FUNCTION_ARGS)
+{
+	char	   *query = text_to_cstring(PG_GETARG_TEXT_PP(0));
+
+	PG_RETURN_INT64((int64) pglog_fingerprint_query(query, NULL, 0));
+}
@@ -0,0 +1,23 @@
+/*-------------------------------------------------------------------------
+ *
+ * pglog_fingerprint.h
+ *		  Fingerprints of log messages for pglog extension
+ *
+ * Copyright (c) 2014, 2ndQuadrant Ltd
+ *
+ * IDENTIFICATION
+ *		  pglog/pglog_fingerprint.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGLOG_FINGERPRINT_H
+#define PGLOG_FINGERPRINT_H
+
+#include "postgres.h"
+
+extern uint64 pglog_fingerprint_message(const char *message,
+						  char *normalized, int normalized_len);
+extern uint64 pglog_fingerprint_query(const char *query,
+						char *normalized, int normalized_len);
+
+#endif
@@ -13,14 +13,79 @@
  */
 
 #include "pglog_helpers.h"
+#include "pglog_cache.h"
+#include "pglog_mover.h"
+#include "pglog_progress.h"
+#include "pglog_syncscan.h"
+#include "pglog_spool.h"
 
+#include <ctype.h>
+#include <unistd.h>
 #include <sys/stat.h>
 
 #include "utils/rel.h"
 #include "access/sysattr.h"
+#include "catalog/pg_type.h"
+#include "commands/dbcommands.h"
+#include "commands/defrem.h"
+#include "foreign/foreign.h"
+#include "executor/executor.h"
+#include "miscadmin.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/clauses.h"
+#include "access/hash.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/datetime.h"
 #include "postmaster/syslogger.h"
 #include "dirent.h"
 #include "storage/fd.h"
+#include "utils/lsyscache.h"
+
+/*
+ * Comparisons of log_time used to restrict the segments read
+ */
+typedef enum PgLogTimeOp
+{
+	PGLOG_TIME_LT,
+	PGLOG_TIME_LE,
+	PGLOG_TIME_EQ,
+	PGLOG_TIME_GE,
+	PGLOG_TIME_GT
+} PgLogTimeOp;
+
+static const char *const time_op_names[] = {"<", "<=", "=", ">=", ">"};
+
+/*
+ * A segment of a spool directory, and the start of its rotation period
+ */
+typedef struct pglogSegment
+{
+	char *name; /* file name, without the directory */
+	bool has_start; /* is the name a spool segment name? */
+	TimestampTz start; /* start of its rotation period */
+} PgLogSegment;
+
+/*
+ * A file a scan opened, to find the rows of segments moved out of the fast
+ * tier while it runs
+ */
+typedef struct pglogOpenedSegment
+{
+	char *filename; /* file opened */
+	uint64 dev; /* its device */
+	uint64 ino; /* its inode */
+	off_t size; /* its size when opened */
+	bool closed; /* was its segment over then? */
+} PgLogOpenedSegment;
+
+/*
+ * How long after the start of the next segment records can still be
+ * written to a segment: the rotation time is checked before log_time is
+ * taken
+ */
+#define SEGMENT_END_SLACK_SECS 60
 
 /*
  * check_selective_binary_conversion
@@ -148,7 +213,8 @@ estimate_size(PlannerInfo *root, RelOptInfo *baserel,
 	 * Get size of the file.  It might not be there at plan time, though, in
 	 * which case we have to use a default estimate.
 	 */
-	if (stat(fdw_private->filenames[0], &stat_buf) < 0)
+	if (fdw_private->filenames == NIL ||
+		stat((const char *) linitial(fdw_private->filenames), &stat_buf) < 0)
 		stat_buf.st_size = 10 * BLCKSZ;
 
 	/*
@@ -242,97 +308,1492 @@ estimate_costs(PlannerInfo *root, RelOptInfo *baserel,
 }
 
 /*
- * Initialise the list of available log files within logging directory
+ * Values a restriction clause compares a column to
+ *
+ * Recognizes "column = constant" and "column = ANY (constant array)", and
+ * returns the name of the column and a list of the constants as strings.
+ */
+static bool
+equality_qual_values(Expr *clause, RelOptInfo *baserel, Oid foreigntableid,
+					 char **column, List **values)
+{
+	Node	   *left;
+	Node	   *right;
+	Oid			opno;
+	Var		   *var;
+	Const	   *con;
+	Oid			out_func;
+	bool		is_varlena;
+
+	if (IsA(clause, OpExpr) && list_length(((OpExpr *) clause)->args) == 2)
+	{
+		opno = ((OpExpr *) clause)->opno;
+		left = linitial(((OpExpr *) clause)->args);
+		right = lsecond(((OpExpr *) clause)->args);
+	}
+	else if (IsA(clause, ScalarArrayOpExpr) &&
+			 ((ScalarArrayOpExpr *) clause)->useOr)
+	{
+		opno = ((ScalarArrayOpExpr *) clause)->opno;
+		left = linitial(((ScalarArrayOpExpr *) clause)->args);
+		right = lsecond(((ScalarArrayOpExpr *) clause)->args);
+	}
+	else
+		return false;
+
+	if (left && IsA(left, RelabelType))
+		left = (Node *) ((RelabelType *) left)->arg;
+	if (right && IsA(right, RelabelType))
+		right = (Node *) ((RelabelType *) right)->arg;
+
+	/* Constants may be on either side of an operator */
+	if (IsA(clause, OpExpr) && IsA(right, Var) && IsA(left, Const))
+	{
+		Node	   *tmp = left;
+
+		left = right;
+		right = tmp;
+	}
+	if (!IsA(left, Var) || !IsA(right, Const))
+		return false;
+	var = (Var *) left;
+	con = (Const *) right;
+
+	if (var->varno != baserel->relid || var->varlevelsup != 0 ||
+		var->varattno <= 0 || con->constisnull ||
+		strcmp(get_opname(opno), "=") != 0)
+		return false;
+
+	*column = get_relid_attribute_name(foreigntableid, var->varattno);
+	*values = NIL;
+
+	if (IsA(clause, OpExpr))
+	{
+		getTypeOutputInfo(con->consttype, &out_func, &is_varlena);
+		*values = list_make1(makeString(OidOutputFunctionCall(out_func,
+															  con->constvalue)));
+	}
+	else
+	{
+		ArrayType  *array = DatumGetArrayTypeP(con->constvalue);
+		Oid			elemtype = ARR_ELEMTYPE(array);
+		int16		typlen;
+		bool		typbyval;
+		char		typalign;
+		Datum	   *elems;
+		bool	   *nulls;
+		int			nelems;
+		int			i;
+
+		get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+		deconstruct_array(array, elemtype, typlen, typbyval, typalign,
+						  &elems, &nulls, &nelems);
+		getTypeOutputInfo(elemtype, &out_func, &is_varlena);
+
+		/* NULL elements never compare equal */
+		for (i = 0; i < nelems; i++)
+			if (!nulls[i])
+				*values = lappend(*values,
+								  makeString(OidOutputFunctionCall(out_func,
+																   elems[i])));
+	}
+
+	return true;
+}
+
+/*
+ * Read the options of a pglog table
+ *
+ * Tables without options read the whole spool of pglog.directory, and of
+ * pglog.fast_directory if there is a fast tier.  Option values are checked
+ * by pglog_validator(), so only the checks that cannot be made there are
+ * done here.  A foreigntableid of InvalidOid gives the default options.
+ */
+void
+get_table_options(Oid foreigntableid, PgLogTableOptions *table)
+{
+	ListCell   *lc;
+
+	table->directories = NIL;
+	table->stream = NULL;
+	table->suffix = ".dat";
+	table->scope_database = NULL;
+	TIMESTAMP_NOBEGIN(table->since);
+	TIMESTAMP_NOEND(table->until);
+
+	if (OidIsValid(foreigntableid))
+	{
+		foreach(lc, GetForeignTable(foreigntableid)->options)
+		{
+			DefElem    *def = (DefElem *) lfirst(lc);
+
+			if (strcmp(def->defname, "directory") == 0)
+				table->directories = pglog_split_directories(defGetString(def));
+			else if (strcmp(def->defname, "stream") == 0)
+				table->stream = defGetString(def);
+			else if (strcmp(def->defname, "format") == 0)
+				table->suffix = (strcmp(defGetString(def), "csvlog") == 0) ?
+					".csv" : ".dat";
+			else if (strcmp(def->defname, "scope") == 0 &&
+					 strcmp(defGetString(def), "current_database") == 0)
+				table->scope_database = get_database_name(MyDatabaseId);
+			else if (strcmp(def->defname, "since") == 0)
+				table->since = parse_timestamptz_option(def);
+			else if (strcmp(def->defname, "until") == 0)
+				table->until = parse_timestamptz_option(def);
+		}
+	}
+
+	/* By default, the spool written by this server */
+	if (table->directories == NIL)
+	{
+		if (Pglog_directory && Pglog_spooling_enabled)
+			table->directories = pglog_split_directories(Pglog_directory);
+
+		/* Then the events not moved yet from the fast tier, if any */
+		if (table->directories != NIL && pglog_fast_tier_enabled())
+			table->directories = lappend(table->directories,
+										 pstrdup(Pglog_fast_directory));
+		if (table->directories == NIL)
+			ereport(ERROR,
+				(errcode(ERRCODE_FDW_INVALID_HANDLE),
+				errmsg("Cannot instantiate the 'pglog' extension handler"),
+				errhint("'pglog' requires you to set 'pglog.directory' to the path of a writable directory, or the table to have a 'directory' option")
+			));
+	}
+}
+
+/* Value of a since or until option */
+TimestampTz
+parse_timestamptz_option(DefElem *def)
+{
+	return DatumGetTimestampTz(DirectFunctionCall3(timestamptz_in,
+											CStringGetDatum(defGetString(def)),
+											ObjectIdGetDatum(InvalidOid),
+											Int32GetDatum(-1)));
+}
+
+/*
+ * Find the spool streams a scan can skip
+ *
+ * Equality restrictions on error_severity and database_name are turned
+ * into "severities" and "databases" options, listing the values the
+ * matching rows can have; the streams holding none of them are not read
+ * (see stream_wanted).  Only the first restriction on each column is used,
+ * which is enough for the streams read to hold all the matching rows.  A
+ * table scoped to the current database only reads the stream of that
+ * database.
+ */
+List *
+extract_stream_options(RelOptInfo *baserel, Oid foreigntableid,
+					   PgLogTableOptions *table)
+{
+	List	   *options = NIL;
+	List	   *severities = NIL;
+	List	   *databases = NIL;
+	ListCell   *lc;
+
+	if (table->scope_database != NULL)
+	{
+		databases = list_make1(makeString(table->scope_database));
+		options = lappend(options,
+						  makeDefElem("databases", (Node *) databases));
+	}
+
+	foreach(lc, baserel->baserestrictinfo)
+	{
+		RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+		char	   *column;
+		List	   *values;
+
+		if (!equality_qual_values(rinfo->clause, baserel, foreigntableid,
+								  &column, &values))
+			continue;
+
+		if (strcmp(column, "error_severity") == 0 && severities == NIL)
+		{
+			severities = values;
+			options = lappend(options,
+							  makeDefElem("severities", (Node *) values));
+		}
+		else if (strcmp(column, "database_name") == 0 && databases == NIL)
+		{
+			databases = values;
+			options = lappend(options,
+							  makeDefElem("databases", (Node *) values));
+		}
+	}
+
+	return options;
+}
+
+/*
+ * Find the restrictions on log_time that can restrict the segments read
+ *
+ * Clauses comparing log_time to an expression that can be computed when
+ * the scan begins (constants, parameters, stable functions such as now())
+ * are recognized.  The expressions are returned, to be evaluated by
+ * eval_time_window(), and the comparisons are returned in *ops.
+ */
+List *
+extract_time_clauses(RelOptInfo *baserel, Oid foreigntableid, List **ops)
+{
+	List	   *exprs = NIL;
+	ListCell   *lc;
+
+	*ops = NIL;
+
+	foreach(lc, baserel->baserestrictinfo)
+	{
+		RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+		OpExpr	   *clause = (OpExpr *) rinfo->clause;
+		Node	   *left;
+		Node	   *right;
+		bool		commuted = false;
+		char	   *opname;
+		int			op;
+
+		if (!IsA(clause, OpExpr) || list_length(clause->args) != 2)
+			continue;
+		left = linitial(clause->args);
+		right = lsecond(clause->args);
+
+		if (IsA(right, Var) && !IsA(left, Var))
+		{
+			Node	   *tmp = left;
+
+			left = right;
+			right = tmp;
+			commuted = true;
+		}
+		if (!IsA(left, Var) ||
+			((Var *) left)->varno != baserel->relid ||
+			((Var *) left)->varattno <= 0 ||
+			((Var *) left)->vartype != TIMESTAMPTZOID ||
+			exprType(right) != TIMESTAMPTZOID ||
+			contain_var_clause(right) ||
+			contain_volatile_functions(right) ||
+			contain_subplans(right) ||
+			strcmp(get_relid_attribute_name(foreigntableid,
+											((Var *) left)->varattno),
+				   "log_time") != 0)
+			continue;
+
+		opname = get_opname(clause->opno);
+		for (op = 0; op < lengthof(time_op_names); op++)
+			if (strcmp(opname, time_op_names[op]) == 0)
+				break;
+		if (op == lengthof(time_op_names))
+			continue;
+
+		/* "value < log_time" is "log_time > value" */
+		if (commuted)
+			op = PGLOG_TIME_GT - op;
+
+		exprs = lappend(exprs, copyObject(right));
+		*ops = lappend_int(*ops, op);
+	}
+
+	return exprs;
+}
+
+/*
+ * Text of the comparisons of log_time found by extract_time_clauses(), for
+ * EXPLAIN
+ *
+ * context is the deparse context of the plan node.
+ */
+List *
+deparse_time_clauses(List *exprs, List *ops, List *context)
+{
+	List	   *clauses = NIL;
+	ListCell   *lc;
+	ListCell   *lo;
+
+	forboth(lc, exprs, lo, ops)
+	{
+		StringInfoData buf;
+
+		initStringInfo(&buf);
+		appendStringInfo(&buf, "log_time %s %s",
+						 time_op_names[lfirst_int(lo)],
+						 deparse_expression((Node *) lfirst(lc), context,
+											false, false));
+		clauses = lappend(clauses, buf.data);
+	}
+
+	return clauses;
+}
+
+/*
+ * Compute the range of log_time a scan can return rows from
+ *
+ * The expressions found by extract_time_clauses() are evaluated, and
+ * combined with the since and until options of the table.
+ */
+void
+eval_time_window(List *exprstates, List *ops, ExprContext *econtext,
+				 TimestampTz since, TimestampTz until,
+				 PgLogTimeWindow *window)
+{
+	MemoryContext oldcontext;
+	ListCell   *lc;
+	ListCell   *lo;
+
+	window->lo = since;
+	window->hi = until;
+
+	oldcontext = MemoryContextSwitchTo(econtext->ecxt_per_tuple_memory);
+
+	forboth(lc, exprstates, lo, ops)
+	{
+		ExprState  *exprstate = (ExprState *) lfirst(lc);
+		TimestampTz value;
+		bool		isnull;
+
+		value = DatumGetTimestampTz(ExecEvalExpr(exprstate, econtext,
+												 &isnull, NULL));
+
+		/* Nothing compares to NULL: no row can be returned */
+		if (isnull)
+		{
+			TIMESTAMP_NOEND(window->lo);
+			TIMESTAMP_NOBEGIN(window->hi);
+			break;
+		}
+
+		switch (lfirst_int(lo))
+		{
+			case PGLOG_TIME_LT:
+			case PGLOG_TIME_LE:
+				if (value < window->hi)
+					window->hi = value;
+				break;
+			case PGLOG_TIME_EQ:
+				if (value < window->hi)
+					window->hi = value;
+				if (value > window->lo)
+					window->lo = value;
+				break;
+			case PGLOG_TIME_GE:
+			case PGLOG_TIME_GT:
+				if (value > window->lo)
+					window->lo = value;
+				break;
+		}
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+	ResetExprContext(econtext);
+}
+
+/* Is the string s in the list of String nodes values? */
+static bool
+string_in_list(const char *s, List *values)
+{
+	ListCell   *lc;
+
+	foreach(lc, values)
+		if (strcmp(strVal(lfirst(lc)), s) == 0)
+			return true;
+	return false;
+}
+
+/*
+ * Can a spool stream hold rows wanted by a scan with these options?
+ *
+ * Only the streams written by pglog_spool.c are considered: other
+ * subdirectories of the spool directory are never read.
+ */
+static bool
+stream_wanted(const char *stream, List *options)
+{
+	bool		errors = (strcmp(stream, PGLOG_STREAM_ERRORS) == 0);
+	char	   *database = pglog_stream_database(stream);
+	ListCell   *lc;
+
+	if (!errors && strcmp(stream, PGLOG_STREAM_EVENTS) != 0 && database == NULL)
+		return false;
+
+	foreach(lc, options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+		List	   *values = (List *) def->arg;
+		ListCell   *lv;
+
+		if (database == NULL && strcmp(def->defname, "severities") == 0)
+		{
+			bool		found = false;
+
+			/* ERROR, FATAL and PANIC events are routed to the errors stream */
+			foreach(lv, values)
+			{
+				const char *label = strVal(lfirst(lv));
+				bool		is_error = (strcmp(label, "ERROR") == 0 ||
+										strcmp(label, "FATAL") == 0 ||
+										strcmp(label, "PANIC") == 0);
+
+				if (is_error == errors)
+					found = true;
+			}
+			if (!found)
+				return false;
+		}
+		else if (database != NULL && strcmp(def->defname, "databases") == 0)
+		{
+			if (!string_in_list(database, values))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Start of the rotation period of a segment, from its name
+ *
+ * Segment names are made by pglog_spool_file_name() in log_timezone.
+ */
+static bool
+segment_start_time(const char *name, TimestampTz *start)
+{
+	struct pg_tm tm;
+	int			tz;
+	char		suffix[5];
+
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(name, "pglog-%4d-%2d-%2d_%2d%2d%2d%4s", &tm.tm_year,
+			   &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec,
+			   suffix) != 7 || strcmp(suffix, ".dat") != 0)
+		return false;
+
+	tz = DetermineTimeZoneOffset(&tm, log_timezone);
+	return tm2timestamp(&tm, 0, &tz, start) == 0;
+}
+
+/*
+ * Is a segment over?
+ *
+ * Segments of past rotation periods, past the slack during which
+ * records can still be written to them, do not change anymore, except
+ * when the mover merges them, which replaces the file.
+ */
+bool
+isClosedSegment(const char *filename)
+{
+	const char *name = strrchr(filename, '/');
+	TimestampTz start;
+
+	name = name ? name + 1 : filename;
+	if (!segment_start_time(name, &start))
+		return false;
+
+	return timestamptz_to_time_t(start) <
+		pglog_segment_start((pg_time_t) time(NULL) - SEGMENT_END_SLACK_SECS);
+}
+
+/* qsort comparator of segments, by start time */
+static int
+segment_cmp(const void *a, const void *b)
+{
+	const PgLogSegment *sa = (const PgLogSegment *) a;
+	const PgLogSegment *sb = (const PgLogSegment *) b;
+
+	if (sa->has_start != sb->has_start)
+		return sa->has_start ? 1 : -1;
+	if (!sa->has_start || sa->start == sb->start)
+		return strcmp(sa->name, sb->name);
+	return (sa->start < sb->start) ? -1 : 1;
+}
+
+/*
+ * Can the k-th of the sorted segments of a directory hold rows of window?
+ *
+ * A segment holds the rows of its rotation period, up to the start of the
+ * next segment plus the slack.  Segments whose name tells no period are
+ * always read, unless the window is empty.
+ */
+static bool
+segment_in_window(PgLogSegment *segments, int nsegments, int k,
+				  PgLogTimeWindow *window)
+{
+	if (window->lo > window->hi)
+		return false;
+	if (!segments[k].has_start)
+		return true;
+	if (segments[k].start > window->hi)
+		return false;
+	if (k + 1 < nsegments &&
+		TimestampTzPlusMilliseconds(segments[k + 1].start,
+									SEGMENT_END_SLACK_SECS * 1000) < window->lo)
+		return false;
+	return true;
+}
+
+/*
+ * Add the segments of a directory to the list of log files
  *
- * Results are returned as a char** value, dynamically created by the function
+ * Segments are added in time order.  With a window, segments that hold
+ * no row in it are skipped (see segment_in_window).
  */
-char **
-initLogFileNames(const char *path)
+static void
+addLogFileNames(const char *path, const char *suffix, List **filenames,
+				PgLogTimeWindow *window, PgLogSegmentPruning *pruning)
 {
-	char **filenames;
+	PgLogSegment *segments;
+	int nsegments = 0;
+	int maxsegments = 16;
 	char *filename;
 	int dir_length;
 	int length;
-	int i;
+	int k;
 	DIR *dir;
 	struct dirent *de;
 
-	/* Initialises the file names structure */
-	filenames = (char **) palloc(sizeof(char *) * MAX_LOG_FILES);
-	for (i = 0; i < MAX_LOG_FILES; ++i)
-		filenames[i] = 0;
-
-	elog(DEBUG1,"Spool directory: %s", path);
+	segments = (PgLogSegment *) palloc(maxsegments * sizeof(PgLogSegment));
 
 	/* Open log directory */
 	dir = AllocateDir(path);
-	dir_length = strlen(path) + 1; /* consider slash too */
-	i = 0;
 	while ((de = ReadDir(dir, path)) != NULL)
 	{
 		elog(DEBUG1,"Found directory entry: %s", de->d_name);
-		/* Look for dat files */
+		/* Look for dat files, or csv files of csvlog */
 		length = strlen(de->d_name);
-		if (length > 4 && (strcmp(de->d_name + (length - 4), ".dat") == 0))
+		if (length > 4 && (strcmp(de->d_name + (length - 4), suffix) == 0))
 		{
-			elog(DEBUG1,"Found DAT log file: %s", de->d_name);
-			/* Allocate the file name */
-			length += dir_length + 1;
-			filename = (char *) palloc(length * sizeof(char));
-			snprintf (filename, length, "%s/%s", path, de->d_name);
-			/* Insert the file in the final array */
-			filenames[i++] = filename;
+			elog(DEBUG1,"Found log file: %s", de->d_name);
+			if (nsegments == maxsegments)
+			{
+				maxsegments *= 2;
+				segments = (PgLogSegment *)
+					repalloc(segments, maxsegments * sizeof(PgLogSegment));
+			}
+			segments[nsegments].name = pstrdup(de->d_name);
+			segments[nsegments].has_start =
+				segment_start_time(de->d_name, &segments[nsegments].start);
+			nsegments++;
 		}
-
-		/* Maximum number of allowed log files reached */
-		if (i == MAX_LOG_FILES)
-			break;
 	}
 	FreeDir(dir);
 
-	/* TODO: sorting of entries based on time? */
+	qsort(segments, nsegments, sizeof(PgLogSegment), segment_cmp);
 
-	return filenames;
+	dir_length = strlen(path) + 1; /* consider slash too */
+	for (k = 0; k < nsegments; k++)
+	{
+		if (window && !segment_in_window(segments, nsegments, k, window))
+		{
+			if (pruning)
+				pruning->segments++;
+			continue;
+		}
 
+		/* Allocate the file name */
+		length = strlen(segments[k].name) + dir_length + 1;
+		filename = (char *) palloc(length * sizeof(char));
+		snprintf (filename, length, "%s/%s", path, segments[k].name);
+		/* Append the file to the final list */
+		*filenames = lappend(*filenames, filename);
+	}
 }
 
-/* Start to read the next log file */
-void
-BeginNextCopy(Relation rel, PgLogExecutionState *state)
+/*
+ * Add the segments of a spool directory to the list of log files
+ *
+ * Segments are looked for in the directory itself, then in the spool
+ * streams it contains that options do not rule out, or only in the stream
+ * of the table if it has one.
+ */
+static void
+addSpoolFileNames(const char *path, PgLogTableOptions *table, List *options,
+				  List **filenames, PgLogTimeWindow *window,
+				  PgLogSegmentPruning *pruning)
 {
-	MemoryContext oldcontext;
-	oldcontext = MemoryContextSwitchTo(state->scan_cxt);
+	char stream_path[MAXPGPATH];
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+
+	elog(DEBUG1,"Spool directory: %s", path);
 
-	if (state->cstate) {
-		EndCopyFrom(state->cstate);
+	/* A table reading a single stream */
+	if (table->stream != NULL)
+	{
+		snprintf(stream_path, MAXPGPATH, "%s/%s", path, table->stream);
+		if (stat(stream_path, &st) == 0 && S_ISDIR(st.st_mode))
+			addLogFileNames(stream_path, table->suffix, filenames, window,
+							pruning);
+		return;
 	}
-	elog(DEBUG1,"Opening log file: %s", state->filenames[state->i]);
-	state->cstate = BeginCopyFrom(rel,
-		state->filenames[state->i],
-		false,
-		NIL,
-		state->options);
 
-	MemoryContextSwitchTo(oldcontext);
-}
+	addLogFileNames(path, table->suffix, filenames, window, pruning);
 
-/* Get the next log line */
-bool
-GetNextRow(Relation rel, PgLogExecutionState *state, TupleTableSlot* slot)
-{
-	return NextCopyFrom(state->cstate, NULL,
-		slot->tts_values, slot->tts_isnull,
-		NULL);
+	/* Then the streams */
+	dir = AllocateDir(path);
+	while ((de = ReadDir(dir, path)) != NULL)
+	{
+		if (de->d_name[0] == '.')
+			continue;
+		if (!stream_wanted(de->d_name, options))
+		{
+			/* Count the streams ruled out by options, not other entries */
+			if (pruning && stream_wanted(de->d_name, NIL))
+				pruning->streams++;
+			continue;
+		}
+
+		snprintf(stream_path, MAXPGPATH, "%s/%s", path, de->d_name);
+		if (stat(stream_path, &st) != 0 || !S_ISDIR(st.st_mode))
+			continue;
+
+		elog(DEBUG1,"Found spool stream: %s", de->d_name);
+		addLogFileNames(stream_path, table->suffix, filenames, window,
+						pruning);
+	}
+	FreeDir(dir);
 }
 
-/* Is the last log file to be read? */
-bool
+/*
+ * Initialise the list of available log files within logging directory
+ *
+ * The segments of all the directories of the table are listed, one
+ * directory after the other (see addSpoolFileNames).  Directories other
+ * than the first one that do not exist are skipped, as the writer only
+ * creates the directories of a striped spool as processes write to them.
+ * If window is not NULL, segments holding no row in it are skipped.  If
+ * pruning is not NULL, the segments and streams skipped are counted there.
+ *
+ * Results are returned as a List of file names, NIL if there is none
+ */
+List *
+initLogFileNames(PgLogTableOptions *table, List *options,
+				 PgLogTimeWindow *window, PgLogSegmentPruning *pruning)
+{
+	List *filenames = NIL;
+	ListCell *lc;
+	struct stat st;
+
+	if (pruning)
+		memset(pruning, 0, sizeof(PgLogSegmentPruning));
+
+	foreach(lc, table->directories)
+	{
+		const char *path = (const char *) lfirst(lc);
+
+		if (lc != list_head(table->directories) &&
+			(stat(path, &st) != 0 || !S_ISDIR(st.st_mode)))
+			continue;
+
+		addSpoolFileNames(path, table, options, &filenames, window, pruning);
+	}
+
+	return filenames;
+}
+
+/*
+ * Prepare the conversion of record fields to datums
+ *
+ * Looks up the input function of every column, and decides which columns
+ * have to be converted: all of them, unless the planner passed a
+ * convert_selectively option listing the ones actually used.
+ */
+void
+BeginRowDecoding(Relation rel, PgLogExecutionState *state)
+{
+	TupleDesc	tupDesc = RelationGetDescr(rel);
+	int			natts = tupDesc->natts;
+	List	   *columns = NIL;
+	bool		selective = false;
+	ListCell   *lc;
+	int			i;
+
+	foreach(lc, state->options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "convert_selectively") == 0)
+		{
+			columns = (List *) def->arg;
+			selective = true;
+		}
+	}
+
+	state->in_functions = (FmgrInfo *) palloc(natts * sizeof(FmgrInfo));
+	state->typioparams = (Oid *) palloc(natts * sizeof(Oid));
+	state->needed = (bool *) palloc0(natts * sizeof(bool));
+	state->nfields = 0;
+
+	/*
+	 * Rows of other databases are skipped if the table is scoped, and rows
+	 * out of its time bounds if it has some.
+	 */
+	get_table_options(RelationGetRelid(rel), &state->table);
+	memset(&state->time_cache, 0, sizeof(PgLogTimeCache));
+
+	/*
+	 * Nothing to convert at all, as in COUNT(*): records only need to be
+	 * counted, not split, unless they have to be checked as above.
+	 */
+	state->count_only = (selective && columns == NIL &&
+						 state->table.scope_database == NULL &&
+						 TIMESTAMP_IS_NOBEGIN(state->table.since) &&
+						 TIMESTAMP_IS_NOEND(state->table.until));
+	state->pending_rows = 0;
+
+	/*
+	 * Rows decoded by other scans of the table can be used, as long as the
+	 * columns and options of the table are the same.
+	 */
+	state->use_block_cache = !state->count_only && pglog_cache_enabled();
+	state->in_block = false;
+	if (state->use_block_cache)
+	{
+		StringInfoData definition;
+
+		initStringInfo(&definition);
+		for (i = 0; i < natts; i++)
+			appendStringInfo(&definition, "%u/%d/%d,",
+							 tupDesc->attrs[i]->atttypid,
+							 tupDesc->attrs[i]->atttypmod,
+							 (int) tupDesc->attrs[i]->attisdropped);
+		appendStringInfo(&definition, "%s/%s/" INT64_FORMAT "/" INT64_FORMAT,
+						 state->table.suffix,
+						 state->table.scope_database ?
+						 state->table.scope_database : "",
+						 (int64) state->table.since,
+						 (int64) state->table.until);
+
+		memset(&state->block_key, 0, sizeof(PgLogBlockKey));
+		state->block_key.dbid = MyDatabaseId;
+		state->block_key.relid = RelationGetRelid(rel);
+		state->block_key.definition =
+			DatumGetUInt32(hash_any((unsigned char *) definition.data,
+									definition.len));
+		pfree(definition.data);
+	}
+
+	for (i = 0; i < natts; i++)
+	{
+		Form_pg_attribute attr = tupDesc->attrs[i];
+		Oid			in_func_oid;
+
+		/* Dropped columns have no field in the spool records */
+		if (attr->attisdropped)
+			continue;
+		state->nfields++;
+
+		getTypeInputInfo(attr->atttypid, &in_func_oid, &state->typioparams[i]);
+		fmgr_info_cxt(in_func_oid, &state->in_functions[i], state->scan_cxt);
+
+		if (!selective)
+			state->needed[i] = true;
+		else
+		{
+			foreach(lc, columns)
+			{
+				if (strcmp(strVal(lfirst(lc)), NameStr(attr->attname)) == 0)
+				{
+					state->needed[i] = true;
+					break;
+				}
+			}
+		}
+	}
+}
+
+/*
+ * Find where the rows of a segment moved out of the fast tier went
+ *
+ * The mover merges a segment of the fast tier into the segment of the same
+ * name in one of the other directories, writing a new file with the rows of
+ * that segment first, and renaming it over it.  The fast tier is listed
+ * last, so that file was opened already, unless it did not exist: returns
+ * its name, and in *offset the size it had when opened, or 0 if it was not.
+ * While the new file is being renamed, the segment is found under its
+ * tombstone name instead, which is returned with an offset of 0.
+ *
+ * Errors out if the rows cannot be found, or if the file opened could still
+ * grow, as rows appended to it since would then be read twice.
+ */
+static char *
+FindMovedSegment(PgLogExecutionState *state, const char *filename,
+				 off_t *offset)
+{
+	const char *relative = filename + strlen(Pglog_fast_directory);
+	ListCell   *lc;
+
+	foreach(lc, state->table.directories)
+	{
+		const char *path = (const char *) lfirst(lc);
+		char		candidate[MAXPGPATH];
+		PgLogOpenedSegment *opened = NULL;
+		ListCell   *lc2;
+		struct stat st;
+
+		if (strcmp(path, Pglog_fast_directory) == 0)
+			continue;
+
+		snprintf(candidate, MAXPGPATH, "%s%s", path, relative);
+		if (stat(candidate, &st) != 0)
+			continue;
+
+		foreach(lc2, state->opened)
+		{
+			PgLogOpenedSegment *segment = (PgLogOpenedSegment *) lfirst(lc2);
+
+			if (strcmp(segment->filename, candidate) == 0)
+				opened = segment;
+		}
+
+		/* Not replaced since opened: the segment was merged elsewhere */
+		if (opened != NULL && opened->dev == (uint64) st.st_dev &&
+			opened->ino == (uint64) st.st_ino)
+			continue;
+
+		if (opened != NULL && !opened->closed)
+			break;
+
+		*offset = opened ? opened->size : 0;
+		return pstrdup(candidate);
+	}
+
+	/* Not merged yet, unless a file opened could still grow */
+	if (lc == NULL)
+	{
+		char		tombstone[MAXPGPATH];
+
+		snprintf(tombstone, MAXPGPATH, "%s%s", filename, PGLOG_MOVED_SUFFIX);
+		if (access(tombstone, F_OK) == 0)
+		{
+			*offset = 0;
+			return pstrdup(tombstone);
+		}
+	}
+
+	ereport(ERROR,
+			(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+			 errmsg("log file \"%s\" was moved during the scan", filename),
+			 errhint("Run the query again.")));
+	return NULL;				/* keep compiler quiet */
+}
+
+/*
+ * Start to read the next log file
+ *
+ * The reader of the previous file, and anything else allocated while reading
+ * it, lives in segment_cxt, which is emptied before the next file is opened.
+ * This keeps the memory used by a scan independent of the number of files
+ * being read.
+ */
+void
+BeginNextSegment(PgLogExecutionState *state)
+{
+	const char *filename;
+	off_t		moved_offset = -1;
+	int			fast_length;
+	PgLogOpenedSegment *opened;
+	MemoryContext oldcontext;
+	struct stat st;
+
+	EndSegment(state);
+
+	/* No log file at all: the scan returns no rows */
+	if (state->i >= list_length(state->filenames))
+		return;
+	filename = (const char *) list_nth(state->filenames, state->i);
+
+	/*
+	 * Segments removed since listed are skipped, except those moved out of
+	 * the fast tier, whose rows are read where they were moved to
+	 */
+	if (access(filename, F_OK) != 0 && errno == ENOENT)
+	{
+		elog(DEBUG1,"Log file gone: %s", filename);
+		fast_length = pglog_fast_tier_enabled() ?
+			strlen(Pglog_fast_directory) : 0;
+		if (fast_length == 0 ||
+			strncmp(filename, Pglog_fast_directory, fast_length) != 0 ||
+			filename[fast_length] != '/')
+			return;
+
+		oldcontext = MemoryContextSwitchTo(state->segment_cxt);
+		filename = FindMovedSegment(state, filename, &moved_offset);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	oldcontext = MemoryContextSwitchTo(state->segment_cxt);
+
+	elog(DEBUG1,"Opening log file: %s", filename);
+	state->reader = pglog_reader_open(filename,
+									  state->nfields,
+									  &state->stats);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* Segments are identified by device and inode */
+	if (fstat(state->reader->fd, &st) < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not stat file \"%s\": %m",
+						state->reader->filename)));
+	state->segment_dev = (uint64) st.st_dev;
+	state->segment_ino = (uint64) st.st_ino;
+	state->block_key.dev = state->segment_dev;
+	state->block_key.ino = state->segment_ino;
+
+	oldcontext = MemoryContextSwitchTo(state->scan_cxt);
+	opened = (PgLogOpenedSegment *) palloc(sizeof(PgLogOpenedSegment));
+	opened->filename = pstrdup(filename);
+	opened->dev = state->segment_dev;
+	opened->ino = state->segment_ino;
+	opened->size = st.st_size;
+	opened->closed = isClosedSegment(filename);
+	state->opened = lappend(state->opened, opened);
+	MemoryContextSwitchTo(oldcontext);
+
+	/* Only the rows of a moved segment are read, past those read before */
+	if (moved_offset >= 0)
+	{
+		state->sync_scan = false;
+		if (moved_offset > 0)
+			pglog_reader_seek(state->reader, moved_offset);
+		return;
+	}
+
+	/* Join the scans of the segment already running, if any */
+	state->sync_scan = pglog_syncscan_wanted(st.st_size) &&
+		pglog_syncscan_generation(state->reader->fd, &state->sync_generation);
+	state->sync_reported = 0;
+	if (state->sync_scan)
+	{
+		off_t		start = pglog_syncscan_start(state->reader->fd,
+												 state->segment_dev,
+												 state->segment_ino,
+												 state->sync_generation);
+
+		if (start > 0 && start < st.st_size)
+		{
+			pglog_reader_start_at(state->reader, start);
+			state->sync_reported = start;
+		}
+	}
+}
+
+/* Stop reading the current log file, if any, and free its resources */
+void
+EndSegment(PgLogExecutionState *state)
+{
+	if (state->reader)
+	{
+		pglog_reader_close(state->reader);
+		state->reader = NULL;
+	}
+	state->pending_rows = 0;
+	state->in_block = false;
+	MemoryContextReset(state->block_cxt);
+	MemoryContextResetAndDeleteChildren(state->segment_cxt);
+	MemoryContextReset(state->row_cxt);
+}
+
+/*
+ * Report the offset of the record a synchronized scan is at, every
+ * PGLOG_SYNCSCAN_REPORT_INTERVAL bytes
+ */
+static void
+ReportLocation(PgLogExecutionState *state, off_t offset)
+{
+	if (!state->sync_scan ||
+		(offset >= state->sync_reported &&
+		 offset - state->sync_reported < PGLOG_SYNCSCAN_REPORT_INTERVAL))
+		return;
+
+	pglog_syncscan_report(state->segment_dev, state->segment_ino,
+						  state->sync_generation, offset);
+	state->sync_reported = offset;
+}
+
+/*
+ * Report the progress of the scan, if shown in pglog_scan_progress, every
+ * PGLOG_PROGRESS_INTERVAL records read or rows returned
+ *
+ * Records read count even when turned down by RecordWanted(), so that
+ * scans returning few rows still show the bytes they read.
+ */
+void
+ReportProgress(PgLogExecutionState *state)
+{
+	uint64		records;
+
+	if (!state->report_progress)
+		return;
+
+	records = state->stats.rows_parsed + state->stats.rows_counted +
+		state->rows_emitted;
+	if (records - state->progress_records < PGLOG_PROGRESS_INTERVAL)
+		return;
+
+	pglog_progress_update(state->stats.bytes_read, state->rows_emitted);
+	state->progress_records = records;
+}
+
+/*
+ * Read the next record of the segment
+ *
+ * A synchronized scan reaching the end of the segment wraps around to read
+ * the records before the one it started at; a block being decoded is then
+ * abandoned.
+ */
+static bool
+NextRecord(PgLogExecutionState *state)
+{
+	PgLogReader *reader = state->reader;
+
+	if (!pglog_reader_next(reader))
+	{
+		if (!pglog_reader_wrap(reader))
+			return false;
+		state->in_block = false;
+		if (!pglog_reader_next(reader))
+			return false;
+	}
+
+	ReportLocation(state, reader->record_offset);
+	ReportProgress(state);
+	return true;
+}
+
+/*
+ * Get the next row of a scan needing no column
+ *
+ * Records are counted in batches, and every row is returned with all
+ * columns NULL.
+ */
+static bool
+GetNextEmptyRow(Relation rel, PgLogExecutionState *state, TupleTableSlot *slot)
+{
+	if (state->pending_rows == 0)
+	{
+		instr_time	start;
+		instr_time	end;
+
+		if (state->stats.collect_timing)
+			INSTR_TIME_SET_CURRENT(start);
+
+		state->pending_rows = pglog_reader_skip(state->reader,
+												COUNT_BATCH_SIZE);
+		if (state->pending_rows == 0 && pglog_reader_wrap(state->reader))
+			state->pending_rows = pglog_reader_skip(state->reader,
+													COUNT_BATCH_SIZE);
+
+		/* Between two records, the scan can report where it is */
+		if (!state->reader->skip_in_quote && state->reader->skip_pending == 0)
+			ReportLocation(state, state->reader->raw_offset +
+						   state->reader->raw_pos);
+		ReportProgress(state);
+
+		if (state->stats.collect_timing)
+		{
+			INSTR_TIME_SET_CURRENT(end);
+			INSTR_TIME_ACCUM_DIFF(state->stats.parse_time, end, start);
+		}
+
+		if (state->pending_rows == 0)
+			return false;
+	}
+
+	state->pending_rows--;
+	memset(slot->tts_isnull, true,
+		   RelationGetDescr(rel)->natts * sizeof(bool));
+
+	return true;
+}
+
+/*
+ * Does a record belong to the table scanned?
+ *
+ * Tables can be scoped to the current database, and bounded in time.
+ */
+static bool
+RecordWanted(PgLogExecutionState *state, PgLogReader *reader)
+{
+	const char *database = NULL;
+	const char *log_time = NULL;
+
+	if (reader->nfields > PGLOG_FIELD_DATABASE_NAME)
+		database = reader->fields[PGLOG_FIELD_DATABASE_NAME];
+	if (reader->nfields > PGLOG_FIELD_LOG_TIME)
+		log_time = reader->fields[PGLOG_FIELD_LOG_TIME];
+
+	if (state->table.scope_database != NULL &&
+		(database == NULL || strcmp(database, state->table.scope_database) != 0))
+		return false;
+
+	if (!TIMESTAMP_IS_NOBEGIN(state->table.since) ||
+		!TIMESTAMP_IS_NOEND(state->table.until))
+	{
+		TimestampTz ts;
+
+		if (log_time == NULL)
+			return false;
+		ts = parse_log_time(&state->time_cache, log_time);
+		if (ts < state->table.since || ts >= state->table.until)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Convert the fields of the current record to the datums of the slot
+ *
+ * Only the needed columns are converted, unless all is true.  Returns the
+ * memory taken by the datums.
+ */
+static Size
+ConvertRecord(Relation rel, PgLogExecutionState *state, TupleTableSlot *slot,
+			  bool all)
+{
+	TupleDesc	tupDesc = RelationGetDescr(rel);
+	PgLogReader *reader = state->reader;
+	Size		row_bytes = 0;
+	int			fieldno = 0;
+	int			i;
+
+	for (i = 0; i < tupDesc->natts; i++)
+	{
+		Form_pg_attribute attr = tupDesc->attrs[i];
+		char	   *field;
+
+		slot->tts_values[i] = (Datum) 0;
+		slot->tts_isnull[i] = true;
+
+		if (attr->attisdropped)
+			continue;
+
+		/* Fields added after csvlog are NULL in older segments */
+		if (fieldno >= reader->nfields && fieldno >= PGLOG_NUM_CSVLOG_FIELDS)
+			continue;
+		if (fieldno >= reader->nfields)
+			ereport(ERROR,
+					(errcode(ERRCODE_BAD_COPY_FILE_FORMAT),
+					 errmsg("missing data for column \"%s\"",
+							NameStr(attr->attname))));
+		field = reader->fields[fieldno++];
+
+		if (!(all || state->needed[i]) || field == NULL)
+			continue;
+
+		slot->tts_values[i] = InputFunctionCall(&state->in_functions[i],
+												field,
+												state->typioparams[i],
+												attr->atttypmod);
+		slot->tts_isnull[i] = false;
+
+		if (attr->attlen == -1)
+			row_bytes += VARSIZE_ANY(DatumGetPointer(slot->tts_values[i]));
+	}
+
+	return row_bytes;
+}
+
+/*
+ * Start a block with the record just read
+ *
+ * The rows of the block are taken from the block cache if found there;
+ * otherwise they are collected as they are decoded, to be stored there
+ * once the block is complete.
+ */
+static void
+StartBlock(PgLogExecutionState *state)
+{
+	PgLogReader *reader = state->reader;
+	MemoryContext oldcontext;
+	char	   *rows;
+
+	MemoryContextReset(state->block_cxt);
+	oldcontext = MemoryContextSwitchTo(state->block_cxt);
+
+	state->in_block = true;
+	state->block_key.offset = (uint64) reader->record_offset;
+	state->block_key.generation =
+		DatumGetUInt32(hash_any((unsigned char *) reader->record.data,
+								reader->record.len));
+
+	state->block_cached = pglog_cache_lookup(&state->block_key, &rows,
+											 &state->block_nrows,
+											 &state->block_end);
+
+	/* After wrapping around, the block must end where the scan started */
+	if (state->block_cached && reader->limit >= 0 &&
+		state->block_end > (uint64) reader->limit)
+	{
+		pfree(rows);
+		state->block_cached = false;
+	}
+
+	if (state->block_cached)
+	{
+		state->block_next = rows;
+		state->stats.cached_blocks++;
+	}
+	else
+	{
+		initStringInfo(&state->block_rows);
+		state->block_nrows = 0;
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Add the row in the slot to the block being decoded
+ *
+ * Rows are stored as MinimalTuples, each MAXALIGN'ed.  Once they outgrow a
+ * cache slot, the block is not collected any further, which block_nrows
+ * set to -1 records.
+ */
+static void
+AddBlockRow(Relation rel, PgLogExecutionState *state, TupleTableSlot *slot)
+{
+	MinimalTuple tuple;
+	int			len;
+
+	if (state->block_nrows < 0)
+		return;
+
+	tuple = heap_form_minimal_tuple(RelationGetDescr(rel),
+									slot->tts_values, slot->tts_isnull);
+	len = MAXALIGN(tuple->t_len);
+	if (state->block_rows.len + len > PGLOG_BLOCK_CACHE_SLOT_SIZE)
+		state->block_nrows = -1;
+	else
+	{
+		enlargeStringInfo(&state->block_rows, len);
+		memset(state->block_rows.data + state->block_rows.len, 0, len);
+		memcpy(state->block_rows.data + state->block_rows.len, tuple,
+			   tuple->t_len);
+		state->block_rows.len += len;
+		state->block_nrows++;
+	}
+	pfree(tuple);
+}
+
+/*
+ * Get the next row of a scan using the block cache
+ *
+ * Rows come either from a cached block, in which case the segment is read
+ * again from the record following it, or from the records of the segment,
+ * converting all the columns so that the rows can be cached.  A block ends
+ * before the first record starting past the PGLOG_BLOCK_SIZE boundary its
+ * first record is in, so that scans starting at different records, such
+ * as synchronized scans, end up on the same blocks.  A block is stored in
+ * the cache when the first record of the next one is read, so the last
+ * block of a segment, possibly still being written, never is.
+ */
+static Size
+GetNextBlockRow(Relation rel, PgLogExecutionState *state,
+				TupleTableSlot *slot, bool *found)
+{
+	PgLogReader *reader = state->reader;
+	Size		row_bytes;
+
+	for (;;)
+	{
+		if (state->in_block && state->block_cached)
+		{
+			if (state->block_nrows > 0)
+			{
+				MinimalTuple tuple = (MinimalTuple) state->block_next;
+				HeapTupleData htup;
+
+				htup.t_len = tuple->t_len + MINIMAL_TUPLE_OFFSET;
+				htup.t_data = (HeapTupleHeader) ((char *) tuple -
+												 MINIMAL_TUPLE_OFFSET);
+				heap_deform_tuple(&htup, RelationGetDescr(rel),
+								  slot->tts_values, slot->tts_isnull);
+				state->block_next += MAXALIGN(tuple->t_len);
+				state->block_nrows--;
+				*found = true;
+				return MAXALIGN(tuple->t_len);
+			}
+
+			/* End of the cached block */
+			pglog_reader_seek(reader, (off_t) state->block_end);
+			state->in_block = false;
+		}
+
+		if (!NextRecord(state))
+		{
+			*found = false;
+			return 0;
+		}
+
+		/* Store the block just completed, and look the next one up */
+		if (!state->in_block ||
+			(uint64) reader->record_offset / PGLOG_BLOCK_SIZE !=
+			state->block_key.offset / PGLOG_BLOCK_SIZE)
+		{
+			if (state->in_block && state->block_nrows >= 0)
+				pglog_cache_store(&state->block_key, state->block_rows.data,
+								  state->block_rows.len, state->block_nrows,
+								  (uint64) reader->record_offset);
+			StartBlock(state);
+			if (state->block_cached)
+				continue;
+		}
+
+		pglog_reader_split(reader, reader->max_fields);
+		state->stats.rows_parsed++;
+
+		if (!RecordWanted(state, reader))
+		{
+			state->stats.rows_rejected++;
+			continue;
+		}
+
+		*found = true;
+		row_bytes = ConvertRecord(rel, state, slot, true);
+		AddBlockRow(rel, state, slot);
+		return row_bytes;
+	}
+}
+
+/*
+ * Get the next log line
+ *
+ * The datums of the previous row are released first, so the values stored
+ * in the slot are only valid until the next call.
+ */
+bool
+GetNextRow(Relation rel, PgLogExecutionState *state, TupleTableSlot* slot)
+{
+	PgLogReader *reader = state->reader;
+	MemoryContext oldcontext;
+	instr_time	start;
+	instr_time	end;
+	Size		row_bytes = 0;
+	bool		found;
+
+	if (reader == NULL)
+		return false;
+
+	if (state->count_only)
+		return GetNextEmptyRow(rel, state, slot);
+
+	MemoryContextReset(state->row_cxt);
+
+	if (state->stats.collect_timing)
+		INSTR_TIME_SET_CURRENT(start);
+
+	oldcontext = MemoryContextSwitchTo(state->row_cxt);
+
+	if (state->use_block_cache)
+		row_bytes = GetNextBlockRow(rel, state, slot, &found);
+	else
+	{
+		for (;;)
+		{
+			found = NextRecord(state);
+			if (!found)
+				break;
+
+			pglog_reader_split(reader, reader->max_fields);
+			state->stats.rows_parsed++;
+
+			if (RecordWanted(state, reader))
+				break;
+			state->stats.rows_rejected++;
+		}
+
+		if (found)
+			row_bytes = ConvertRecord(rel, state, slot, false);
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (!found)
+		return false;
+
+	if (state->stats.collect_timing)
+	{
+		INSTR_TIME_SET_CURRENT(end);
+		INSTR_TIME_ACCUM_DIFF(state->stats.parse_time, end, start);
+	}
+
+	row_bytes += pglog_reader_memory(reader);
+	if (row_bytes > state->stats.peak_memory)
+		state->stats.peak_memory = row_bytes;
+
+	return true;
+}
+
+/*
+ * Convert a log_time field to a timestamp
+ */
+TimestampTz
+parse_log_time(PgLogTimeCache *cache, const char *str)
+{
+	int			len = strlen(str);
+	int			msec;
+
+	/* Same second as the cached value: only the milliseconds differ */
+	if (len == cache->len && len > 23 && str[19] == '.' &&
+		memcmp(str, cache->str, 19) == 0 &&
+		memcmp(str + 23, cache->str + 23, len - 23) == 0 &&
+		isdigit((unsigned char) str[20]) &&
+		isdigit((unsigned char) str[21]) &&
+		isdigit((unsigned char) str[22]))
+	{
+		msec = (str[20] - '0') * 100 + (str[21] - '0') * 10 + (str[22] - '0');
+#ifdef HAVE_INT64_TIMESTAMP
+		return cache->value + (msec - cache->msec) * INT64CONST(1000);
+#else
+		return cache->value + (msec - cache->msec) / 1000.0;
+#endif
+	}
+
+	cache->value = DatumGetTimestampTz(DirectFunctionCall3(timestamptz_in,
+											CStringGetDatum(str),
+											ObjectIdGetDatum(InvalidOid),
+											Int32GetDatum(-1)));
+
+	/* Remember it, if it has the expected layout */
+	cache->len = 0;
+	if (len > 23 && len < sizeof(cache->str) && str[19] == '.' &&
+		isdigit((unsigned char) str[20]) &&
+		isdigit((unsigned char) str[21]) &&
+		isdigit((unsigned char) str[22]))
+	{
+		memcpy(cache->str, str, len + 1);
+		cache->len = len;
+		cache->msec = (str[20] - '0') * 100 + (str[21] - '0') * 10 +
+			(str[22] - '0');
+	}
+
+	return cache->value;
+}
+
+/*
+ * Error context callback, to identify the record being read
+ */
+void
+ScanErrorCallback(void *arg)
+{
+	PgLogExecutionState *state = (PgLogExecutionState *) arg;
+
+	if (state->reader)
+		errcontext("pglog segment \"%s\", record at offset " INT64_FORMAT,
+				   state->reader->filename,
+				   (int64) state->reader->record_offset);
+}
+
+/* Is the last log file to be read? */
+bool
 isLastLogFile(PgLogExecutionState* state)
 {
 	elog(DEBUG1, "i: %d", state->i);
-	if (state->i < (MAX_LOG_FILES -1)
-		&& state->filenames[state->i + 1])
-			return false;
+	if (state->i + 1 < list_length(state->filenames))
+		return false;
 
 	return true;
 }
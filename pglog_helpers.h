@@ -16,25 +16,80 @@
 
 #include "postgres.h"
 
+#include "pglog_cache.h"
+#include "pglog_reader.h"
+
 #include "access/htup_details.h"
 #include "access/reloptions.h"
-#include "commands/copy.h"
+#include "fmgr.h"
+#include "nodes/execnodes.h"
 #include "optimizer/cost.h"
 #include "optimizer/pathnode.h"
 #include "optimizer/planmain.h"
 #include "optimizer/restrictinfo.h"
 #include "optimizer/var.h"
+#include "utils/timestamp.h"
+
+/* Number of records counted at once by scans needing no column */
+#define COUNT_BATCH_SIZE 1024
+
+/*
+ * Cache of the last log_time parsed
+ *
+ * Timestamps are written as "YYYY-MM-DD HH:MM:SS.mmm TZ", and consecutive
+ * records often fall in the same second; in that case only the milliseconds
+ * need parsing.
+ */
+typedef struct pglogTimeCache
+{
+	char str[64]; /* last string fully parsed */
+	int len; /* its length, 0 if the cache is empty */
+	int msec; /* its milliseconds */
+	TimestampTz value; /* its value */
+} PgLogTimeCache;
+
+/*
+ * Range of log_time a scan can return rows from, bounds included
+ *
+ * Used to skip whole segments, so it only needs to be conservative.
+ */
+typedef struct pglogTimeWindow
+{
+	TimestampTz lo; /* lower bound, DT_NOBEGIN if none */
+	TimestampTz hi; /* upper bound, DT_NOEND if none */
+} PgLogTimeWindow;
+
+/*
+ * Segments and streams skipped when listing the segments of a scan
+ */
+typedef struct pglogSegmentPruning
+{
+	int segments; /* segments out of the log_time window */
+	int streams; /* streams ruled out by severities or databases */
+} PgLogSegmentPruning;
 
-/* Maximum number of log files to be read */
-#define MAX_LOG_FILES 16
+/*
+ * Options of a pglog foreign table
+ */
+typedef struct pglogTableOptions
+{
+	List *directories; /* spool directories, striped by the writer */
+	char *stream; /* only stream read, NULL for all */
+	const char *suffix; /* suffix of the segments, ".csv" for csvlog */
+	char *scope_database; /* database of the rows returned, NULL for all */
+	TimestampTz since; /* first log_time returned, DT_NOBEGIN for all */
+	TimestampTz until; /* log_time returned are before, DT_NOEND for all */
+} PgLogTableOptions;
 
 /*
  * FDW-specific information for RelOptInfo.fdw_private.
  */
 typedef struct pglogPlanState
 {
-	char **filenames; /* log file names */
-	int i; /* log file index */
+	List *filenames; /* log file names */
+	PgLogSegmentPruning pruning; /* segments and streams skipped */
+	PgLogTableOptions table; /* options of the table */
+	List *stream_options; /* spool streams that can be skipped */
 	BlockNumber pages; /* estimate of file's physical size */
 	double ntuples; /* estimate of number of rows in file */
 } PgLogPlanState;
@@ -44,11 +99,46 @@ typedef struct pglogPlanState
  */
 typedef struct pglogExecutionState
 {
-	char **filenames; /* log file names */
+	List *filenames; /* log file names */
 	int i; /* log file index */
-	CopyState cstate; /* state of reading file */
-	List *options; /* options (mainly for COPY) */
+	List *opened; /* PgLogOpenedSegment of the files opened */
+	PgLogSegmentPruning pruning; /* segments and streams skipped */
+	PgLogReader *reader; /* state of reading file */
+	List *options; /* options (convert_selectively, severities, databases) */
+	List *time_exprs; /* ExprStates of the values log_time is compared to */
+	List *time_ops; /* comparisons of log_time to them */
+	int nfields; /* number of fields expected in a record */
+	FmgrInfo *in_functions; /* input functions of the columns */
+	Oid *typioparams; /* type I/O parameters of the columns */
+	bool *needed; /* columns to be converted to datums */
+	PgLogTableOptions table; /* options of the table */
+	PgLogTimeCache time_cache; /* last log_time parsed */
+	bool count_only; /* no column needed, only the number of rows */
+	int pending_rows; /* rows counted but not returned yet */
+	uint64 segment_dev; /* device of the segment being read */
+	uint64 segment_ino; /* inode of the segment being read */
+	bool sync_scan; /* is the scan of the segment synchronized? */
+	uint32 sync_generation; /* generation of the segment */
+	off_t sync_reported; /* last location reported for it */
+	bool use_block_cache; /* are rows shared through the block cache? */
+	bool in_block; /* is a block being read? */
+	PgLogBlockKey block_key; /* block being read */
+	bool block_cached; /* are its rows taken from the cache? */
+	StringInfoData block_rows; /* rows of the block, cached or to cache */
+	int block_nrows; /* number of rows in block_rows */
+	char *block_next; /* next cached row to return */
+	uint64 block_end; /* offset of the record following a cached block */
+	MemoryContext block_cxt; /* context for per-block data, reset on
+							  * block switch */
+	PgLogScanStats stats; /* counters for EXPLAIN ANALYZE */
+	uint64 rows_emitted; /* rows returned by the scan */
+	bool report_progress; /* is the scan shown in pglog_scan_progress? */
+	uint64 progress_records; /* records and rows at the last report */
 	MemoryContext scan_cxt; /* context for per-scan lifespan data */
+	MemoryContext segment_cxt; /* context for per-segment data, reset on
+								* segment switch */
+	MemoryContext row_cxt; /* context for per-row data, reset before
+							* reading each row */
 } PgLogExecutionState;
 
 /*
@@ -62,10 +152,27 @@ void estimate_size(PlannerInfo *root, RelOptInfo *baserel,
 void estimate_costs(PlannerInfo *root, RelOptInfo *baserel,
 			   PgLogPlanState *fdw_private,
 			   Cost *startup_cost, Cost *total_cost);
-char **initLogFileNames(const char *path);
+void get_table_options(Oid foreigntableid, PgLogTableOptions *table);
+TimestampTz parse_timestamptz_option(DefElem *def);
+List *extract_stream_options(RelOptInfo *baserel, Oid foreigntableid,
+					   PgLogTableOptions *table);
+List *extract_time_clauses(RelOptInfo *baserel, Oid foreigntableid,
+					 List **ops);
+void eval_time_window(List *exprstates, List *ops, ExprContext *econtext,
+				 TimestampTz since, TimestampTz until,
+				 PgLogTimeWindow *window);
+List *initLogFileNames(PgLogTableOptions *table, List *options,
+				 PgLogTimeWindow *window, PgLogSegmentPruning *pruning);
+List *deparse_time_clauses(List *exprs, List *ops, List *context);
+TimestampTz parse_log_time(PgLogTimeCache *cache, const char *str);
+bool isClosedSegment(const char *filename);
 
-void BeginNextCopy(Relation rel, PgLogExecutionState* state);
+void BeginRowDecoding(Relation rel, PgLogExecutionState *state);
+void BeginNextSegment(PgLogExecutionState *state);
+void EndSegment(PgLogExecutionState *state);
 bool isLastLogFile(PgLogExecutionState* state);
+void ReportProgress(PgLogExecutionState *state);
 bool GetNextRow(Relation rel, PgLogExecutionState *state, TupleTableSlot* slot);
+void ScanErrorCallback(void *arg);
 
 #endif
@@ -0,0 +1,591 @@
+/*-------------------------------------------------------------------------
+ *
+ * pglog_hll.c
+ *		  Per-minute distinct session and client estimates for pglog
+ *		  extension
+ *
+ * Along with the rollups, the sessions and the client hosts of the spooled
+ * events are registered, per minute and severity, in HyperLogLog sketches
+ * (Flajolet, Fusy, Gandouet and Meunier, 2007) of 2^PGLOG_HLL_BITS
+ * registers.  Sketches are merged by taking the maximum of each register,
+ * so the number of distinct sessions or clients over any range of minutes
+ * can be estimated, with a standard error of 1.04 / sqrt(2^PGLOG_HLL_BITS),
+ * without reading the spool.
+ *
+ * Once a minute is over its sketches are appended to a file stored next to
+ * the spool file of the same period (pglog-<period>.hll), one line per
+ * severity:
+ *
+ *		minute,severity,sessions,clients
+ *
+ * where a sketch is either the hexadecimal dump of its registers, or 's'
+ * followed by index (3 digits) and value (2 digits) of the non-zero
+ * registers when that is shorter.
+ *
+ * Copyright (c) 2014, 2ndQuadrant Ltd
+ *
+ * IDENTIFICATION
+ *		  pglog/pglog_hll.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "pglog_hll.h"
+#include "pglog_reader.h"
+#include "pglog_rollup.h"
+#include "pglog_spool.h"
+
+#include <math.h>
+#include <time.h>
+
+#include "access/hash.h"
+#include "access/htup_details.h"
+#include "funcapi.h"
+#include "libpq/libpq-be.h"
+#include "miscadmin.h"
+#include "storage/fd.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/int8.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+
+/* Number of index bits of the hash, and resulting number of registers */
+#define PGLOG_HLL_BITS 10
+#define PGLOG_HLL_REGISTERS (1 << PGLOG_HLL_BITS)
+
+/* Number of fields of a sketch file record */
+#define PGLOG_HLL_FIELDS 4
+
+/* Number of columns returned by pglog_distinct_estimates() */
+#define PGLOG_HLL_COLS 3
+
+/*
+ * A HyperLogLog sketch
+ */
+typedef struct pglogHll
+{
+	uint8 registers[PGLOG_HLL_REGISTERS]; /* maximum rank seen per index */
+} PgLogHll;
+
+/* What is counted */
+typedef enum PgLogHllDimension
+{
+	PGLOG_HLL_SESSIONS,
+	PGLOG_HLL_CLIENTS,
+	PGLOG_HLL_DIMENSIONS
+} PgLogHllDimension;
+
+/*
+ * Global shared state
+ */
+typedef struct pglogHllShared
+{
+	LWLockId lock; /* protects everything below */
+	pg_time_t current_minute; /* earlier minutes have been flushed */
+	bool used[PGLOG_NUM_SEVERITIES]; /* any event of the severity? */
+	PgLogHll sketches[PGLOG_NUM_SEVERITIES][PGLOG_HLL_DIMENSIONS];
+} PgLogHllShared;
+
+/* Links to shared memory state */
+static PgLogHllShared *hll_shared = NULL;
+
+/* Is this backend already updating the sketches? */
+static bool hll_busy = false;
+
+/*
+ * Sessions and clients are the same for all the events of a backend, so
+ * registering them again is useless: remember the severities already
+ * registered for the current minute.
+ */
+static pg_time_t registered_minute = 0;
+static uint32 registered_severities = 0;
+
+/*
+ * SQL functions
+ */
+extern Datum pglog_distinct_estimates(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(pglog_distinct_estimates);
+
+static void hll_add_hash(PgLogHll *hll, uint32 hash);
+static void hll_merge(PgLogHll *dst, const PgLogHll *src);
+static double hll_estimate(const PgLogHll *hll);
+static void encode_sketch(StringInfo buf, const PgLogHll *hll);
+static bool decode_sketch(const char *data, PgLogHll *hll);
+static bool flush_sketches(PgLogHllShared *expired);
+
+/*
+ * Shared memory needed for the sketches
+ */
+Size
+pglog_hll_shmem_size(void)
+{
+	return MAXALIGN(sizeof(PgLogHllShared));
+}
+
+/*
+ * Allocate or attach to the sketches
+ *
+ * Called from the shared memory startup hook, holding AddinShmemInitLock.
+ */
+void
+pglog_hll_shmem_startup(void)
+{
+	bool		found;
+
+	hll_shared = ShmemInitStruct("pglog hll",
+								 sizeof(PgLogHllShared),
+								 &found);
+	if (!found)
+	{
+		memset(hll_shared, 0, sizeof(PgLogHllShared));
+		hll_shared->lock = LWLockAssign();
+	}
+}
+
+/*
+ * Register the session and client of an event in the sketches of the
+ * current minute
+ *
+ * Sketches are maintained whenever rollups are.  An event of a minute
+ * already flushed is registered in the current minute.
+ */
+void
+pglog_hll_add(int elevel)
+{
+	pg_time_t	now;
+	pg_time_t	minute;
+	int			severity;
+	struct
+	{
+		pg_time_t	start_time;
+		int			pid;
+	}			session;
+	uint32		session_hash;
+	uint32		client_hash = 0;
+	bool		has_client = false;
+	PgLogHllShared *expired = NULL;
+
+	/* Safety check, and no recursion from errors reported below */
+	if (!Pglog_rollups || !hll_shared || MyProc == NULL || hll_busy)
+		return;
+
+	now = (pg_time_t) time(NULL);
+	minute = now - now % SECS_PER_MINUTE;
+	severity = pglog_severity_index(pglog_error_severity(elevel));
+
+	if (minute == registered_minute &&
+		(registered_severities & (1 << severity)) != 0)
+		return;
+
+	/* Same as the session_id column */
+	memset(&session, 0, sizeof(session));
+	session.start_time = MyStartTime;
+	session.pid = MyProcPid;
+	session_hash = DatumGetUInt32(hash_any((unsigned char *) &session,
+										   sizeof(session)));
+
+	if (MyProcPort && MyProcPort->remote_host)
+	{
+		client_hash = DatumGetUInt32(hash_any((unsigned char *) MyProcPort->remote_host,
+											  strlen(MyProcPort->remote_host)));
+		has_client = true;
+	}
+
+	hll_busy = true;
+
+	LWLockAcquire(hll_shared->lock, LW_EXCLUSIVE);
+
+	/* Sketches of the previous minute are written once the lock is released */
+	if (minute > hll_shared->current_minute)
+	{
+		expired = (PgLogHllShared *) palloc(sizeof(PgLogHllShared));
+		memcpy(expired, hll_shared, sizeof(PgLogHllShared));
+		memset(hll_shared->used, 0, sizeof(hll_shared->used));
+		memset(hll_shared->sketches, 0, sizeof(hll_shared->sketches));
+		hll_shared->current_minute = minute;
+	}
+
+	hll_add_hash(&hll_shared->sketches[severity][PGLOG_HLL_SESSIONS],
+				 session_hash);
+	if (has_client)
+		hll_add_hash(&hll_shared->sketches[severity][PGLOG_HLL_CLIENTS],
+					 client_hash);
+	hll_shared->used[severity] = true;
+
+	LWLockRelease(hll_shared->lock);
+
+	if (registered_minute != minute)
+	{
+		registered_minute = minute;
+		registered_severities = 0;
+	}
+	registered_severities |= 1 << severity;
+
+	if (expired)
+	{
+		if (!flush_sketches(expired))
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not write pglog sketch file: %m")));
+		pfree(expired);
+	}
+
+	hll_busy = false;
+}
+
+/*
+ * Append the sketches of a minute that is over to the sketch file
+ *
+ * expired is a copy of the shared state taken when the minute ended; the
+ * lock is not held, so that other backends do not wait for the write.
+ * The records are written with a single unbuffered write, which the append
+ * mode keeps whole.
+ */
+static bool
+flush_sketches(PgLogHllShared *expired)
+{
+	const char *directory = pglog_spool_primary_directory();
+	StringInfoData buf;
+	char	   *filename;
+	FILE	   *fh;
+	bool		ok = true;
+	int			severity;
+
+	initStringInfo(&buf);
+
+	for (severity = 0; severity < PGLOG_NUM_SEVERITIES; severity++)
+	{
+		if (!expired->used[severity])
+			continue;
+
+		appendStringInfo(&buf, INT64_FORMAT ",%s,",
+						 (int64) expired->current_minute,
+						 pglog_severity_labels[severity]);
+		encode_sketch(&buf, &expired->sketches[severity][PGLOG_HLL_SESSIONS]);
+		appendStringInfoChar(&buf, ',');
+		encode_sketch(&buf, &expired->sketches[severity][PGLOG_HLL_CLIENTS]);
+		appendStringInfoChar(&buf, '\n');
+	}
+
+	if (buf.len > 0)
+	{
+		filename = pglog_spool_file_name(directory,
+								pglog_segment_start(expired->current_minute),
+										 ".hll");
+		fh = pglog_spool_fopen(directory, filename);
+		pfree(filename);
+		if (fh == NULL)
+			ok = false;
+		else
+		{
+			int			save_errno = 0;
+
+			setvbuf(fh, NULL, _IONBF, 0);
+			if (fwrite(buf.data, 1, buf.len, fh) != buf.len)
+			{
+				save_errno = errno;
+				ok = false;
+			}
+			fclose(fh);
+			errno = save_errno;
+		}
+	}
+
+	pfree(buf.data);
+
+	return ok;
+}
+
+/*
+ * Register a hashed value in a sketch
+ *
+ * The first PGLOG_HLL_BITS bits of the hash select a register, which keeps
+ * the maximum position of the leftmost 1-bit in the remaining ones.
+ */
+static void
+hll_add_hash(PgLogHll *hll, uint32 hash)
+{
+	uint32		index = hash >> (32 - PGLOG_HLL_BITS);
+	uint32		rest = hash << PGLOG_HLL_BITS;
+	uint8		rank = 1;
+
+	while (rank <= 32 - PGLOG_HLL_BITS && (rest & 0x80000000) == 0)
+	{
+		rest <<= 1;
+		rank++;
+	}
+
+	if (hll->registers[index] < rank)
+		hll->registers[index] = rank;
+}
+
+/*
+ * Merge src into dst
+ */
+static void
+hll_merge(PgLogHll *dst, const PgLogHll *src)
+{
+	int			i;
+
+	for (i = 0; i < PGLOG_HLL_REGISTERS; i++)
+		if (dst->registers[i] < src->registers[i])
+			dst->registers[i] = src->registers[i];
+}
+
+/*
+ * Estimated number of distinct values registered in a sketch
+ *
+ * Uses linear counting for small cardinalities and the correction for
+ * 32-bit hash collisions for very large ones.
+ */
+static double
+hll_estimate(const PgLogHll *hll)
+{
+	double		m = PGLOG_HLL_REGISTERS;
+	double		alpha = 0.7213 / (1.0 + 1.079 / m);
+	double		sum = 0.0;
+	int			zeros = 0;
+	double		estimate;
+	int			i;
+
+	for (i = 0; i < PGLOG_HLL_REGISTERS; i++)
+	{
+		sum += ldexp(1.0, -hll->registers[i]);
+		if (hll->registers[i] == 0)
+			zeros++;
+	}
+
+	estimate = alpha * m * m / sum;
+
+	if (estimate <= 2.5 * m && zeros > 0)
+		estimate = m * log(m / zeros);
+	else if (estimate > 4294967296.0 / 30.0)
+		estimate = -4294967296.0 * log(1.0 - estimate / 4294967296.0);
+
+	return estimate;
+}
+
+/*
+ * Append the text form of a sketch to buf; nothing for an empty one
+ */
+static void
+encode_sketch(StringInfo buf, const PgLogHll *hll)
+{
+	int			nonzero = 0;
+	int			i;
+
+	for (i = 0; i < PGLOG_HLL_REGISTERS; i++)
+		if (hll->registers[i] != 0)
+			nonzero++;
+
+	if (nonzero == 0)
+		return;
+
+	if (1 + nonzero * 5 < PGLOG_HLL_REGISTERS * 2)
+	{
+		appendStringInfoChar(buf, 's');
+		for (i = 0; i < PGLOG_HLL_REGISTERS; i++)
+			if (hll->registers[i] != 0)
+				appendStringInfo(buf, "%03x%02x", i, hll->registers[i]);
+	}
+	else
+	{
+		for (i = 0; i < PGLOG_HLL_REGISTERS; i++)
+			appendStringInfo(buf, "%02x", hll->registers[i]);
+	}
+}
+
+/* Value of n hexadecimal digits, or -1 if not all of them are */
+static int
+hex_value(const char *data, int n)
+{
+	int			value = 0;
+
+	while (n-- > 0)
+	{
+		char		c = *data++;
+
+		value <<= 4;
+		if (c >= '0' && c <= '9')
+			value += c - '0';
+		else if (c >= 'a' && c <= 'f')
+			value += c - 'a' + 10;
+		else
+			return -1;
+	}
+
+	return value;
+}
+
+/*
+ * Merge the text form of a sketch into hll
+ *
+ * Returns false, leaving hll partially merged, if the text is malformed.
+ */
+static bool
+decode_sketch(const char *data, PgLogHll *hll)
+{
+	int			length = strlen(data);
+	int			i;
+
+	if (data[0] == 's')
+	{
+		if ((length - 1) % 5 != 0)
+			return false;
+		for (i = 1; i < length; i += 5)
+		{
+			int			index = hex_value(data + i, 3);
+			int			value = hex_value(data + i + 3, 2);
+
+			if (index < 0 || index >= PGLOG_HLL_REGISTERS || value < 0)
+				return false;
+			if (hll->registers[index] < value)
+				hll->registers[index] = value;
+		}
+	}
+	else
+	{
+		if (length != PGLOG_HLL_REGISTERS * 2)
+			return false;
+		for (i = 0; i < PGLOG_HLL_REGISTERS; i++)
+		{
+			int			value = hex_value(data + 2 * i, 2);
+
+			if (value < 0)
+				return false;
+			if (hll->registers[i] < value)
+				hll->registers[i] = value;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * pglog_distinct_estimates
+ *		Estimate the number of distinct sessions and clients having logged
+ *		an event of at least the given severity between since and until
+ *
+ * The sketches of every minute starting in the range are merged, from the
+ * sketch files and from shared memory.
+ */
+Datum
+pglog_distinct_estimates(PG_FUNCTION_ARGS)
+{
+	TimestampTz since = PG_GETARG_TIMESTAMPTZ(0);
+	TimestampTz until = PG_GETARG_TIMESTAMPTZ(1);
+	TupleDesc	tupdesc;
+	Datum		values[PGLOG_HLL_COLS];
+	bool		nulls[PGLOG_HLL_COLS];
+	PgLogHll	merged[PGLOG_HLL_DIMENSIONS];
+	PgLogScanStats stats;
+	MemoryContext oldcontext;
+	MemoryContext file_cxt;
+	Oid			out_func_oid;
+	bool		is_varlena;
+	const char *directory = pglog_spool_primary_directory();
+	int			min_severity;
+	DIR		   *dir;
+	struct dirent *de;
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	/* The severity is a pglog_severity value */
+	getTypeOutputInfo(get_fn_expr_argtype(fcinfo->flinfo, 2),
+					  &out_func_oid, &is_varlena);
+	min_severity = pglog_severity_index(OidOutputFunctionCall(out_func_oid,
+														PG_GETARG_DATUM(2)));
+
+	memset(merged, 0, sizeof(merged));
+
+	file_cxt = AllocSetContextCreate(CurrentMemoryContext,
+									 "pglog hll file",
+									 ALLOCSET_DEFAULT_MINSIZE,
+									 ALLOCSET_DEFAULT_INITSIZE,
+									 ALLOCSET_DEFAULT_MAXSIZE);
+	memset(&stats, 0, sizeof(PgLogScanStats));
+	oldcontext = MemoryContextSwitchTo(file_cxt);
+
+	/* Sketches already flushed to the sketch files */
+	dir = AllocateDir(directory);
+	while (dir != NULL && (de = ReadDir(dir, directory)) != NULL)
+	{
+		PgLogReader *reader;
+		char		filename[MAXPGPATH];
+		int			length = strlen(de->d_name);
+
+		if (length <= 4 || strcmp(de->d_name + length - 4, ".hll") != 0)
+			continue;
+		snprintf(filename, MAXPGPATH, "%s/%s", directory, de->d_name);
+
+		reader = pglog_reader_open(filename, PGLOG_HLL_FIELDS, &stats);
+		while (pglog_reader_next(reader))
+		{
+			int64		minute;
+			char	  **fields = reader->fields;
+
+			pglog_reader_split(reader, PGLOG_HLL_FIELDS);
+			if (reader->nfields < PGLOG_HLL_FIELDS || fields[0] == NULL ||
+				!scanint8(fields[0], true, &minute))
+				continue;
+
+			if (time_t_to_timestamptz((pg_time_t) minute) < since ||
+				time_t_to_timestamptz((pg_time_t) minute) >= until ||
+				pglog_severity_index(fields[1]) < min_severity)
+				continue;
+
+			if ((fields[2] && !decode_sketch(fields[2], &merged[PGLOG_HLL_SESSIONS])) ||
+				(fields[3] && !decode_sketch(fields[3], &merged[PGLOG_HLL_CLIENTS])))
+				ereport(WARNING,
+						(errcode(ERRCODE_DATA_CORRUPTED),
+						 errmsg("invalid sketch in pglog file \"%s\"",
+								filename)));
+		}
+		pglog_reader_close(reader);
+
+		MemoryContextReset(file_cxt);
+	}
+	if (dir != NULL)
+		FreeDir(dir);
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextDelete(file_cxt);
+
+	/* Sketches of the current minute */
+	if (hll_shared)
+	{
+		LWLockAcquire(hll_shared->lock, LW_SHARED);
+
+		if (time_t_to_timestamptz(hll_shared->current_minute) >= since &&
+			time_t_to_timestamptz(hll_shared->current_minute) < until)
+		{
+			int			severity;
+			int			d;
+
+			for (severity = min_severity; severity < PGLOG_NUM_SEVERITIES; severity++)
+			{
+				if (!hll_shared->used[severity])
+					continue;
+				for (d = 0; d < PGLOG_HLL_DIMENSIONS; d++)
+					hll_merge(&merged[d], &hll_shared->sketches[severity][d]);
+			}
+		}
+
+		LWLockRelease(hll_shared->lock);
+	}
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = Int64GetDatum((int64) rint(hll_estimate(&merged[PGLOG_HLL_SESSIONS])));
+	values[1] = Int64GetDatum((int64) rint(hll_estimate(&merged[PGLOG_HLL_CLIENTS])));
+	values[2] = Float8GetDatum(1.04 / sqrt((double) PGLOG_HLL_REGISTERS));
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
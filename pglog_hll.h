@@ -0,0 +1,26 @@
+/*-------------------------------------------------------------------------
+ *
+ * pglog_hll.h
+ *		  Per-minute distinct session and client estimates for pglog
+ *		  extension
+ *
+ * Copyright (c) 2014, 2ndQuadrant Ltd
+ *
+ * IDENTIFICATION
+ *		  pglog/pglog_hll.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGLOG_HLL_H
+#define PGLOG_HLL_H
+
+#include "postgres.h"
+
+/* Shared memory setup */
+extern Size pglog_hll_shmem_size(void);
+extern void pglog_hll_shmem_startup(void);
+
+/* Called by the write path for every spooled event */
+extern void pglog_hll_add(int elevel);
+
+#endif
@@ -0,0 +1,494 @@
+/*-------------------------------------------------------------------------
+ *
+ * pglog_mover.c
+ *		  Moving of fast tier segments to the spool for pglog extension
+ *
+ * When pglog.fast_directory is set, events less severe than
+ * pglog.persistent_min_messages are spooled there, typically on a tmpfs,
+ * with the same layout of streams as pglog.directory.  A background worker
+ * wakes up every PGLOG_MOVER_NAPTIME seconds and moves the segments of the
+ * fast tier whose rotation period is over, and that have not been written
+ * for PGLOG_MOVER_GRACE_SECS, to pglog.directory.  A moved segment is
+ * merged with the segment of the same name in pglog.directory, which holds
+ * the more severe events of the same period, into a new file synced and
+ * renamed over it.  The segment of the fast tier is renamed to a tombstone
+ * before that, and the tombstone removed after, so that a move interrupted
+ * by a crash of the worker is finished, or forgotten, when it starts again,
+ * rather than merging the segment twice (see recover_moves).
+ *
+ * Events still in the fast tier are lost on a crash of the host.  As the
+ * end of a segment is only known from its rotation period, the fast tier
+ * is not used when time-based rotation is disabled.
+ *
+ * The worker runs even without a fast tier: every PGLOG_MOVER_SWEEP_SECS,
+ * it writes the summaries of the dedup windows that are over, and of the
+ * events dropped by rate limits that stopped dropping, which backends only
+ * do when they spool an event.
+ *
+ * Copyright (c) 2014, 2ndQuadrant Ltd
+ *
+ * IDENTIFICATION
+ *		  pglog/pglog_mover.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "pglog_mover.h"
+#include "pglog_spool.h"
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "miscadmin.h"
+#include "postmaster/bgworker.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+
+/* Size of the chunks segments are copied by */
+#define PGLOG_MOVER_BUFSIZE 65536
+
+/* Has the mover been registered by the postmaster? */
+static bool mover_registered = false;
+
+/* Flags set by signal handlers */
+static volatile sig_atomic_t got_sighup = false;
+static volatile sig_atomic_t got_sigterm = false;
+
+static void pglog_mover_main(Datum main_arg);
+static void pglog_mover_sighup(SIGNAL_ARGS);
+static void pglog_mover_sigterm(SIGNAL_ARGS);
+static void move_directory(const char *path, const char *target,
+			   const char *current, pg_time_t now, bool streams);
+static bool move_segment(const char *path, const char *target,
+			 const char *name);
+static void recover_moves(void);
+static void finish_moves(const char *path, const char *relative,
+			 List *stripes, bool streams);
+static void remove_merged_files(const char *path, bool streams);
+static bool has_suffix(const char *name, const char *suffix);
+
+/*
+ * Register the mover
+ *
+ * Must be called while loading via shared_preload_libraries.
+ */
+void
+pglog_mover_register(void)
+{
+	BackgroundWorker worker;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_name = "pglog mover";
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+	worker.bgw_restart_time = PGLOG_MOVER_NAPTIME;
+	worker.bgw_main = pglog_mover_main;
+	worker.bgw_main_arg = (Datum) 0;
+	worker.bgw_sighup = pglog_mover_sighup;
+	worker.bgw_sigterm = pglog_mover_sigterm;
+
+	RegisterBackgroundWorker(&worker);
+	mover_registered = true;
+}
+
+/*
+ * Are low-severity events written to the fast tier?
+ *
+ * Only if the mover runs to move them to pglog.directory.
+ */
+bool
+pglog_fast_tier_enabled(void)
+{
+	return mover_registered && Pglog_fast_directory != NULL &&
+		Pglog_fast_directory[0] != '\0' && Pglog_RotationAge > 0;
+}
+
+static void
+pglog_mover_sighup(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sighup = true;
+	if (MyProc)
+		SetLatch(&MyProc->procLatch);
+
+	errno = save_errno;
+}
+
+static void
+pglog_mover_sigterm(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sigterm = true;
+	if (MyProc)
+		SetLatch(&MyProc->procLatch);
+
+	errno = save_errno;
+}
+
+/*
+ * Main loop of the mover
+ */
+static void
+pglog_mover_main(Datum main_arg)
+{
+	MemoryContext mover_cxt;
+	pg_time_t	next_move = 0;
+	bool		recovered = false;
+
+	BackgroundWorkerUnblockSignals();
+
+	mover_cxt = AllocSetContextCreate(TopMemoryContext,
+									  "pglog mover",
+									  ALLOCSET_DEFAULT_MINSIZE,
+									  ALLOCSET_DEFAULT_INITSIZE,
+									  ALLOCSET_DEFAULT_MAXSIZE);
+
+	while (!got_sigterm)
+	{
+		MemoryContext oldcontext;
+		pg_time_t	now;
+		char	   *current;
+		int			rc;
+
+		rc = WaitLatch(&MyProc->procLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   PGLOG_MOVER_SWEEP_SECS * 1000L);
+		ResetLatch(&MyProc->procLatch);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		if (got_sigterm || pglog_spool_directories() == NIL)
+			continue;
+
+		oldcontext = MemoryContextSwitchTo(mover_cxt);
+
+		pglog_spool_flush_summaries();
+
+		now = (pg_time_t) time(NULL);
+		if (pglog_fast_tier_enabled() && !recovered)
+		{
+			recover_moves();
+			recovered = true;
+		}
+
+		if (pglog_fast_tier_enabled() && now >= next_move)
+		{
+			/* Name of the segments still being written */
+			current = pglog_spool_file_name("", pglog_segment_start(now),
+											".dat");
+
+			move_directory(Pglog_fast_directory,
+						   pglog_spool_stripe_directory(),
+						   current + 1, now, true);
+			next_move = now + PGLOG_MOVER_NAPTIME;
+		}
+
+		MemoryContextSwitchTo(oldcontext);
+		MemoryContextReset(mover_cxt);
+	}
+
+	proc_exit(0);
+}
+
+/*
+ * Move the complete segments of a directory of the fast tier to target,
+ * and those of its streams if streams is true
+ */
+static void
+move_directory(const char *path, const char *target, const char *current,
+			   pg_time_t now, bool streams)
+{
+	DIR		   *dir;
+	struct dirent *de;
+
+	dir = AllocateDir(path);
+	while (dir != NULL && (de = ReadDir(dir, path)) != NULL)
+	{
+		char		filename[MAXPGPATH];
+		struct stat st;
+		int			length = strlen(de->d_name);
+
+		if (de->d_name[0] == '.')
+			continue;
+
+		snprintf(filename, MAXPGPATH, "%s/%s", path, de->d_name);
+		if (stat(filename, &st) != 0)
+			continue;
+
+		if (S_ISDIR(st.st_mode))
+		{
+			char		stream_target[MAXPGPATH];
+
+			if (!streams)
+				continue;
+			snprintf(stream_target, MAXPGPATH, "%s/%s", target, de->d_name);
+			move_directory(filename, stream_target, current, now, false);
+		}
+		else if (length > 4 && strcmp(de->d_name + length - 4, ".dat") == 0 &&
+				 strcmp(de->d_name, current) != 0 &&
+				 now - st.st_mtime >= PGLOG_MOVER_GRACE_SECS)
+		{
+			if (!move_segment(path, target, de->d_name))
+				break;
+		}
+	}
+	if (dir != NULL)
+		FreeDir(dir);
+}
+
+/*
+ * Merge a segment of the fast tier into the segment of the same name in
+ * target, and remove it
+ *
+ * Both are copied to a new file, which is synced and renamed over the
+ * target segment: existing segments are never truncated or rewritten in
+ * place, as scans may have them mapped (see pglog_reader.c).  The segment
+ * of the fast tier is renamed to a tombstone in between, telling that the
+ * new file is complete, and removed once the new file is in place.
+ * Returns false on failure, leaving both segments as they were.
+ */
+static bool
+move_segment(const char *path, const char *target, const char *name)
+{
+	char		source_name[MAXPGPATH];
+	char		target_name[MAXPGPATH];
+	char		temp_name[MAXPGPATH];
+	char		tomb_name[MAXPGPATH];
+	const char *inputs[2];
+	char	   *buf;
+	FILE	   *out;
+	int			i;
+	bool		ok = true;
+
+	snprintf(source_name, MAXPGPATH, "%s/%s", path, name);
+	snprintf(target_name, MAXPGPATH, "%s/%s", target, name);
+	snprintf(temp_name, MAXPGPATH, "%s%s", target_name, PGLOG_MOVING_SUFFIX);
+	snprintf(tomb_name, MAXPGPATH, "%s%s", source_name, PGLOG_MOVED_SUFFIX);
+
+	out = pglog_spool_fopen(target, temp_name);
+	if (out == NULL)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not open log file \"%s\": %m", temp_name)));
+		return false;
+	}
+	/* Leftover of an interrupted move */
+	if (ftruncate(fileno(out), 0) != 0)
+		ok = false;
+
+	/* The target segment, if it exists, then the fast one */
+	inputs[0] = target_name;
+	inputs[1] = source_name;
+	buf = palloc(PGLOG_MOVER_BUFSIZE);
+	for (i = 0; ok && i < lengthof(inputs); i++)
+	{
+		FILE	   *in;
+		size_t		nread;
+
+		in = AllocateFile(inputs[i], PG_BINARY_R);
+		if (in == NULL)
+		{
+			if (i == 0 && errno == ENOENT)
+				continue;
+			ok = false;
+			break;
+		}
+		while ((nread = fread(buf, 1, PGLOG_MOVER_BUFSIZE, in)) > 0)
+		{
+			if (fwrite(buf, 1, nread, out) != nread)
+			{
+				ok = false;
+				break;
+			}
+		}
+		if (ferror(in))
+			ok = false;
+		FreeFile(in);
+	}
+	pfree(buf);
+
+	if (ok && (fflush(out) != 0 || pg_fsync(fileno(out)) != 0))
+		ok = false;
+	if (fclose(out) != 0)
+		ok = false;
+	if (ok && rename(source_name, tomb_name) != 0)
+		ok = false;
+	if (ok && rename(temp_name, target_name) != 0)
+	{
+		(void) rename(tomb_name, source_name);
+		ok = false;
+	}
+
+	if (!ok)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not move log file \"%s\" to \"%s\": %m",
+						source_name, target_name)));
+		unlink(temp_name);
+		return false;
+	}
+
+	if (unlink(tomb_name) != 0)
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not remove file \"%s\": %m", tomb_name)));
+
+	return true;
+}
+
+/*
+ * Finish or forget the moves interrupted by a crash of the mover
+ *
+ * A tombstone left in the fast tier means that the new file of its move
+ * was complete: it is renamed over its target segment, unless that was
+ * done already, and the tombstone removed.  Any new file left then belongs
+ * to a move that did not get that far, and whose segment is still in the
+ * fast tier: it is removed, and the segment will be moved again.
+ */
+static void
+recover_moves(void)
+{
+	List	   *stripes = pglog_spool_directories();
+	ListCell   *lc;
+
+	finish_moves(Pglog_fast_directory, "", stripes, true);
+
+	foreach(lc, stripes)
+		remove_merged_files((const char *) lfirst(lc), true);
+}
+
+/*
+ * Finish the moves whose tombstones are in path, relative being the path
+ * of that directory under the fast tier, and those of its streams if
+ * streams is true
+ */
+static void
+finish_moves(const char *path, const char *relative, List *stripes,
+			 bool streams)
+{
+	DIR		   *dir;
+	struct dirent *de;
+
+	dir = AllocateDir(path);
+	while (dir != NULL && (de = ReadDir(dir, path)) != NULL)
+	{
+		char		filename[MAXPGPATH];
+		struct stat st;
+		ListCell   *lc;
+
+		if (de->d_name[0] == '.')
+			continue;
+
+		snprintf(filename, MAXPGPATH, "%s/%s", path, de->d_name);
+		if (stat(filename, &st) != 0)
+			continue;
+
+		if (S_ISDIR(st.st_mode))
+		{
+			char		stream_relative[MAXPGPATH];
+
+			if (!streams)
+				continue;
+			snprintf(stream_relative, MAXPGPATH, "%s/%s", relative,
+					 de->d_name);
+			finish_moves(filename, stream_relative, stripes, false);
+			continue;
+		}
+
+		if (!has_suffix(de->d_name, PGLOG_MOVED_SUFFIX))
+			continue;
+
+		foreach(lc, stripes)
+		{
+			char		target_name[MAXPGPATH];
+			char		temp_name[MAXPGPATH];
+
+			snprintf(target_name, MAXPGPATH, "%s%s/%.*s",
+					 (const char *) lfirst(lc), relative,
+					 (int) (strlen(de->d_name) - strlen(PGLOG_MOVED_SUFFIX)),
+					 de->d_name);
+			snprintf(temp_name, MAXPGPATH, "%s%s", target_name,
+					 PGLOG_MOVING_SUFFIX);
+			if (rename(temp_name, target_name) == 0)
+			{
+				ereport(LOG,
+						(errmsg("finished interrupted move of log file \"%s\"",
+								target_name)));
+				break;
+			}
+		}
+
+		if (unlink(filename) != 0)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not remove file \"%s\": %m", filename)));
+	}
+	if (dir != NULL)
+		FreeDir(dir);
+}
+
+/*
+ * Remove the new files of interrupted moves left in a directory of the
+ * spool, and in its streams if streams is true
+ */
+static void
+remove_merged_files(const char *path, bool streams)
+{
+	DIR		   *dir;
+	struct dirent *de;
+
+	dir = AllocateDir(path);
+	while (dir != NULL && (de = ReadDir(dir, path)) != NULL)
+	{
+		char		filename[MAXPGPATH];
+		struct stat st;
+
+		if (de->d_name[0] == '.')
+			continue;
+
+		snprintf(filename, MAXPGPATH, "%s/%s", path, de->d_name);
+		if (stat(filename, &st) != 0)
+			continue;
+
+		if (S_ISDIR(st.st_mode))
+		{
+			if (streams)
+				remove_merged_files(filename, false);
+		}
+		else if (has_suffix(de->d_name, PGLOG_MOVING_SUFFIX) &&
+				 unlink(filename) != 0)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not remove file \"%s\": %m", filename)));
+	}
+	if (dir != NULL)
+		FreeDir(dir);
+}
+
+/* Does name end with suffix? */
+static bool
+has_suffix(const char *name, const char *suffix)
+{
+	int			length = strlen(name);
+	int			suffix_length = strlen(suffix);
+
+	return length > suffix_length &&
+		strcmp(name + length - suffix_length, suffix) == 0;
+}
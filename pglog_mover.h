@@ -0,0 +1,41 @@
+/*-------------------------------------------------------------------------
+ *
+ * pglog_mover.h
+ *		  Moving of fast tier segments to the spool for pglog extension
+ *
+ * Copyright (c) 2014, 2ndQuadrant Ltd
+ *
+ * IDENTIFICATION
+ *		  pglog/pglog_mover.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGLOG_MOVER_H
+#define PGLOG_MOVER_H
+
+#include "postgres.h"
+
+/* Time between two passes of the mover, in seconds */
+#define PGLOG_MOVER_NAPTIME 10
+
+/* Time between two looks for summaries left to write, in seconds */
+#define PGLOG_MOVER_SWEEP_SECS 1
+
+/* Time a complete segment is left alone before being moved, in seconds */
+#define PGLOG_MOVER_GRACE_SECS 60
+
+/*
+ * Suffixes of the file a segment is merged into before being renamed over
+ * its target, and of the segment of the fast tier while it is renamed
+ */
+#define PGLOG_MOVING_SUFFIX ".moving"
+#define PGLOG_MOVED_SUFFIX ".moved"
+
+/* Registration of the mover background worker, which also writes the
+ * summaries of dedup windows and rate limits left by the last event */
+extern void pglog_mover_register(void);
+
+/* Are low-severity events written to the fast tier? */
+extern bool pglog_fast_tier_enabled(void);
+
+#endif
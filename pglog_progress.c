@@ -0,0 +1,416 @@
+/*-------------------------------------------------------------------------
+ *
+ * pglog_progress.c
+ *		  Progress reporting of pglog scans
+ *
+ * Every backend scanning the spool publishes how far it got in a slot of a
+ * shared array, keyed by pid.  Slots are written by their owner only, using
+ * a change counter so that readers never see a half-updated slot, like
+ * PgBackendStatus does.
+ *
+ * Copyright (c) 2014, 2ndQuadrant Ltd
+ *
+ * IDENTIFICATION
+ *		  pglog/pglog_progress.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "pglog_progress.h"
+
+#include <sys/stat.h>
+
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/barrier.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
+#include "utils/timestamp.h"
+
+/*
+ * Progress of a single scan
+ */
+typedef struct pglogProgressSlot
+{
+	int pid; /* scanning backend, 0 if the slot is free */
+	int changecount; /* odd while the slot is being updated */
+	Oid relid; /* foreign table being scanned */
+	TimestampTz start_time; /* when the scan started */
+	int segments_total; /* segments to be read */
+	int segments_done; /* segments completely read */
+	uint64 bytes_total; /* size of the segments at scan start */
+	uint64 bytes_done; /* bytes read so far */
+	uint64 rows_emitted; /* rows returned so far */
+	char current_segment[MAXPGPATH]; /* segment being read */
+} PgLogProgressSlot;
+
+typedef struct pglogProgressShared
+{
+	slock_t mutex; /* protects slot allocation */
+	int nslots; /* number of slots */
+	PgLogProgressSlot slots[FLEXIBLE_ARRAY_MEMBER];
+} PgLogProgressShared;
+
+/* Number of columns returned by pglog_get_scan_progress() */
+#define PGLOG_PROGRESS_COLS 9
+
+/* Links to shared memory state */
+static PgLogProgressShared *progress_shared = NULL;
+
+/* Slot of this backend, and is a scan reporting into it? */
+static volatile PgLogProgressSlot *my_slot = NULL;
+static bool my_slot_active = false;
+
+/* Subtransaction the reporting scan began in */
+static SubTransactionId my_slot_subid = InvalidSubTransactionId;
+
+/* Bytes read by the scan before its last rescan */
+static uint64 my_bytes_base = 0;
+
+/*
+ * SQL functions
+ */
+extern Datum pglog_get_scan_progress(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(pglog_get_scan_progress);
+
+static volatile PgLogProgressSlot *claim_slot(void);
+static void release_slot(int code, Datum arg);
+static void progress_xact_callback(XactEvent event, void *arg);
+static void progress_subxact_callback(SubXactEvent event,
+						  SubTransactionId mySubid,
+						  SubTransactionId parentSubid, void *arg);
+static void set_scan_totals(List *filenames);
+
+/* Begin and end an update of my_slot */
+#define BEGIN_SLOT_UPDATE() \
+	do { \
+		my_slot->changecount++; \
+		pg_write_barrier(); \
+	} while (0)
+#define END_SLOT_UPDATE() \
+	do { \
+		pg_write_barrier(); \
+		my_slot->changecount++; \
+	} while (0)
+
+/*
+ * Shared memory needed for progress reporting
+ *
+ * There is a slot for every client connection.  MaxBackends is not known yet
+ * when shared memory is requested.
+ */
+Size
+pglog_progress_shmem_size(void)
+{
+	return add_size(offsetof(PgLogProgressShared, slots),
+					mul_size(MaxConnections, sizeof(PgLogProgressSlot)));
+}
+
+/*
+ * Allocate or attach to the progress slots
+ *
+ * Called from the shared memory startup hook, holding AddinShmemInitLock.
+ */
+void
+pglog_progress_shmem_startup(void)
+{
+	bool		found;
+
+	progress_shared = ShmemInitStruct("pglog scan progress",
+									  pglog_progress_shmem_size(),
+									  &found);
+	if (!found)
+	{
+		SpinLockInit(&progress_shared->mutex);
+		progress_shared->nslots = MaxConnections;
+		memset(progress_shared->slots, 0,
+			   MaxConnections * sizeof(PgLogProgressSlot));
+	}
+}
+
+/*
+ * Find a free slot for this backend
+ *
+ * The slot is kept until the backend exits.  Returns NULL if all the slots
+ * are taken, in which case the scan simply is not reported.
+ */
+static volatile PgLogProgressSlot *
+claim_slot(void)
+{
+	volatile PgLogProgressShared *shared = progress_shared;
+	volatile PgLogProgressSlot *slot = NULL;
+	int			i;
+
+	SpinLockAcquire(&shared->mutex);
+	for (i = 0; i < shared->nslots; i++)
+	{
+		if (shared->slots[i].pid == 0)
+		{
+			slot = &shared->slots[i];
+			slot->pid = MyProcPid;
+			break;
+		}
+	}
+	SpinLockRelease(&shared->mutex);
+
+	if (slot)
+	{
+		on_shmem_exit(release_slot, 0);
+		RegisterXactCallback(progress_xact_callback, NULL);
+		RegisterSubXactCallback(progress_subxact_callback, NULL);
+	}
+
+	return slot;
+}
+
+/* Give the slot back at backend exit */
+static void
+release_slot(int code, Datum arg)
+{
+	volatile PgLogProgressShared *shared = progress_shared;
+
+	SpinLockAcquire(&shared->mutex);
+	my_slot->pid = 0;
+	SpinLockRelease(&shared->mutex);
+	my_slot = NULL;
+}
+
+/*
+ * Stop reporting a scan interrupted by an error, as EndForeignScan is not
+ * called in that case.
+ */
+static void
+progress_xact_callback(XactEvent event, void *arg)
+{
+	if (event == XACT_EVENT_ABORT && my_slot_active)
+		pglog_progress_end();
+}
+
+/*
+ * Same for a scan interrupted by an error caught in a subtransaction, such
+ * as a PL/pgSQL exception block: the rest of the transaction goes on.  The
+ * scan of a subtransaction that commits belongs to its parent from then
+ * on, and ends with it if it aborts.
+ */
+static void
+progress_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+						  SubTransactionId parentSubid, void *arg)
+{
+	if (!my_slot_active || my_slot_subid != mySubid)
+		return;
+
+	if (event == SUBXACT_EVENT_ABORT_SUB)
+		pglog_progress_end();
+	else if (event == SUBXACT_EVENT_COMMIT_SUB)
+		my_slot_subid = parentSubid;
+}
+
+/*
+ * Publish the segments a scan is about to read, and reset its counters
+ */
+static void
+set_scan_totals(List *filenames)
+{
+	uint64		bytes_total = 0;
+	ListCell   *lc;
+
+	foreach(lc, filenames)
+	{
+		struct stat stat_buf;
+
+		if (stat((const char *) lfirst(lc), &stat_buf) == 0)
+			bytes_total += stat_buf.st_size;
+	}
+
+	BEGIN_SLOT_UPDATE();
+	my_slot->segments_total = list_length(filenames);
+	my_slot->segments_done = 0;
+	my_slot->bytes_total = bytes_total;
+	my_slot->bytes_done = 0;
+	my_slot->rows_emitted = 0;
+	my_slot->current_segment[0] = '\0';
+	END_SLOT_UPDATE();
+}
+
+/*
+ * Start reporting a scan of the given files
+ *
+ * Only one scan per backend is reported; returns false if another scan is
+ * already reporting, or if progress reporting is not available.  Only the
+ * scan that got true is allowed to call the other reporting functions.
+ */
+bool
+pglog_progress_begin(Oid relid, List *filenames)
+{
+	if (progress_shared == NULL || my_slot_active)
+		return false;
+
+	if (my_slot == NULL)
+	{
+		my_slot = claim_slot();
+		if (my_slot == NULL)
+			return false;
+	}
+
+	BEGIN_SLOT_UPDATE();
+	my_slot->relid = relid;
+	my_slot->start_time = GetCurrentTimestamp();
+	END_SLOT_UPDATE();
+	set_scan_totals(filenames);
+
+	my_bytes_base = 0;
+	my_slot_subid = GetCurrentSubTransactionId();
+	my_slot_active = true;
+	return true;
+}
+
+/*
+ * Report that the scan starts over, possibly on other segments
+ *
+ * bytes_done is what the scan has read so far, which is not counted in the
+ * progress of the new pass.
+ */
+void
+pglog_progress_rescan(List *filenames, uint64 bytes_done)
+{
+	set_scan_totals(filenames);
+	my_bytes_base = bytes_done;
+}
+
+/*
+ * Report that the scan moved to a new segment, having read bytes_done
+ * (see pglog_progress_update)
+ */
+void
+pglog_progress_segment(const char *filename, int segments_done,
+					   uint64 bytes_done)
+{
+	BEGIN_SLOT_UPDATE();
+	my_slot->segments_done = segments_done;
+	my_slot->bytes_done = bytes_done - my_bytes_base;
+	strlcpy((char *) my_slot->current_segment, filename, MAXPGPATH);
+	END_SLOT_UPDATE();
+}
+
+/* Report bytes read and rows returned so far */
+void
+pglog_progress_update(uint64 bytes_done, uint64 rows_emitted)
+{
+	BEGIN_SLOT_UPDATE();
+	my_slot->bytes_done = bytes_done - my_bytes_base;
+	my_slot->rows_emitted = rows_emitted;
+	END_SLOT_UPDATE();
+}
+
+/* Stop reporting the current scan */
+void
+pglog_progress_end(void)
+{
+	BEGIN_SLOT_UPDATE();
+	my_slot->relid = InvalidOid;
+	END_SLOT_UPDATE();
+
+	my_slot_active = false;
+}
+
+/*
+ * pglog_get_scan_progress
+ *		Return the progress of every running pglog scan
+ */
+Datum
+pglog_get_scan_progress(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	int			i;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	if (!progress_shared)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pglog must be loaded via shared_preload_libraries")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	for (i = 0; i < progress_shared->nslots; i++)
+	{
+		volatile PgLogProgressSlot *slot = &progress_shared->slots[i];
+		PgLogProgressSlot local;
+		Datum		values[PGLOG_PROGRESS_COLS];
+		bool		nulls[PGLOG_PROGRESS_COLS];
+		int			j = 0;
+
+		/* Copy the slot, retrying until we get a consistent image */
+		for (;;)
+		{
+			int			before = slot->changecount;
+
+			pg_read_barrier();
+			memcpy(&local, (char *) slot, sizeof(PgLogProgressSlot));
+			pg_read_barrier();
+			if (before == slot->changecount && (before & 1) == 0)
+				break;
+
+			CHECK_FOR_INTERRUPTS();
+		}
+
+		if (local.pid == 0 || !OidIsValid(local.relid))
+			continue;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[j++] = Int32GetDatum(local.pid);
+		values[j++] = ObjectIdGetDatum(local.relid);
+		values[j++] = TimestampTzGetDatum(local.start_time);
+		if (local.current_segment[0] != '\0')
+			values[j++] = CStringGetTextDatum(local.current_segment);
+		else
+			nulls[j++] = true;
+		values[j++] = Int32GetDatum(local.segments_done);
+		values[j++] = Int32GetDatum(local.segments_total);
+		values[j++] = Int64GetDatumFast(local.bytes_done);
+		values[j++] = Int64GetDatumFast(local.bytes_total);
+		values[j++] = Int64GetDatumFast(local.rows_emitted);
+
+		Assert(j == PGLOG_PROGRESS_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
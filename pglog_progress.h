@@ -0,0 +1,35 @@
+/*-------------------------------------------------------------------------
+ *
+ * pglog_progress.h
+ *		  Progress reporting of pglog scans
+ *
+ * Copyright (c) 2014, 2ndQuadrant Ltd
+ *
+ * IDENTIFICATION
+ *		  pglog/pglog_progress.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGLOG_PROGRESS_H
+#define PGLOG_PROGRESS_H
+
+#include "postgres.h"
+
+#include "nodes/pg_list.h"
+
+/* Number of rows between two updates of the rows counter */
+#define PGLOG_PROGRESS_INTERVAL 1024
+
+/* Shared memory setup */
+extern Size pglog_progress_shmem_size(void);
+extern void pglog_progress_shmem_startup(void);
+
+/* Reporting, done by the scanning backend */
+extern bool pglog_progress_begin(Oid relid, List *filenames);
+extern void pglog_progress_rescan(List *filenames, uint64 bytes_done);
+extern void pglog_progress_segment(const char *filename, int segments_done,
+					   uint64 bytes_done);
+extern void pglog_progress_update(uint64 bytes_done, uint64 rows_emitted);
+extern void pglog_progress_end(void);
+
+#endif
@@ -0,0 +1,414 @@
+/*-------------------------------------------------------------------------
+ *
+ * pglog_ratelimit.c
+ *		  Per-database rate limiting of spooled events for pglog extension
+ *
+ * Each database has two token buckets in shared memory: one for WARNING
+ * and less severe events, refilled at pglog.warning_rate_limit tokens per
+ * second, and one for ERROR events, refilled at pglog.error_rate_limit
+ * tokens per second.  Both hold at most one second worth of tokens.  An
+ * event finding its bucket empty is dropped before being formatted, and
+ * only counted; the next event passing the same bucket writes a summary
+ * record of the events dropped meanwhile.  Should no event pass it, as when
+ * a storm simply stops, the mover collects the summary once no event was
+ * dropped for a second (see pglog_ratelimit_sweep).  LOG, FATAL and PANIC
+ * events are never throttled.
+ *
+ * Buckets are protected by their own spinlock, so that checking one only
+ * takes the shared lock of the hash table; the exclusive lock is only
+ * needed the first time a database is seen.
+ *
+ * Copyright (c) 2014, 2ndQuadrant Ltd
+ *
+ * IDENTIFICATION
+ *		  pglog/pglog_ratelimit.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "pglog_ratelimit.h"
+
+#include <sys/time.h>
+#include <time.h>
+
+#include "libpq/libpq-be.h"
+#include "miscadmin.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/timestamp.h"
+
+/* GUC Variables */
+int			Pglog_warning_rate_limit = 0;
+int			Pglog_error_rate_limit = 0;
+
+/* Maximum number of databases with their own buckets */
+#define PGLOG_RATELIMIT_MAX_DATABASES 256
+
+/* Classes of throttled events */
+typedef enum PgLogThrottleClass
+{
+	PGLOG_THROTTLE_WARNING,
+	PGLOG_THROTTLE_ERROR,
+	PGLOG_THROTTLE_CLASSES
+} PgLogThrottleClass;
+
+/*
+ * A token bucket, and the events it dropped since it last let one pass
+ */
+typedef struct pglogBucket
+{
+	slock_t mutex; /* protects the fields below */
+	double tokens; /* events that can be written right now */
+	int64 refill_time; /* time of the last refill, in microseconds */
+	int64 throttled; /* events dropped since the last one written */
+	pg_time_t first_time; /* time of the first dropped event */
+	int first_msec; /* milliseconds of first_time */
+	pg_time_t last_time; /* time of the last dropped event */
+	int last_msec; /* milliseconds of last_time */
+} PgLogBucket;
+
+typedef struct pglogRateLimitEntry
+{
+	NameData database; /* hash key of entry - MUST BE FIRST */
+	PgLogBucket buckets[PGLOG_THROTTLE_CLASSES]; /* one per class */
+} PgLogRateLimitEntry;
+
+/*
+ * Global shared state
+ */
+typedef struct pglogRateLimitShared
+{
+	LWLockId lock; /* protects hashtable search/modification */
+} PgLogRateLimitShared;
+
+/* Links to shared memory state */
+static PgLogRateLimitShared *ratelimit_shared = NULL;
+static HTAB *ratelimit_hash = NULL;
+
+/* Is this backend already checking an event? */
+static bool ratelimit_busy = false;
+
+/*
+ * Define the rate limit GUCs
+ */
+void
+pglog_ratelimit_init(void)
+{
+	DefineCustomIntVariable("pglog.warning_rate_limit",
+							"Sets the maximum number of WARNING and less severe events written per second and database.",
+							"Zero disables the limit.",
+							&Pglog_warning_rate_limit,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_NOT_IN_SAMPLE,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pglog.error_rate_limit",
+							"Sets the maximum number of ERROR events written per second and database.",
+							"Zero disables the limit.",
+							&Pglog_error_rate_limit,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_NOT_IN_SAMPLE,
+							NULL,
+							NULL,
+							NULL);
+}
+
+/*
+ * Shared memory needed for the buckets
+ */
+Size
+pglog_ratelimit_shmem_size(void)
+{
+	return add_size(MAXALIGN(sizeof(PgLogRateLimitShared)),
+					hash_estimate_size(PGLOG_RATELIMIT_MAX_DATABASES,
+									   sizeof(PgLogRateLimitEntry)));
+}
+
+/*
+ * Allocate or attach to the buckets
+ *
+ * Called from the shared memory startup hook, holding AddinShmemInitLock.
+ */
+void
+pglog_ratelimit_shmem_startup(void)
+{
+	bool		found;
+	HASHCTL		info;
+
+	ratelimit_shared = ShmemInitStruct("pglog ratelimit",
+									   sizeof(PgLogRateLimitShared),
+									   &found);
+	if (!found)
+		ratelimit_shared->lock = LWLockAssign();
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(NameData);
+	info.entrysize = sizeof(PgLogRateLimitEntry);
+	info.hash = tag_hash;
+	ratelimit_hash = ShmemInitHash("pglog ratelimit hash",
+								   PGLOG_RATELIMIT_MAX_DATABASES,
+								   PGLOG_RATELIMIT_MAX_DATABASES,
+								   &info,
+								   HASH_ELEM | HASH_FUNCTION);
+}
+
+/* Fill a summary of the events dropped by a bucket.  Caller holds its mutex */
+static void
+fill_summary(PgLogThrottleSummary *summary, NameData *database,
+			 PgLogThrottleClass class, volatile PgLogBucket *bucket)
+{
+	summary->database = *database;
+	summary->elevel = (class == PGLOG_THROTTLE_ERROR) ? ERROR : WARNING;
+	summary->limit = (class == PGLOG_THROTTLE_ERROR) ?
+		"pglog.error_rate_limit" : "pglog.warning_rate_limit";
+	summary->throttled = bucket->throttled;
+	summary->first_time = bucket->first_time;
+	summary->first_msec = bucket->first_msec;
+	summary->last_time = bucket->last_time;
+	summary->last_msec = bucket->last_msec;
+}
+
+/*
+ * Should an event be dropped by its rate limit?
+ *
+ * Returns true if the bucket of the event is empty, in which case the event
+ * has been counted and must not be written.  Otherwise, if events of the
+ * same bucket were dropped since the last one written, *has_summary is set
+ * and *summary describes them.
+ */
+bool
+pglog_ratelimit_check(int elevel, PgLogThrottleSummary *summary,
+					  bool *has_summary)
+{
+	PgLogThrottleClass class;
+	PgLogRateLimitEntry *entry;
+	volatile PgLogBucket *bucket;
+	NameData	database;
+	struct timeval tv;
+	int64		now;
+	int			rate;
+	bool		found;
+	bool		drop = false;
+
+	*has_summary = false;
+
+	if (elevel == LOG || elevel >= FATAL)
+		return false;
+	class = (elevel >= ERROR) ? PGLOG_THROTTLE_ERROR : PGLOG_THROTTLE_WARNING;
+	rate = (class == PGLOG_THROTTLE_ERROR) ?
+		Pglog_error_rate_limit : Pglog_warning_rate_limit;
+
+	/* Safety check, and no recursion from errors reported below */
+	if (rate <= 0 || !ratelimit_shared || MyProc == NULL || ratelimit_busy)
+		return false;
+
+	gettimeofday(&tv, NULL);
+	now = (int64) tv.tv_sec * USECS_PER_SEC + tv.tv_usec;
+
+	memset(&database, 0, sizeof(NameData));
+	if (MyProcPort && MyProcPort->database_name)
+		strlcpy(NameStr(database), MyProcPort->database_name, NAMEDATALEN);
+
+	ratelimit_busy = true;
+
+	/* Lookup the buckets using a shared lock */
+	LWLockAcquire(ratelimit_shared->lock, LW_SHARED);
+	entry = (PgLogRateLimitEntry *) hash_search(ratelimit_hash, &database,
+												HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		int			i;
+
+		/*
+		 * Need exclusive lock to make new buckets, full at first.  The table
+		 * is not allowed to grow past its size, which would take shared
+		 * memory other modules rely on.
+		 */
+		LWLockRelease(ratelimit_shared->lock);
+		LWLockAcquire(ratelimit_shared->lock, LW_EXCLUSIVE);
+
+		entry = (PgLogRateLimitEntry *) hash_search(ratelimit_hash, &database,
+													HASH_FIND, &found);
+		if (entry == NULL &&
+			hash_get_num_entries(ratelimit_hash) < PGLOG_RATELIMIT_MAX_DATABASES)
+			entry = (PgLogRateLimitEntry *) hash_search(ratelimit_hash,
+														&database,
+														HASH_ENTER_NULL,
+														&found);
+		if (entry != NULL && !found)
+		{
+			for (i = 0; i < PGLOG_THROTTLE_CLASSES; i++)
+			{
+				memset(&entry->buckets[i], 0, sizeof(PgLogBucket));
+				SpinLockInit(&entry->buckets[i].mutex);
+				entry->buckets[i].tokens = INT_MAX;
+				entry->buckets[i].refill_time = now;
+			}
+		}
+	}
+
+	/* Databases beyond PGLOG_RATELIMIT_MAX_DATABASES are not limited */
+	if (entry != NULL)
+	{
+		bucket = &entry->buckets[class];
+
+		SpinLockAcquire(&bucket->mutex);
+
+		if (now > bucket->refill_time)
+		{
+			bucket->tokens += (double) (now - bucket->refill_time) * rate /
+				USECS_PER_SEC;
+			bucket->refill_time = now;
+		}
+		if (bucket->tokens > rate)
+			bucket->tokens = rate;
+
+		if (bucket->tokens >= 1.0)
+		{
+			bucket->tokens -= 1.0;
+
+			if (bucket->throttled > 0)
+			{
+				fill_summary(summary, &database, class, bucket);
+				*has_summary = true;
+				bucket->throttled = 0;
+			}
+		}
+		else
+		{
+			if (bucket->throttled == 0)
+			{
+				bucket->first_time = (pg_time_t) tv.tv_sec;
+				bucket->first_msec = (int) (tv.tv_usec / 1000);
+			}
+			bucket->last_time = (pg_time_t) tv.tv_sec;
+			bucket->last_msec = (int) (tv.tv_usec / 1000);
+			bucket->throttled++;
+			drop = true;
+		}
+
+		SpinLockRelease(&bucket->mutex);
+	}
+
+	LWLockRelease(ratelimit_shared->lock);
+
+	ratelimit_busy = false;
+
+	return drop;
+}
+
+/*
+ * Collect the summaries of the buckets that dropped no event for a second
+ *
+ * Summaries are otherwise only written by the next event let through the
+ * same bucket; the mover calls this regularly so that the events dropped
+ * by a storm that stopped are summarized too.  Summaries are appended to
+ * *summaries, in the current memory context.
+ */
+void
+pglog_ratelimit_sweep(List **summaries)
+{
+	HASH_SEQ_STATUS hash_seq;
+	PgLogRateLimitEntry *entry;
+	PgLogThrottleSummary *summary = NULL;
+	pg_time_t	now = (pg_time_t) time(NULL);
+
+	if (!ratelimit_shared)
+		return;
+
+	LWLockAcquire(ratelimit_shared->lock, LW_SHARED);
+	hash_seq_init(&hash_seq, ratelimit_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		int			class;
+
+		for (class = 0; class < PGLOG_THROTTLE_CLASSES; class++)
+		{
+			volatile PgLogBucket *bucket = &entry->buckets[class];
+			bool		taken = false;
+
+			/* No palloc() under a spinlock: have a summary ready */
+			if (summary == NULL)
+				summary = (PgLogThrottleSummary *)
+					palloc(sizeof(PgLogThrottleSummary));
+
+			SpinLockAcquire(&bucket->mutex);
+			if (bucket->throttled > 0 && now - bucket->last_time >= 1)
+			{
+				fill_summary(summary, &entry->database, class, bucket);
+				bucket->throttled = 0;
+				taken = true;
+			}
+			SpinLockRelease(&bucket->mutex);
+
+			if (taken)
+			{
+				*summaries = lappend(*summaries, summary);
+				summary = NULL;
+			}
+		}
+	}
+	LWLockRelease(ratelimit_shared->lock);
+
+	if (summary != NULL)
+		pfree(summary);
+}
+
+/*
+ * Put back the summaries collected by pglog_ratelimit_sweep() that could
+ * not be written
+ *
+ * Their events are counted again in their bucket, to be summarized with
+ * those it dropped since.  Summaries of databases that no longer have a
+ * bucket are lost.
+ */
+void
+pglog_ratelimit_requeue(List *summaries)
+{
+	ListCell   *lc;
+
+	if (!ratelimit_shared || summaries == NIL)
+		return;
+
+	LWLockAcquire(ratelimit_shared->lock, LW_SHARED);
+	foreach(lc, summaries)
+	{
+		PgLogThrottleSummary *summary = (PgLogThrottleSummary *) lfirst(lc);
+		PgLogRateLimitEntry *entry;
+		volatile PgLogBucket *bucket;
+
+		entry = (PgLogRateLimitEntry *) hash_search(ratelimit_hash,
+													&summary->database,
+													HASH_FIND, NULL);
+		if (entry == NULL)
+			continue;
+		bucket = &entry->buckets[summary->elevel == ERROR ?
+								 PGLOG_THROTTLE_ERROR :
+								 PGLOG_THROTTLE_WARNING];
+
+		SpinLockAcquire(&bucket->mutex);
+		if (bucket->throttled == 0)
+		{
+			bucket->last_time = summary->last_time;
+			bucket->last_msec = summary->last_msec;
+		}
+		bucket->first_time = summary->first_time;
+		bucket->first_msec = summary->first_msec;
+		bucket->throttled += summary->throttled;
+		SpinLockRelease(&bucket->mutex);
+	}
+	LWLockRelease(ratelimit_shared->lock);
+}
@@ -0,0 +1,53 @@
+/*-------------------------------------------------------------------------
+ *
+ * pglog_ratelimit.h
+ *		  Per-database rate limiting of spooled events for pglog extension
+ *
+ * Copyright (c) 2014, 2ndQuadrant Ltd
+ *
+ * IDENTIFICATION
+ *		  pglog/pglog_ratelimit.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGLOG_RATELIMIT_H
+#define PGLOG_RATELIMIT_H
+
+#include "postgres.h"
+
+#include "nodes/pg_list.h"
+#include "pgtime.h"
+
+/*
+ * Events dropped by a rate limit, to be written as a single summary record
+ */
+typedef struct pglogThrottleSummary
+{
+	NameData database; /* database name, empty if none */
+	int elevel; /* WARNING or ERROR */
+	const char *limit; /* name of the GUC setting the limit */
+	int64 throttled; /* number of events dropped */
+	pg_time_t first_time; /* time of the first dropped event */
+	int first_msec; /* milliseconds of first_time */
+	pg_time_t last_time; /* time of the last dropped event */
+	int last_msec; /* milliseconds of last_time */
+} PgLogThrottleSummary;
+
+/* GUC Variables */
+extern PGDLLIMPORT int Pglog_warning_rate_limit;
+extern PGDLLIMPORT int Pglog_error_rate_limit;
+
+/* Initialization and shared memory setup */
+extern void pglog_ratelimit_init(void);
+extern Size pglog_ratelimit_shmem_size(void);
+extern void pglog_ratelimit_shmem_startup(void);
+
+/* Called by the write path before anything else is done with an event */
+extern bool pglog_ratelimit_check(int elevel, PgLogThrottleSummary *summary,
+					  bool *has_summary);
+
+/* Called by the mover, for buckets no event passed since they dropped some */
+extern void pglog_ratelimit_sweep(List **summaries);
+extern void pglog_ratelimit_requeue(List *summaries);
+
+#endif
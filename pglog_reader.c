@@ -0,0 +1,581 @@
+/*-------------------------------------------------------------------------
+ *
+ * pglog_reader.c
+ *		  Spool segment reader for pglog extension
+ *
+ * The reader splits a segment into records and fields without building
+ * any datum, so that callers can decide which fields are worth converting.
+ * Segments are mapped in windows of PGLOG_MAP_SIZE bytes, which are parsed
+ * straight from the page cache without being copied to a buffer first.
+ * The size of the segment is checked again at the end of every window, so
+ * that records appended to the active segment during the scan are seen.
+ * Should mmap() fail, or for csvlog files, which the syslogger may
+ * truncate when reusing them, the segment is read in PGLOG_READ_BUFSIZE
+ * chunks instead.  Either way, I/O is accounted separately from parsing.
+ * Mapped windows are tracked outside of the memory of the readers, with the
+ * resource owner they were mapped under, so that those of the scans
+ * interrupted by an error are unmapped when it is released, be it at the
+ * abort of a subtransaction.
+ *
+ * Copyright (c) 2014, 2ndQuadrant Ltd
+ *
+ * IDENTIFICATION
+ *		  pglog/pglog_reader.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "pglog_reader.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "lib/ilist.h"
+#include "storage/fd.h"
+#include "utils/memutils.h"
+#include "utils/resowner.h"
+
+/*
+ * A window of a segment mapped by a reader
+ */
+typedef struct pglogMapping
+{
+	char *base; /* start of the mapping */
+	size_t len; /* length of the mapping */
+	ResourceOwner owner; /* resource owner it was mapped under */
+	dlist_node node; /* link in mappings */
+} PgLogMapping;
+
+/* Windows mapped by the readers of this backend */
+static dlist_head mappings = DLIST_STATIC_INIT(mappings);
+static bool mappings_callback_registered = false;
+
+static bool fill_raw_buf(PgLogReader *reader);
+static bool map_raw_buf(PgLogReader *reader);
+static void unmap_raw_buf(PgLogReader *reader);
+static void unmap_owned_callback(ResourceReleasePhase phase, bool isCommit,
+					 bool isTopLevel, void *arg);
+
+/*
+ * Open a segment for reading
+ *
+ * The reader and its buffers are allocated in CurrentMemoryContext.
+ */
+PgLogReader *
+pglog_reader_open(const char *filename, int max_fields, PgLogScanStats *stats)
+{
+	PgLogReader *reader;
+	int			length;
+
+	reader = (PgLogReader *) palloc0(sizeof(PgLogReader));
+	reader->filename = pstrdup(filename);
+	reader->fd = OpenTransientFile((char *) filename, O_RDONLY | PG_BINARY, 0);
+	if (reader->fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\" for reading: %m",
+						filename)));
+
+	length = strlen(filename);
+	reader->use_mmap = !(length > 4 &&
+						 strcmp(filename + length - 4, ".csv") == 0);
+	reader->limit = -1;
+	initStringInfo(&reader->record);
+	initStringInfo(&reader->attr_buf);
+	reader->max_fields = max_fields;
+	reader->field_starts = (int *) palloc(max_fields * sizeof(int));
+	reader->fields = (char **) palloc(max_fields * sizeof(char *));
+	reader->stats = stats;
+
+	stats->segments_read++;
+
+	return reader;
+}
+
+/*
+ * Load the next chunk of the segment into the raw buffer
+ *
+ * Returns false at end of file.
+ */
+static bool
+fill_raw_buf(PgLogReader *reader)
+{
+	instr_time	start;
+	instr_time	end;
+	int			nread;
+
+	unmap_raw_buf(reader);
+	reader->raw_offset += reader->raw_len;
+	reader->raw_pos = 0;
+	reader->raw_len = 0;
+
+	if (reader->use_mmap)
+	{
+		if (map_raw_buf(reader))
+			return (reader->raw_len > 0);
+
+		/* Go on reading from where the last window ended */
+		reader->use_mmap = false;
+		if (lseek(reader->fd, reader->raw_offset, SEEK_SET) < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not seek in file \"%s\": %m",
+							reader->filename)));
+	}
+
+	if (reader->read_buf == NULL)
+		reader->read_buf = (char *) palloc(PGLOG_READ_BUFSIZE);
+	reader->raw_buf = reader->read_buf;
+
+	if (reader->stats->collect_timing)
+		INSTR_TIME_SET_CURRENT(start);
+
+	nread = PGLOG_READ_BUFSIZE;
+	if (reader->limit >= 0)
+		nread = Max(Min(nread, reader->limit - reader->raw_offset), 0);
+	if (nread > 0)
+		nread = read(reader->fd, reader->raw_buf, nread);
+
+	if (reader->stats->collect_timing)
+	{
+		INSTR_TIME_SET_CURRENT(end);
+		INSTR_TIME_ACCUM_DIFF(reader->stats->io_time, end, start);
+	}
+
+	if (nread < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read file \"%s\": %m",
+						reader->filename)));
+	if (nread == 0)
+		return false;
+
+	reader->raw_len = nread;
+	reader->stats->bytes_read += nread;
+
+	return true;
+}
+
+/*
+ * Map the window of the segment starting at reader->raw_offset
+ *
+ * The window ends at the current end of the segment, or PGLOG_MAP_SIZE
+ * bytes later.  Leaves raw_len at 0 at end of file.  Returns false if the
+ * segment cannot be mapped.
+ */
+static bool
+map_raw_buf(PgLogReader *reader)
+{
+	instr_time	start;
+	instr_time	end;
+	struct stat st;
+	off_t		map_start;
+	size_t		len;
+	char	   *base;
+
+	if (fstat(reader->fd, &st) < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not stat file \"%s\": %m",
+						reader->filename)));
+	if (reader->limit >= 0 && st.st_size > reader->limit)
+		st.st_size = reader->limit;
+	if (st.st_size <= reader->raw_offset)
+		return true;
+
+	/* Mappings start on a page boundary */
+	map_start = reader->raw_offset - reader->raw_offset % sysconf(_SC_PAGESIZE);
+	len = Min(st.st_size - reader->raw_offset, PGLOG_MAP_SIZE);
+
+	if (reader->stats->collect_timing)
+		INSTR_TIME_SET_CURRENT(start);
+
+	base = mmap(NULL, (reader->raw_offset - map_start) + len, PROT_READ,
+				MAP_SHARED, reader->fd, map_start);
+	if (base == MAP_FAILED)
+	{
+		elog(DEBUG1, "could not map file \"%s\": %m", reader->filename);
+		return false;
+	}
+#ifdef MADV_SEQUENTIAL
+	(void) madvise(base, (reader->raw_offset - map_start) + len,
+				   MADV_SEQUENTIAL);
+#endif
+
+	if (reader->stats->collect_timing)
+	{
+		INSTR_TIME_SET_CURRENT(end);
+		INSTR_TIME_ACCUM_DIFF(reader->stats->io_time, end, start);
+	}
+
+	if (!mappings_callback_registered)
+	{
+		RegisterResourceReleaseCallback(unmap_owned_callback, NULL);
+		mappings_callback_registered = true;
+	}
+	reader->map = (PgLogMapping *) MemoryContextAlloc(TopMemoryContext,
+													  sizeof(PgLogMapping));
+	reader->map->base = base;
+	reader->map->len = (reader->raw_offset - map_start) + len;
+	reader->map->owner = CurrentResourceOwner;
+	dlist_push_head(&mappings, &reader->map->node);
+
+	reader->raw_buf = base + (reader->raw_offset - map_start);
+	reader->raw_len = len;
+	reader->stats->bytes_read += len;
+
+	return true;
+}
+
+/* Unmap the current window of the segment, if any */
+static void
+unmap_raw_buf(PgLogReader *reader)
+{
+	if (reader->map != NULL)
+	{
+		munmap(reader->map->base, reader->map->len);
+		dlist_delete(&reader->map->node);
+		pfree(reader->map);
+		reader->map = NULL;
+		reader->raw_buf = NULL;
+	}
+}
+
+/*
+ * Unmap the windows left mapped under the resource owner being released
+ *
+ * Scans interrupted by an error leave their window mapped; so do scans
+ * never ended, on commit.  The release of a transaction, rather than of a
+ * subtransaction or portal, unmaps them all.
+ */
+static void
+unmap_owned_callback(ResourceReleasePhase phase, bool isCommit,
+					 bool isTopLevel, void *arg)
+{
+	dlist_mutable_iter iter;
+
+	if (phase != RESOURCE_RELEASE_AFTER_LOCKS)
+		return;
+
+	dlist_foreach_modify(iter, &mappings)
+	{
+		PgLogMapping *map = dlist_container(PgLogMapping, node, iter.cur);
+
+		if (!isTopLevel && map->owner != CurrentResourceOwner)
+			continue;
+
+		munmap(map->base, map->len);
+		dlist_delete(&map->node);
+		pfree(map);
+	}
+}
+
+/*
+ * Read the next record of the segment into reader->record
+ *
+ * A record ends at the first newline found outside a quoted field.  Since
+ * quotes inside a field are doubled, the quoting state simply flips at every
+ * quote character.  Returns false when there are no more complete records.
+ */
+bool
+pglog_reader_next(PgLogReader *reader)
+{
+	bool		in_quote = false;
+	bool		started = false;
+
+	resetStringInfo(&reader->record);
+	reader->nfields = 0;
+
+	for (;;)
+	{
+		char	   *start;
+		char	   *end;
+		char	   *p;
+
+		/*
+		 * A trailing record without its newline is still being written by
+		 * some backend: leave it to a later scan.
+		 */
+		if (reader->raw_pos >= reader->raw_len && !fill_raw_buf(reader))
+			return false;
+
+		if (!started)
+		{
+			reader->record_offset = reader->raw_offset + reader->raw_pos;
+			started = true;
+		}
+
+		start = reader->raw_buf + reader->raw_pos;
+		end = reader->raw_buf + reader->raw_len;
+		for (p = start; p < end; p++)
+		{
+			if (*p == '"')
+				in_quote = !in_quote;
+			else if (*p == '\n' && !in_quote)
+				break;
+		}
+
+		appendBinaryStringInfo(&reader->record, start, p - start);
+		reader->raw_pos = p - reader->raw_buf;
+
+		if (p == end)
+			continue;
+
+		/* Skip the newline, and the carriage return before it if any */
+		reader->raw_pos++;
+		if (reader->record.len > 0 &&
+			reader->record.data[reader->record.len - 1] == '\r')
+			reader->record.data[--reader->record.len] = '\0';
+
+		/* Ignore empty lines */
+		if (reader->record.len == 0)
+		{
+			started = false;
+			continue;
+		}
+
+		return true;
+	}
+}
+
+/*
+ * Go on reading from the record starting at offset
+ *
+ * offset must be the start of a record, as found in record_offset.
+ */
+void
+pglog_reader_seek(PgLogReader *reader, off_t offset)
+{
+	unmap_raw_buf(reader);
+	reader->raw_offset = offset;
+	reader->raw_pos = 0;
+	reader->raw_len = 0;
+
+	if (!reader->use_mmap && lseek(reader->fd, offset, SEEK_SET) < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not seek in file \"%s\": %m",
+						reader->filename)));
+}
+
+/*
+ * Start reading at offset, to read the records before it after the end of
+ * the segment is reached (see pglog_reader_wrap)
+ *
+ * offset must be the start of a record.
+ */
+void
+pglog_reader_start_at(PgLogReader *reader, off_t offset)
+{
+	reader->start_offset = offset;
+	pglog_reader_seek(reader, offset);
+}
+
+/*
+ * At the end of the segment, go on reading from its start, up to the
+ * offset the scan started at
+ *
+ * Returns false if there is nothing left to read.  Whatever is left of a
+ * trailing record being written is discarded.
+ */
+bool
+pglog_reader_wrap(PgLogReader *reader)
+{
+	if (reader->start_offset == 0 || reader->limit >= 0)
+		return false;
+
+	pglog_reader_seek(reader, 0);
+	reader->limit = reader->start_offset;
+	reader->skip_in_quote = false;
+	reader->skip_pending = 0;
+	return true;
+}
+
+/*
+ * Split the first nfields fields of the current record into reader->fields
+ *
+ * Quotes are removed and doubled quotes collapsed.  An unquoted empty field
+ * is NULL, a quoted empty field is an empty string.  Callers interested in
+ * the leading fields only can stop early and skip the long text fields at
+ * the end of the record; extra fields are only detected when asking for all
+ * of them.
+ *
+ * Fields are only ever appended to the spool format, so records can have
+ * more fields than a table defined by an older version of the extension
+ * has columns: those trailing fields are ignored.  Extra data is an error
+ * only for readers expecting every field of the current format.
+ */
+void
+pglog_reader_split(PgLogReader *reader, int nfields)
+{
+	const char *p = reader->record.data;
+	const char *end = p + reader->record.len;
+	bool		more = true;
+	int			i;
+
+	Assert(nfields <= reader->max_fields);
+
+	resetStringInfo(&reader->attr_buf);
+	reader->nfields = 0;
+
+	while (more && reader->nfields < nfields)
+	{
+		int			start = reader->attr_buf.len;
+		bool		quoted = false;
+		bool		in_quote = false;
+
+		more = false;
+		while (p < end)
+		{
+			char		c = *p++;
+
+			if (in_quote)
+			{
+				if (c != '"')
+					appendStringInfoCharMacro(&reader->attr_buf, c);
+				else if (p < end && *p == '"')
+				{
+					appendStringInfoCharMacro(&reader->attr_buf, '"');
+					p++;
+				}
+				else
+					in_quote = false;
+			}
+			else if (c == ',')
+			{
+				more = true;
+				break;
+			}
+			else if (c == '"')
+				in_quote = quoted = true;
+			else
+				appendStringInfoCharMacro(&reader->attr_buf, c);
+		}
+
+		if (!quoted && reader->attr_buf.len == start)
+			reader->field_starts[reader->nfields] = -1;
+		else
+			reader->field_starts[reader->nfields] = start;
+		appendStringInfoCharMacro(&reader->attr_buf, '\0');
+		reader->nfields++;
+	}
+
+	if (more && nfields == reader->max_fields &&
+		reader->max_fields >= PGLOG_NUM_FIELDS)
+		ereport(ERROR,
+				(errcode(ERRCODE_BAD_COPY_FILE_FORMAT),
+				 errmsg("extra data after last expected column")));
+
+	/* attr_buf may have been enlarged, so compute pointers only now */
+	for (i = 0; i < reader->nfields; i++)
+	{
+		if (reader->field_starts[i] < 0)
+			reader->fields[i] = NULL;
+		else
+			reader->fields[i] = reader->attr_buf.data + reader->field_starts[i];
+	}
+}
+
+/*
+ * Skip up to max_records records, returning how many were skipped
+ *
+ * This is the counting counterpart of pglog_reader_next(): records are not
+ * copied anywhere, and the segment is scanned with memchr(), which the C
+ * library vectorises, jumping from quote to quote inside quoted fields and
+ * from quote or newline to the next one outside them.  A return value lower
+ * than max_records means the end of the segment was reached; as with
+ * pglog_reader_next(), a trailing record without its newline is not counted.
+ * The two functions cannot be mixed on the same reader.
+ */
+int
+pglog_reader_skip(PgLogReader *reader, int max_records)
+{
+	int			count = 0;
+
+	while (count < max_records)
+	{
+		char	   *p;
+		char	   *end;
+		char	   *nl;
+		char	   *q;
+
+		if (reader->raw_pos >= reader->raw_len && !fill_raw_buf(reader))
+			break;
+
+		p = reader->raw_buf + reader->raw_pos;
+		end = reader->raw_buf + reader->raw_len;
+
+		/* Inside a quoted field only the closing quote matters */
+		if (reader->skip_in_quote)
+		{
+			q = memchr(p, '"', end - p);
+			if (q == NULL)
+				q = end;
+			else
+			{
+				reader->skip_in_quote = false;
+				q++;
+			}
+			reader->skip_pending += q - p;
+			reader->raw_pos = q - reader->raw_buf;
+			continue;
+		}
+
+		/* Outside quotes, stop at the first quote before the newline */
+		nl = memchr(p, '\n', end - p);
+		q = memchr(p, '"', (nl ? nl : end) - p);
+		if (q)
+		{
+			reader->skip_in_quote = true;
+			reader->skip_pending += q + 1 - p;
+			reader->raw_pos = q + 1 - reader->raw_buf;
+			continue;
+		}
+		if (nl == NULL)
+		{
+			reader->skip_pending += end - p;
+			reader->raw_pos = reader->raw_len;
+			continue;
+		}
+
+		/* End of record; empty lines are ignored as in pglog_reader_next() */
+		if (reader->skip_pending + (nl - p) > 0)
+			count++;
+		reader->skip_pending = 0;
+		reader->raw_pos = nl + 1 - reader->raw_buf;
+	}
+
+	reader->stats->rows_counted += count;
+
+	return count;
+}
+
+/*
+ * Memory held by the reader, not counting the datums built from it
+ */
+Size
+pglog_reader_memory(PgLogReader *reader)
+{
+	return sizeof(PgLogReader) +
+		(reader->read_buf ? PGLOG_READ_BUFSIZE : 0) +
+		reader->record.maxlen + reader->attr_buf.maxlen +
+		reader->max_fields * (sizeof(int) + sizeof(char *));
+}
+
+/*
+ * Close the segment
+ *
+ * Memory is left to the caller, which is expected to reset the context the
+ * reader was opened in.
+ */
+void
+pglog_reader_close(PgLogReader *reader)
+{
+	unmap_raw_buf(reader);
+	if (reader->fd >= 0)
+		CloseTransientFile(reader->fd);
+	reader->fd = -1;
+}
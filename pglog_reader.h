@@ -0,0 +1,125 @@
+/*-------------------------------------------------------------------------
+ *
+ * pglog_reader.h
+ *		  Spool segment reader for pglog extension
+ *
+ * Copyright (c) 2014, 2ndQuadrant Ltd
+ *
+ * IDENTIFICATION
+ *		  pglog/pglog_reader.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGLOG_READER_H
+#define PGLOG_READER_H
+
+#include "postgres.h"
+
+#include "lib/stringinfo.h"
+#include "portability/instr_time.h"
+
+/* Size of the raw read buffer of a segment reader */
+#define PGLOG_READ_BUFSIZE 65536
+
+/* Size of the windows of a segment mapped by a segment reader */
+#define PGLOG_MAP_SIZE (8 * 1024 * 1024)
+
+/*
+ * Position of the fields in a spool record, as written by fmtLogLine()
+ */
+typedef enum PgLogField
+{
+	PGLOG_FIELD_LOG_TIME = 0,
+	PGLOG_FIELD_USER_NAME,
+	PGLOG_FIELD_DATABASE_NAME,
+	PGLOG_FIELD_PROCESS_ID,
+	PGLOG_FIELD_CONNECTION_FROM,
+	PGLOG_FIELD_SESSION_ID,
+	PGLOG_FIELD_SESSION_LINE_NUM,
+	PGLOG_FIELD_COMMAND_TAG,
+	PGLOG_FIELD_SESSION_START_TIME,
+	PGLOG_FIELD_VIRTUAL_TRANSACTION_ID,
+	PGLOG_FIELD_TRANSACTION_ID,
+	PGLOG_FIELD_ERROR_SEVERITY,
+	PGLOG_FIELD_SQL_STATE_CODE,
+	PGLOG_FIELD_MESSAGE,
+	PGLOG_FIELD_DETAIL,
+	PGLOG_FIELD_HINT,
+	PGLOG_FIELD_INTERNAL_QUERY,
+	PGLOG_FIELD_INTERNAL_QUERY_POS,
+	PGLOG_FIELD_CONTEXT,
+	PGLOG_FIELD_QUERY,
+	PGLOG_FIELD_QUERY_POS,
+	PGLOG_FIELD_LOCATION,
+	PGLOG_FIELD_APPLICATION_NAME,
+	PGLOG_FIELD_MESSAGE_FINGERPRINT,
+	PGLOG_FIELD_QUERY_FINGERPRINT,
+	PGLOG_NUM_FIELDS
+} PgLogField;
+
+/*
+ * Fields of the csvlog format; those following it were added by pglog, and
+ * are missing from the segments written by earlier versions.
+ */
+#define PGLOG_NUM_CSVLOG_FIELDS (PGLOG_FIELD_APPLICATION_NAME + 1)
+
+/*
+ * Counters collected while scanning the spool, shown by EXPLAIN ANALYZE.
+ */
+typedef struct pglogScanStats
+{
+	long segments_read; /* segments opened */
+	uint64 bytes_read; /* raw bytes read or mapped from segments */
+	uint64 rows_parsed; /* records split into fields */
+	uint64 rows_counted; /* records skipped without splitting */
+	uint64 rows_rejected; /* records split but not returned by the scan */
+	uint64 cached_blocks; /* blocks of rows found in the block cache */
+	instr_time io_time; /* time spent waiting for read() or mmap() */
+	instr_time parse_time; /* time spent fetching rows, reads included */
+	Size peak_memory; /* largest reader plus row footprint */
+	bool collect_timing; /* are io_time and parse_time wanted? */
+} PgLogScanStats;
+
+/*
+ * State of reading a single spool segment.
+ *
+ * Segments are CSV files written by pglog_spool.c, using the PostgreSQL
+ * defaults (quote = escape = '"', unquoted empty field is NULL).
+ */
+typedef struct pglogReader
+{
+	const char *filename; /* segment being read */
+	int fd; /* file descriptor of the segment */
+	bool use_mmap; /* is the segment mapped rather than read? */
+	struct pglogMapping *map; /* mapped window of the segment, NULL if none */
+	char *read_buf; /* buffer for read(), NULL until needed */
+	char *raw_buf; /* raw data of the segment, mapped or read */
+	int raw_len; /* valid bytes in raw_buf */
+	int raw_pos; /* next byte to scan in raw_buf */
+	off_t raw_offset; /* segment offset of raw_buf[0] */
+	off_t start_offset; /* offset the scan started at, read last */
+	off_t limit; /* offset reading stops at, -1 for the end of file */
+	off_t record_offset; /* segment offset of the current record */
+	StringInfoData record; /* current record, without its newline */
+	StringInfoData attr_buf; /* de-quoted fields of the current record */
+	int *field_starts; /* offsets of fields in attr_buf, -1 for NULL */
+	char **fields; /* fields of the current record, NULL for NULL */
+	int max_fields; /* number of fields expected in a record */
+	int nfields; /* number of fields in the current record */
+	bool skip_in_quote; /* pglog_reader_skip() is inside a quoted field */
+	int64 skip_pending; /* bytes of the record being skipped so far */
+	PgLogScanStats *stats; /* where to account reads */
+} PgLogReader;
+
+extern PgLogReader *pglog_reader_open(const char *filename, int max_fields,
+				  PgLogScanStats *stats);
+extern bool pglog_reader_next(PgLogReader *reader);
+extern void pglog_reader_split(PgLogReader *reader, int nfields);
+extern void pglog_reader_seek(PgLogReader *reader, off_t offset);
+extern void pglog_reader_start_at(PgLogReader *reader, off_t offset);
+extern bool pglog_reader_wrap(PgLogReader *reader);
+extern int pglog_reader_skip(PgLogReader *reader, int max_records);
+extern Size pglog_reader_memory(PgLogReader *reader);
+extern void pglog_reader_close(PgLogReader *reader);
+
+#endif
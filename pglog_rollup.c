@@ -0,0 +1,616 @@
+/*-------------------------------------------------------------------------
+ *
+ * pglog_rollup.c
+ *		  Per-minute event counters for pglog extension
+ *
+ * Every spooled event is counted in a shared hash table keyed by minute,
+ * database, user, severity and SQLSTATE.  Once a minute is over its
+ * counters are appended to a rollup file stored next to the spool file of
+ * the same period (pglog-<period>.rollup), one line per key:
+ *
+ *		minute,severity,sqlstate,database,user,count
+ *
+ * where minute is a Unix timestamp.  pglog_rollup() merges the rollup files
+ * with the counters not flushed yet, so long-range trends can be computed
+ * without reading the spool itself.
+ *
+ * Copyright (c) 2014, 2ndQuadrant Ltd
+ *
+ * IDENTIFICATION
+ *		  pglog/pglog_rollup.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "pglog_rollup.h"
+#include "pglog_reader.h"
+#include "pglog_spool.h"
+
+#include <time.h>
+
+#include "funcapi.h"
+#include "libpq/libpq-be.h"
+#include "miscadmin.h"
+#include "storage/fd.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/int8.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+
+/* GUC Variables */
+bool		Pglog_rollups = true;
+int			Pglog_rollup_max_entries = 1024;
+
+/*
+ * Hash table key of a counter
+ */
+typedef struct pglogRollupKey
+{
+	pg_time_t minute; /* start of the minute */
+	int severity; /* index in pglog_severity_labels */
+	int sqlerrcode; /* encoded SQLSTATE */
+	NameData database; /* database name, empty if none */
+	NameData user; /* user name, empty if none */
+} PgLogRollupKey;
+
+typedef struct pglogRollupEntry
+{
+	PgLogRollupKey key; /* hash key of entry - MUST BE FIRST */
+	slock_t mutex; /* protects the counter only */
+	int64 count; /* number of events */
+} PgLogRollupEntry;
+
+/*
+ * Global shared state
+ */
+typedef struct pglogRollupShared
+{
+	LWLockId lock; /* protects hashtable search/modification */
+	pg_time_t current_minute; /* earlier minutes have been flushed */
+	int64 dropped; /* events not counted because the table was full */
+} PgLogRollupShared;
+
+/* Number of columns returned by pglog_rollup() */
+#define PGLOG_ROLLUP_COLS 6
+
+/* Number of fields of a rollup file record */
+#define PGLOG_ROLLUP_FIELDS 6
+
+/* Links to shared memory state */
+static PgLogRollupShared *rollup_shared = NULL;
+static HTAB *rollup_hash = NULL;
+
+/* Is this backend already updating the counters? */
+static bool rollup_busy = false;
+
+/*
+ * SQL functions
+ */
+extern Datum pglog_rollup(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(pglog_rollup);
+
+static PgLogRollupEntry *detach_rollups(pg_time_t before, int *nentries);
+static bool write_rollups(PgLogRollupEntry *entries, int nentries);
+static int rollup_minute_cmp(const void *a, const void *b);
+static void accumulate(HTAB *htab, PgLogRollupKey *key, int64 count);
+
+/*
+ * Define the rollup GUCs
+ *
+ * Must be called before pglog_rollup_shmem_size(), which depends on them.
+ */
+void
+pglog_rollup_init(void)
+{
+	DefineCustomBoolVariable("pglog.rollups",
+							 "Maintains per-minute counters of spooled events.",
+							 NULL,
+							 &Pglog_rollups,
+							 true,
+							 PGC_SIGHUP,
+							 GUC_NOT_IN_SAMPLE,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pglog.rollup_max_entries",
+							"Sets the maximum number of per-minute counters kept in shared memory.",
+							NULL,
+							&Pglog_rollup_max_entries,
+							1024,
+							64,
+							INT_MAX,
+							PGC_POSTMASTER,
+							GUC_NOT_IN_SAMPLE,
+							NULL,
+							NULL,
+							NULL);
+}
+
+/*
+ * Shared memory needed for the counters
+ */
+Size
+pglog_rollup_shmem_size(void)
+{
+	return add_size(MAXALIGN(sizeof(PgLogRollupShared)),
+					hash_estimate_size(Pglog_rollup_max_entries,
+									   sizeof(PgLogRollupEntry)));
+}
+
+/*
+ * Allocate or attach to the counters
+ *
+ * Called from the shared memory startup hook, holding AddinShmemInitLock.
+ */
+void
+pglog_rollup_shmem_startup(void)
+{
+	bool		found;
+	HASHCTL		info;
+
+	rollup_shared = ShmemInitStruct("pglog rollups",
+									sizeof(PgLogRollupShared),
+									&found);
+	if (!found)
+	{
+		rollup_shared->lock = LWLockAssign();
+		rollup_shared->current_minute = 0;
+		rollup_shared->dropped = 0;
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(PgLogRollupKey);
+	info.entrysize = sizeof(PgLogRollupEntry);
+	info.hash = tag_hash;
+	rollup_hash = ShmemInitHash("pglog rollup hash",
+								Pglog_rollup_max_entries,
+								Pglog_rollup_max_entries,
+								&info,
+								HASH_ELEM | HASH_FUNCTION);
+}
+
+/*
+ * Count an event in the counters of the current minute
+ *
+ * Existing counters are updated under a shared lock; the exclusive lock is
+ * only taken to add a counter, or to detach the counters of the previous
+ * minutes when a new one starts.  Those are written to the rollup files
+ * once the lock is released, so that other backends do not wait for the
+ * file writes.  Processes without a PGPROC, such as the postmaster, cannot
+ * take the lock and are not counted.
+ */
+void
+pglog_rollup_count(int elevel, int sqlerrcode)
+{
+	PgLogRollupKey key;
+	PgLogRollupEntry *entry;
+	PgLogRollupEntry *expired = NULL;
+	int			nexpired = 0;
+	pg_time_t	now;
+
+	/* Safety check, and no recursion from errors reported below */
+	if (!Pglog_rollups || !rollup_shared || MyProc == NULL || rollup_busy)
+		return;
+
+	now = (pg_time_t) time(NULL);
+
+	memset(&key, 0, sizeof(PgLogRollupKey));
+	key.minute = now - now % SECS_PER_MINUTE;
+	key.severity = pglog_severity_index(pglog_error_severity(elevel));
+	key.sqlerrcode = sqlerrcode;
+	if (MyProcPort && MyProcPort->database_name)
+		strlcpy(NameStr(key.database), MyProcPort->database_name, NAMEDATALEN);
+	if (MyProcPort && MyProcPort->user_name)
+		strlcpy(NameStr(key.user), MyProcPort->user_name, NAMEDATALEN);
+
+	rollup_busy = true;
+
+	/* Lookup the counter using a shared lock */
+	LWLockAcquire(rollup_shared->lock, LW_SHARED);
+
+	if (key.minute <= rollup_shared->current_minute)
+	{
+		entry = (PgLogRollupEntry *) hash_search(rollup_hash, &key,
+												 HASH_FIND, NULL);
+		if (entry)
+		{
+			volatile PgLogRollupEntry *e = (volatile PgLogRollupEntry *) entry;
+
+			SpinLockAcquire(&e->mutex);
+			e->count++;
+			SpinLockRelease(&e->mutex);
+
+			LWLockRelease(rollup_shared->lock);
+			rollup_busy = false;
+			return;
+		}
+	}
+
+	/* Need exclusive lock to flush or to make a new counter */
+	LWLockRelease(rollup_shared->lock);
+	LWLockAcquire(rollup_shared->lock, LW_EXCLUSIVE);
+
+	if (key.minute > rollup_shared->current_minute)
+	{
+		expired = detach_rollups(key.minute, &nexpired);
+		rollup_shared->current_minute = key.minute;
+	}
+
+	/*
+	 * The counter could have been made by someone else meanwhile.  The table
+	 * is not allowed to grow past its size, which would take shared memory
+	 * other modules rely on.
+	 */
+	entry = (PgLogRollupEntry *) hash_search(rollup_hash, &key,
+											 HASH_FIND, NULL);
+	if (entry == NULL &&
+		hash_get_num_entries(rollup_hash) < Pglog_rollup_max_entries)
+	{
+		entry = (PgLogRollupEntry *) hash_search(rollup_hash, &key,
+												 HASH_ENTER_NULL, NULL);
+		if (entry)
+		{
+			SpinLockInit(&entry->mutex);
+			entry->count = 0;
+		}
+	}
+	if (entry == NULL)
+		rollup_shared->dropped++;
+	else
+		entry->count++;
+
+	LWLockRelease(rollup_shared->lock);
+
+	if (expired)
+	{
+		if (!write_rollups(expired, nexpired))
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not write pglog rollup file: %m")));
+		pfree(expired);
+	}
+
+	rollup_busy = false;
+}
+
+/*
+ * Remove the counters of the minutes before the given one from the hash
+ * table, and return a palloc'd copy of them, or NULL if there is none
+ *
+ * Caller must hold the lock exclusively.  Until they are written, the
+ * counters returned are not seen by pglog_rollup().
+ */
+static PgLogRollupEntry *
+detach_rollups(pg_time_t before, int *nentries)
+{
+	HASH_SEQ_STATUS hash_seq;
+	PgLogRollupEntry *entry;
+	PgLogRollupEntry *entries = NULL;
+	int			n = 0;
+
+	hash_seq_init(&hash_seq, rollup_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (entry->key.minute >= before)
+			continue;
+
+		if (entries == NULL)
+			entries = (PgLogRollupEntry *)
+				palloc(hash_get_num_entries(rollup_hash) *
+					   sizeof(PgLogRollupEntry));
+		entries[n].key = entry->key;
+		entries[n].count = entry->count;
+		n++;
+
+		hash_search(rollup_hash, &entry->key, HASH_REMOVE, NULL);
+	}
+
+	*nentries = n;
+	return entries;
+}
+
+/* qsort comparator of counters, by minute */
+static int
+rollup_minute_cmp(const void *a, const void *b)
+{
+	const PgLogRollupEntry *ea = (const PgLogRollupEntry *) a;
+	const PgLogRollupEntry *eb = (const PgLogRollupEntry *) b;
+
+	if (ea->key.minute == eb->key.minute)
+		return 0;
+	return (ea->key.minute < eb->key.minute) ? -1 : 1;
+}
+
+/*
+ * Append detached counters to the rollup files
+ *
+ * Other backends may be appending other minutes to the same file, so the
+ * records of a file are written with a single unbuffered write, which the
+ * append mode keeps whole.  Returns false if some counter could not be
+ * written; it is lost anyway.
+ */
+static bool
+write_rollups(PgLogRollupEntry *entries, int nentries)
+{
+	const char *directory = pglog_spool_primary_directory();
+	StringInfoData buf;
+	bool		ok = true;
+	int			save_errno = 0;
+	int			i = 0;
+
+	qsort(entries, nentries, sizeof(PgLogRollupEntry), rollup_minute_cmp);
+
+	initStringInfo(&buf);
+
+	while (i < nentries)
+	{
+		pg_time_t	file_start = pglog_segment_start(entries[i].key.minute);
+		char	   *filename;
+		FILE	   *fh;
+
+		/* Rollups go next to the spool file of the same period */
+		resetStringInfo(&buf);
+		for (; i < nentries &&
+			 pglog_segment_start(entries[i].key.minute) == file_start; i++)
+		{
+			PgLogRollupKey *key = &entries[i].key;
+
+			appendStringInfo(&buf, INT64_FORMAT ",%s,%s,",
+							 (int64) key->minute,
+							 pglog_severity_labels[key->severity],
+							 unpack_sql_state(key->sqlerrcode));
+			if (NameStr(key->database)[0] != '\0')
+				pglog_append_csv_literal(&buf, NameStr(key->database));
+			appendStringInfoChar(&buf, ',');
+			if (NameStr(key->user)[0] != '\0')
+				pglog_append_csv_literal(&buf, NameStr(key->user));
+			appendStringInfo(&buf, "," INT64_FORMAT "\n", entries[i].count);
+		}
+
+		filename = pglog_spool_file_name(directory, file_start, ".rollup");
+		fh = pglog_spool_fopen(directory, filename);
+		pfree(filename);
+		if (fh == NULL)
+		{
+			save_errno = errno;
+			ok = false;
+			continue;
+		}
+
+		setvbuf(fh, NULL, _IONBF, 0);
+		if (fwrite(buf.data, 1, buf.len, fh) != buf.len)
+		{
+			save_errno = errno;
+			ok = false;
+		}
+		fclose(fh);
+	}
+
+	pfree(buf.data);
+
+	errno = save_errno;
+	return ok;
+}
+
+/*
+ * Add count to the counter of key in a local hash table
+ */
+static void
+accumulate(HTAB *htab, PgLogRollupKey *key, int64 count)
+{
+	PgLogRollupEntry *entry;
+	bool		found;
+
+	entry = (PgLogRollupEntry *) hash_search(htab, key, HASH_ENTER, &found);
+	if (!found)
+		entry->count = 0;
+	entry->count += count;
+}
+
+/*
+ * pglog_rollup
+ *		Return the per-minute counters between since and until
+ *
+ * Counters already flushed are read from the rollup files, the others from
+ * shared memory.  A key may appear more than once in the files, for
+ * instance when an event of a minute was counted just after that minute had
+ * been flushed, so all counters are summed up before being returned.
+ */
+Datum
+pglog_rollup(PG_FUNCTION_ARGS)
+{
+	TimestampTz since = PG_GETARG_TIMESTAMPTZ(0);
+	TimestampTz until = PG_GETARG_TIMESTAMPTZ(1);
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	MemoryContext file_cxt;
+	HASHCTL		ctl;
+	HTAB	   *counters;
+	HASH_SEQ_STATUS hash_seq;
+	PgLogRollupEntry *entry;
+	PgLogScanStats stats;
+	FmgrInfo	severity_in;
+	Oid			severity_ioparam;
+	Oid			in_func_oid;
+	const char *directory = pglog_spool_primary_directory();
+	DIR		   *dir;
+	struct dirent *de;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(PgLogRollupKey);
+	ctl.entrysize = sizeof(PgLogRollupEntry);
+	ctl.hash = tag_hash;
+	ctl.hcxt = CurrentMemoryContext;
+	counters = hash_create("pglog rollup counters", 1024, &ctl,
+						   HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+	file_cxt = AllocSetContextCreate(CurrentMemoryContext,
+									 "pglog rollup file",
+									 ALLOCSET_DEFAULT_MINSIZE,
+									 ALLOCSET_DEFAULT_INITSIZE,
+									 ALLOCSET_DEFAULT_MAXSIZE);
+	memset(&stats, 0, sizeof(PgLogScanStats));
+
+	/* Counters already flushed to the rollup files */
+	dir = AllocateDir(directory);
+	while (dir != NULL && (de = ReadDir(dir, directory)) != NULL)
+	{
+		PgLogReader *reader;
+		char		filename[MAXPGPATH];
+		int			length = strlen(de->d_name);
+
+		if (length <= 7 || strcmp(de->d_name + length - 7, ".rollup") != 0)
+			continue;
+		snprintf(filename, MAXPGPATH, "%s/%s", directory, de->d_name);
+
+		MemoryContextSwitchTo(file_cxt);
+		reader = pglog_reader_open(filename, PGLOG_ROLLUP_FIELDS, &stats);
+		while (pglog_reader_next(reader))
+		{
+			PgLogRollupKey key;
+			int64		minute;
+			int64		count;
+			char	  **fields = reader->fields;
+			const char *sqlstate;
+
+			pglog_reader_split(reader, PGLOG_ROLLUP_FIELDS);
+			if (reader->nfields < PGLOG_ROLLUP_FIELDS ||
+				fields[0] == NULL || fields[5] == NULL ||
+				!scanint8(fields[0], true, &minute) ||
+				!scanint8(fields[5], true, &count))
+				continue;
+
+			if (time_t_to_timestamptz((pg_time_t) minute) < since ||
+				time_t_to_timestamptz((pg_time_t) minute) >= until)
+				continue;
+
+			memset(&key, 0, sizeof(PgLogRollupKey));
+			key.minute = (pg_time_t) minute;
+			key.severity = pglog_severity_index(fields[1]);
+			sqlstate = fields[2] ? fields[2] : "00000";
+			if (strlen(sqlstate) == 5)
+				key.sqlerrcode = MAKE_SQLSTATE(sqlstate[0], sqlstate[1],
+											   sqlstate[2], sqlstate[3],
+											   sqlstate[4]);
+			if (fields[3])
+				strlcpy(NameStr(key.database), fields[3], NAMEDATALEN);
+			if (fields[4])
+				strlcpy(NameStr(key.user), fields[4], NAMEDATALEN);
+
+			MemoryContextSwitchTo(oldcontext);
+			accumulate(counters, &key, count);
+			MemoryContextSwitchTo(file_cxt);
+		}
+		pglog_reader_close(reader);
+
+		MemoryContextSwitchTo(oldcontext);
+		MemoryContextReset(file_cxt);
+	}
+	if (dir != NULL)
+		FreeDir(dir);
+	MemoryContextDelete(file_cxt);
+
+	/* Counters still in shared memory */
+	if (rollup_shared)
+	{
+		LWLockAcquire(rollup_shared->lock, LW_SHARED);
+
+		hash_seq_init(&hash_seq, rollup_hash);
+		while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		{
+			volatile PgLogRollupEntry *e = (volatile PgLogRollupEntry *) entry;
+			int64		count;
+
+			if (time_t_to_timestamptz(entry->key.minute) < since ||
+				time_t_to_timestamptz(entry->key.minute) >= until)
+				continue;
+
+			SpinLockAcquire(&e->mutex);
+			count = e->count;
+			SpinLockRelease(&e->mutex);
+
+			accumulate(counters, &entry->key, count);
+		}
+
+		LWLockRelease(rollup_shared->lock);
+	}
+
+	/* Severities are returned as pglog_severity values */
+	getTypeInputInfo(tupdesc->attrs[3]->atttypid, &in_func_oid,
+					 &severity_ioparam);
+	fmgr_info(in_func_oid, &severity_in);
+
+	hash_seq_init(&hash_seq, counters);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		PgLogRollupKey *key = &entry->key;
+		Datum		values[PGLOG_ROLLUP_COLS];
+		bool		nulls[PGLOG_ROLLUP_COLS];
+		int			i = 0;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[i++] = TimestampTzGetDatum(time_t_to_timestamptz(key->minute));
+		if (NameStr(key->database)[0] != '\0')
+			values[i++] = CStringGetTextDatum(NameStr(key->database));
+		else
+			nulls[i++] = true;
+		if (NameStr(key->user)[0] != '\0')
+			values[i++] = CStringGetTextDatum(NameStr(key->user));
+		else
+			nulls[i++] = true;
+		values[i++] = InputFunctionCall(&severity_in,
+							(char *) pglog_severity_labels[key->severity],
+										severity_ioparam, -1);
+		values[i++] = CStringGetTextDatum(unpack_sql_state(key->sqlerrcode));
+		values[i++] = Int64GetDatum(entry->count);
+
+		Assert(i == PGLOG_ROLLUP_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	hash_destroy(counters);
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
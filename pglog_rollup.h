@@ -0,0 +1,30 @@
+/*-------------------------------------------------------------------------
+ *
+ * pglog_rollup.h
+ *		  Per-minute event counters for pglog extension
+ *
+ * Copyright (c) 2014, 2ndQuadrant Ltd
+ *
+ * IDENTIFICATION
+ *		  pglog/pglog_rollup.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGLOG_ROLLUP_H
+#define PGLOG_ROLLUP_H
+
+#include "postgres.h"
+
+/* GUC Variables */
+extern PGDLLIMPORT bool Pglog_rollups;
+extern PGDLLIMPORT int Pglog_rollup_max_entries;
+
+/* Initialization and shared memory setup */
+extern void pglog_rollup_init(void);
+extern Size pglog_rollup_shmem_size(void);
+extern void pglog_rollup_shmem_startup(void);
+
+/* Called by the write path for every spooled event */
+extern void pglog_rollup_count(int elevel, int sqlerrcode);
+
+#endif
@@ -0,0 +1,244 @@
+/*-------------------------------------------------------------------------
+ *
+ * pglog_shed.c
+ *		  Load shedding of low-severity events for pglog extension
+ *
+ * The time taken by every write to the spool is folded into an
+ * exponentially weighted moving average kept in shared memory.  When it
+ * exceeds pglog.shed_latency, the minimum severity of the events written
+ * is raised one step, from NOTICE to WARNING to ERROR, at most once a
+ * second.  It is lowered one step at a time once the average has fallen
+ * below half the threshold, or nothing has been written, for
+ * PGLOG_SHED_HOLD_SECS seconds since the last change.  LOG, FATAL and
+ * PANIC events are never shed.
+ *
+ * Copyright (c) 2014, 2ndQuadrant Ltd
+ *
+ * IDENTIFICATION
+ *		  pglog/pglog_shed.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "pglog_shed.h"
+
+#include <time.h>
+
+#include "pgtime.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/guc.h"
+
+/* GUC Variables */
+int			Pglog_shed_latency = 0;
+
+/* Weight of a new sample in the average write latency */
+#define PGLOG_SHED_ALPHA 0.1
+
+/*
+ * Global shared state
+ */
+typedef struct pglogShedShared
+{
+	slock_t mutex; /* protects the fields below */
+	double latency; /* average write latency in ms, 0 if unknown */
+	int level; /* minimum severity written, 0 if not shedding */
+	pg_time_t last_change; /* time of the last change of level */
+	pg_time_t last_sample; /* time of the last write */
+} PgLogShedShared;
+
+/* Successive shedding levels */
+static const int shed_levels[] = {NOTICE, WARNING, ERROR};
+
+#define NUM_SHED_LEVELS lengthof(shed_levels)
+
+/* Link to shared memory state */
+static PgLogShedShared *shed_shared = NULL;
+
+static int level_above(int level);
+static int level_below(int level, int min_level);
+static void change_level(int new_level, double latency, pg_time_t now,
+			 PgLogShedChange *change);
+
+/*
+ * Define the load shedding GUCs
+ */
+void
+pglog_shed_init(void)
+{
+	DefineCustomIntVariable("pglog.shed_latency",
+							"Sets the average write latency above which low-severity events are shed.",
+							"Zero disables load shedding.",
+							&Pglog_shed_latency,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_NOT_IN_SAMPLE | GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+}
+
+/*
+ * Shared memory needed for the shedding state
+ */
+Size
+pglog_shed_shmem_size(void)
+{
+	return MAXALIGN(sizeof(PgLogShedShared));
+}
+
+/*
+ * Allocate or attach to the shedding state
+ *
+ * Called from the shared memory startup hook, holding AddinShmemInitLock.
+ */
+void
+pglog_shed_shmem_startup(void)
+{
+	bool		found;
+
+	shed_shared = ShmemInitStruct("pglog shed",
+								  sizeof(PgLogShedShared),
+								  &found);
+	if (!found)
+	{
+		memset(shed_shared, 0, sizeof(PgLogShedShared));
+		SpinLockInit(&shed_shared->mutex);
+	}
+}
+
+/*
+ * Current shedding level: events less severe are not to be written
+ *
+ * Returns 0 when not shedding.  If nothing has been written for a while,
+ * pressure is assumed to be over and the level is lowered, which is
+ * reported in *change.
+ */
+int
+pglog_shed_level(int min_level, PgLogShedChange *change)
+{
+	volatile PgLogShedShared *s = shed_shared;
+	pg_time_t	now;
+	int			level;
+
+	change->changed = false;
+
+	if (Pglog_shed_latency <= 0 || s == NULL)
+		return 0;
+
+	/* Unlocked read: the level is a single int */
+	level = s->level;
+	if (level == 0)
+		return 0;
+
+	now = (pg_time_t) time(NULL);
+	if (now - s->last_sample < PGLOG_SHED_HOLD_SECS ||
+		now - s->last_change < PGLOG_SHED_HOLD_SECS)
+		return level;
+
+	SpinLockAcquire(&s->mutex);
+	if (s->level != 0 &&
+		now - s->last_sample >= PGLOG_SHED_HOLD_SECS &&
+		now - s->last_change >= PGLOG_SHED_HOLD_SECS)
+	{
+		change_level(level_below(s->level, min_level), -1, now, change);
+		s->latency = 0;
+	}
+	level = s->level;
+	SpinLockRelease(&s->mutex);
+
+	return level;
+}
+
+/*
+ * Account for the latency of a write, in ms, and raise or lower the
+ * shedding level accordingly
+ *
+ * A change of level is reported in *change.
+ */
+void
+pglog_shed_sample(double latency, int min_level, PgLogShedChange *change)
+{
+	volatile PgLogShedShared *s = shed_shared;
+	pg_time_t	now;
+	int			effective;
+
+	change->changed = false;
+
+	if (Pglog_shed_latency <= 0 || s == NULL)
+		return;
+
+	now = (pg_time_t) time(NULL);
+
+	SpinLockAcquire(&s->mutex);
+
+	if (s->latency == 0)
+		s->latency = latency;
+	else
+		s->latency = PGLOG_SHED_ALPHA * latency +
+			(1.0 - PGLOG_SHED_ALPHA) * s->latency;
+	s->last_sample = now;
+
+	effective = (s->level != 0) ? s->level : min_level;
+
+	/* Nothing can be shed if LOG or ERROR and above are all that is written */
+	if (s->latency > Pglog_shed_latency && now > s->last_change &&
+		effective < ERROR && min_level != LOG)
+		change_level(level_above(effective), s->latency, now, change);
+	else if (s->level != 0 && s->latency < Pglog_shed_latency / 2.0 &&
+			 now - s->last_change >= PGLOG_SHED_HOLD_SECS)
+		change_level(level_below(s->level, min_level), s->latency, now,
+					 change);
+
+	SpinLockRelease(&s->mutex);
+}
+
+/*
+ * Set the shedding level, and describe the change in *change
+ *
+ * Caller must hold the spinlock.
+ */
+static void
+change_level(int new_level, double latency, pg_time_t now,
+			 PgLogShedChange *change)
+{
+	volatile PgLogShedShared *s = shed_shared;
+
+	change->changed = true;
+	change->old_level = s->level;
+	change->new_level = new_level;
+	change->latency = latency;
+
+	s->level = new_level;
+	s->last_change = now;
+}
+
+/* First shedding level more severe than level */
+static int
+level_above(int level)
+{
+	int			i;
+
+	for (i = 0; i < NUM_SHED_LEVELS; i++)
+		if (shed_levels[i] > level)
+			return shed_levels[i];
+	return shed_levels[NUM_SHED_LEVELS - 1];
+}
+
+/* Shedding level before level, 0 if it is not above min_level */
+static int
+level_below(int level, int min_level)
+{
+	int			result = 0;
+	int			i;
+
+	for (i = 0; i < NUM_SHED_LEVELS; i++)
+		if (shed_levels[i] < level)
+			result = shed_levels[i];
+	if (result <= min_level)
+		result = 0;
+	return result;
+}
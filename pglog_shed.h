@@ -0,0 +1,45 @@
+/*-------------------------------------------------------------------------
+ *
+ * pglog_shed.h
+ *		  Load shedding of low-severity events for pglog extension
+ *
+ * Copyright (c) 2014, 2ndQuadrant Ltd
+ *
+ * IDENTIFICATION
+ *		  pglog/pglog_shed.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGLOG_SHED_H
+#define PGLOG_SHED_H
+
+#include "postgres.h"
+
+/*
+ * A change of the shedding level, to be recorded by a marker record
+ */
+typedef struct pglogShedChange
+{
+	bool changed; /* has the level just changed? */
+	int old_level; /* previous level, 0 if none */
+	int new_level; /* new level, 0 if none */
+	double latency; /* average write latency in ms, -1 if no recent write */
+} PgLogShedChange;
+
+/* Minimum time between a change of level and its lowering */
+#define PGLOG_SHED_HOLD_SECS 10
+
+/* GUC Variables */
+extern PGDLLIMPORT int Pglog_shed_latency;
+
+/* Initialization and shared memory setup */
+extern void pglog_shed_init(void);
+extern Size pglog_shed_shmem_size(void);
+extern void pglog_shed_shmem_startup(void);
+
+/* Called by the write path */
+extern int pglog_shed_level(int min_level, PgLogShedChange *change);
+extern void pglog_shed_sample(double latency, int min_level,
+				  PgLogShedChange *change);
+
+#endif
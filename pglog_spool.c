@@ -14,16 +14,30 @@
 #include "postgres.h"
 
 #include "pglog_spool.h"
-
+#include "pglog_dedup.h"
+#include "pglog_filter.h"
+#include "pglog_fingerprint.h"
+#include "pglog_hll.h"
+#include "pglog_mover.h"
+#include "pglog_ratelimit.h"
+#include "pglog_rollup.h"
+#include "pglog_shed.h"
+#include "pglog_topk.h"
+
+#include <ctype.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
 #include "access/xact.h"
 #include "libpq/libpq-be.h"
 #include "miscadmin.h"
+#include "portability/instr_time.h"
+#include "postmaster/autovacuum.h"
 #include "postmaster/syslogger.h"
+#include "replication/walsender.h"
 #include "storage/proc.h"
 #include "tcop/tcopprot.h"
+#include "utils/builtins.h"
 #include "utils/memutils.h"
 #include "utils/guc.h"
 #include "utils/ps_status.h"
@@ -32,7 +46,13 @@
 /* GUC Variables */
 char   *Pglog_directory = NULL;
 int		Pglog_min_messages = WARNING;
+int		Pglog_autovacuum_min_messages = -1;
+int		Pglog_walsender_min_messages = -1;
+int		Pglog_bgworker_min_messages = -1;
 int		Pglog_RotationAge = HOURS_PER_DAY * MINS_PER_HOUR;
+int		Pglog_route = PGLOG_ROUTE_NONE;
+char   *Pglog_fast_directory = NULL;
+int		Pglog_persistent_min_messages = ERROR;
 
 /* Is event spooling working? */
 bool Pglog_spooling_enabled = true;
@@ -43,10 +63,35 @@ static void pglog_emit_log_hook(ErrorData *edata);
 /* Old hook storage for loading/unloading of the extension */
 static emit_log_hook_type prev_emit_log_hook = NULL;
 
+/* Maximum number of spool streams a process keeps open */
+#define PGLOG_MAX_OPEN_STREAMS 8
+
+/*
+ * A spool stream open by this process
+ */
+typedef struct pglogOpenStream
+{
+	char *stream; /* stream name, "" for pglog.directory itself */
+	bool fast; /* is the file in the fast tier? */
+	char *filename; /* spool file of the current rotation period */
+	FILE *fh; /* open spool file */
+} PgLogOpenStream;
+
 /* Private state */
-static FILE *current_spoolfile = NULL;
-static char *current_spoolfile_name = NULL;
+static PgLogOpenStream open_streams[PGLOG_MAX_OPEN_STREAMS];
+static int	num_open_streams = 0;
 static bool rotation_requested = false;
+
+/* Directories listed in pglog.directory, NIL until first parsed */
+static List *spool_directories = NIL;
+static bool spool_directories_valid = false;
+
+/*
+ * Minimum level of the events spooled by this process, resolved from the
+ * settings above on first use, and again after any of them changed
+ */
+static int	effective_min_messages = WARNING;
+static int	effective_min_messages_pid = 0;
 static pg_time_t next_rotation_time;
 
 /*
@@ -59,18 +104,36 @@ static char formatted_log_time[FORMATTED_TS_LEN];
 /* Internal functions */
 static char *get_spoolfile_name(const char *path, pg_time_t timestamp);
 static void set_next_rotation_time(void);
-static void open_spoolfile(const char *path, pg_time_t timestamp);
-static void rotate_spoolfile(const char *path);
+static FILE *open_spoolfile(const char *path, pg_time_t timestamp,
+			   char **filename);
+static void close_streams(void);
+static void rotate_spoolfile(void);
+static PgLogOpenStream *get_stream(const char *stream, bool fast);
+static bool write_record(StringInfo buf, int elevel, const char *database,
+			 instr_time *elapsed);
 static void setup_formatted_log_time(void);
+static void format_log_time(char *dst, pg_time_t stamp_time, int msec);
 static void setup_formatted_start_time(void);
-static inline void appendCSVLiteral(StringInfo buf, const char *data);
-static const char * error_severity(int elevel);
 static bool is_log_level_output(int elevel, int log_min_level);
-static void fmtLogLine(StringInfo buf, ErrorData *edata);
+static int	get_min_messages(void);
+static void fmtLogLine(StringInfo buf, ErrorData *edata, uint64 fingerprint);
+static void fmtSyntheticLine(StringInfo buf, const char *log_time,
+				 const char *user, const char *database, int elevel,
+				 int sqlerrcode, const char *message, const char *detail,
+				 const uint64 *fingerprint);
+static void fmtSummaryLine(StringInfo buf, PgLogDedupSummary *summary);
+static void fmtThrottleLine(StringInfo buf, PgLogThrottleSummary *summary);
+static void fmtShedLine(StringInfo buf, PgLogShedChange *change);
+static bool write_summaries(StringInfo buf, List **summaries,
+				instr_time *elapsed);
+static void count_event(ErrorData *edata, uint64 fingerprint);
 static void pglog_emit_log_hook(ErrorData *edata);
 static void guc_assign_directory(const char *newval, void *extra);
 static bool guc_check_directory(char **newval, void **extra, GucSource source);
+static bool guc_check_fast_directory(char **newval, void **extra,
+						 GucSource source);
 static void guc_assign_rotation_age(int newval, void *extra);
+static void guc_assign_min_messages(int newval, void *extra);
 
 /*
  * We really want line-buffered mode for logfile output, but Windows does
@@ -103,6 +166,53 @@ static const struct config_enum_entry server_message_level_options[] = {
 	{NULL, 0, false}
 };
 
+/*
+ * Enum definition for pglog.route
+ */
+static const struct config_enum_entry route_options[] = {
+	{"none", PGLOG_ROUTE_NONE, false},
+	{"severity", PGLOG_ROUTE_SEVERITY, false},
+	{"database", PGLOG_ROUTE_DATABASE, false},
+	{NULL, 0, false}
+};
+
+/*
+ * Enum definition for the per-process-type minimum levels, where "default"
+ * means pglog.min_messages
+ */
+static const struct config_enum_entry process_message_level_options[] = {
+	{"default", -1, false},
+	{"debug", DEBUG2, true},
+	{"debug5", DEBUG5, false},
+	{"debug4", DEBUG4, false},
+	{"debug3", DEBUG3, false},
+	{"debug2", DEBUG2, false},
+	{"debug1", DEBUG1, false},
+	{"info", INFO, false},
+	{"notice", NOTICE, false},
+	{"warning", WARNING, false},
+	{"error", ERROR, false},
+	{"log", LOG, false},
+	{"fatal", FATAL, false},
+	{"panic", PANIC, false},
+	{NULL, 0, false}
+};
+
+/*
+ * Labels of the pglog_severity enum, in the order of its declaration
+ */
+const char *const pglog_severity_labels[PGLOG_NUM_SEVERITIES] = {
+	"DEBUG",
+	"INFO",
+	"NOTICE",
+	"WARNING",
+	"ERROR",
+	"LOG",
+	"FATAL",
+	"PANIC",
+	"???"
+};
+
 /*
  * construct logfile name using timestamp information
  *
@@ -110,6 +220,18 @@ static const struct config_enum_entry server_message_level_options[] = {
  */
 static char *
 get_spoolfile_name(const char *path, pg_time_t timestamp)
+{
+	return pglog_spool_file_name(path, timestamp, ".dat");
+}
+
+/*
+ * construct the name of a spool file, or of a file stored next to it
+ *
+ * Result is palloc'd.
+ */
+char *
+pglog_spool_file_name(const char *path, pg_time_t timestamp,
+					  const char *suffix)
 {
 	char	   *filename;
 	int			len;
@@ -121,12 +243,40 @@ get_spoolfile_name(const char *path, pg_time_t timestamp)
 	len = strlen(filename);
 
 	/* treat Log_filename as a strftime pattern */
-	pg_strftime(filename + len, MAXPGPATH - len, "pglog-%Y-%m-%d_%H%M%S.dat",
+	pg_strftime(filename + len, MAXPGPATH - len, "pglog-%Y-%m-%d_%H%M%S",
 				pg_localtime(&timestamp, log_timezone));
 
+	strlcat(filename, suffix, MAXPGPATH);
+
 	return filename;
 }
 
+/*
+ * Start of the rotation period containing timestamp, which is the time
+ * used to name the spool file of that period.
+ *
+ * Mirrors set_next_rotation_time(); with time-based rotation disabled,
+ * periods are taken to be one day long.
+ */
+pg_time_t
+pglog_segment_start(pg_time_t timestamp)
+{
+	struct pg_tm *tm;
+	int			rotinterval;
+
+	if (Pglog_RotationAge > 0)
+		rotinterval = Pglog_RotationAge * SECS_PER_MINUTE;
+	else
+		rotinterval = SECS_PER_DAY;
+
+	tm = pg_localtime(&timestamp, log_timezone);
+	timestamp += tm->tm_gmtoff;
+	timestamp -= timestamp % rotinterval;
+	timestamp -= tm->tm_gmtoff;
+
+	return timestamp;
+}
+
 /*
  * Determine the next planned rotation time, and store in next_rotation_time.
  */
@@ -158,18 +308,15 @@ set_next_rotation_time(void)
 }
 
 /*
- * Open the log spool file
+ * Open a file of the spool directory for appending, creating the directory
+ * if needed.  Returns NULL on failure, with errno set.
  */
-static void
-open_spoolfile(const char *path, pg_time_t timestamp)
+FILE *
+pglog_spool_fopen(const char *path, const char *filename)
 {
-	const int	save_errno = errno;
-	char        *filename  = NULL;
-	FILE		*fh		   = NULL;
+	FILE	   *fh;
 	mode_t		oumask;
 
-	filename = get_spoolfile_name(path, timestamp);
-
 	/*
 	 * Create spool directory if not present; ignore errors
 	 */
@@ -183,6 +330,24 @@ open_spoolfile(const char *path, pg_time_t timestamp)
 	fh = fopen(filename, "a");
 	umask(oumask);
 
+	return fh;
+}
+
+/*
+ * Open the spool file of a rotation period in directory path
+ *
+ * Returns NULL on failure, after disabling spooling and reporting it.  The
+ * palloc'd name of the file is returned in *filename.
+ */
+static FILE *
+open_spoolfile(const char *path, pg_time_t timestamp, char **filename)
+{
+	const int	save_errno = errno;
+	FILE		*fh		   = NULL;
+
+	*filename = get_spoolfile_name(path, timestamp);
+	fh = pglog_spool_fopen(path, *filename);
+
 	if (fh)
 	{
 		setvbuf(fh, NULL, LBF_MODE, 0);
@@ -191,8 +356,6 @@ open_spoolfile(const char *path, pg_time_t timestamp)
 		/* use CRLF line endings on Windows */
 		_setmode(_fileno(fh), _O_TEXT);
 #endif
-
-		current_spoolfile = fh;
 	}
 	else
 	{
@@ -203,39 +366,311 @@ open_spoolfile(const char *path, pg_time_t timestamp)
 		ereport(LOG,
 				(errcode_for_file_access(),
 				 errmsg("could not open log file \"%s\": %m",
-						filename)));
+						*filename)));
 	}
-	pfree(filename);
 	errno = save_errno;
-	return;
+	return fh;
 
 }
 
 /*
- * Close the current file (if any) and open a new one
+ * Close the spool files of all the streams open by this process
  */
 static void
-rotate_spoolfile(const char *path)
+close_streams(void)
 {
-	/* Close old file and free its name */
-	if (current_spoolfile) {
-		fclose(current_spoolfile);
-		current_spoolfile = NULL;
-	}
-	if (current_spoolfile_name) {
-		pfree(current_spoolfile_name);
-		current_spoolfile_name = NULL;
+	int			i;
+
+	for (i = 0; i < num_open_streams; i++)
+	{
+		fclose(open_streams[i].fh);
+		pfree(open_streams[i].stream);
+		pfree(open_streams[i].filename);
 	}
+	num_open_streams = 0;
+}
+
+/*
+ * Close the current files (if any); the files of the new rotation period
+ * are opened as events are written to each stream
+ */
+static void
+rotate_spoolfile(void)
+{
+	close_streams();
+	rotation_requested = false;
 
 	/* Enable spooling again */
 	Pglog_spooling_enabled=true;
 
 	/* set next planned rotation time */
 	set_next_rotation_time();
+}
 
-	/* Open a new log file */
-	open_spoolfile(path, next_rotation_time - Pglog_RotationAge * SECS_PER_MINUTE);
+/*
+ * Get the open spool file of a stream, opening it if needed
+ *
+ * The file is opened in the fast tier if fast is true.  When too many
+ * streams are open, the least recently opened one is closed.  Returns NULL
+ * if the file could not be opened.
+ */
+static PgLogOpenStream *
+get_stream(const char *stream, bool fast)
+{
+	PgLogOpenStream *entry;
+	MemoryContext oldcontext;
+	const char *directory;
+	char	   *path;
+	char	   *filename;
+	FILE	   *fh;
+	int			i;
+
+	for (i = 0; i < num_open_streams; i++)
+		if (open_streams[i].fast == fast &&
+			strcmp(open_streams[i].stream, stream) == 0)
+			return &open_streams[i];
+
+	/* Open the file of the current period, creating the directories */
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	directory = fast ? Pglog_fast_directory : pglog_spool_stripe_directory();
+	if (stream[0] == '\0')
+		path = pstrdup(directory);
+	else
+	{
+		mkdir(directory, S_IRWXU);
+		path = palloc(MAXPGPATH);
+		snprintf(path, MAXPGPATH, "%s/%s", directory, stream);
+	}
+	fh = open_spoolfile(path,
+						next_rotation_time - Pglog_RotationAge * SECS_PER_MINUTE,
+						&filename);
+	pfree(path);
+	if (fh == NULL)
+	{
+		pfree(filename);
+		MemoryContextSwitchTo(oldcontext);
+		return NULL;
+	}
+
+	if (num_open_streams == PGLOG_MAX_OPEN_STREAMS)
+	{
+		fclose(open_streams[0].fh);
+		pfree(open_streams[0].stream);
+		pfree(open_streams[0].filename);
+		memmove(&open_streams[0], &open_streams[1],
+				(PGLOG_MAX_OPEN_STREAMS - 1) * sizeof(PgLogOpenStream));
+		num_open_streams--;
+	}
+
+	entry = &open_streams[num_open_streams++];
+	entry->stream = pstrdup(stream);
+	entry->fast = fast;
+	entry->filename = filename;
+	entry->fh = fh;
+	MemoryContextSwitchTo(oldcontext);
 
+	return entry;
+}
+
+/*
+ * Split a list of spool directories, such as the value of pglog.directory
+ *
+ * Directories are separated by commas, and can be double-quoted; they are
+ * canonicalized.  Returns NIL, after reporting nothing, on a syntax error.
+ * The list and its directories are palloc'd.
+ */
+List *
+pglog_split_directories(const char *value)
+{
+	List	   *directories = NIL;
+
+	if (!SplitDirectoriesString(pstrdup(value), ',', &directories))
+	{
+		list_free_deep(directories);
+		return NIL;
+	}
+	return directories;
+}
+
+/*
+ * Directories listed in pglog.directory
+ *
+ * The list is parsed once, and again after the setting changed.
+ */
+List *
+pglog_spool_directories(void)
+{
+	MemoryContext oldcontext;
+
+	if (!spool_directories_valid)
+	{
+		list_free_deep(spool_directories);
+		oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+		spool_directories = (Pglog_directory != NULL) ?
+			pglog_split_directories(Pglog_directory) : NIL;
+		MemoryContextSwitchTo(oldcontext);
+		spool_directories_valid = true;
+	}
+	return spool_directories;
+}
+
+/*
+ * First directory of pglog.directory, "" if none
+ *
+ * Files other than the spool segments, such as rollups, are kept there
+ * only.
+ */
+const char *
+pglog_spool_primary_directory(void)
+{
+	List	   *directories = pglog_spool_directories();
+
+	return (directories != NIL) ? (const char *) linitial(directories) : "";
+}
+
+/*
+ * Directory this process spools to
+ *
+ * Processes are striped across the directories of pglog.directory by
+ * process id, so that concurrent writers spread their writes over all the
+ * volumes, while the events of a process stay in order in one segment.
+ */
+const char *
+pglog_spool_stripe_directory(void)
+{
+	List	   *directories = pglog_spool_directories();
+
+	if (directories == NIL)
+		return "";
+	return (const char *) list_nth(directories,
+								   MyProcPid % list_length(directories));
+}
+
+/*
+ * Name of the stream an event is routed to, "" for pglog.directory itself
+ *
+ * Database names are encoded so as to be safe as a directory name, even on
+ * case-insensitive filesystems: lower-case letters, digits and underscores
+ * are kept, any other byte is written as %XX.  Result is palloc'd.
+ */
+char *
+pglog_stream_name(int elevel, const char *database)
+{
+	StringInfoData stream;
+	const unsigned char *p;
+
+	initStringInfo(&stream);
+
+	switch (Pglog_route)
+	{
+		case PGLOG_ROUTE_SEVERITY:
+			appendStringInfoString(&stream, (elevel >= ERROR) ?
+								   PGLOG_STREAM_ERRORS : PGLOG_STREAM_EVENTS);
+			break;
+		case PGLOG_ROUTE_DATABASE:
+			/* Events of no database stay in pglog.directory */
+			if (database == NULL || database[0] == '\0')
+				break;
+			appendStringInfoString(&stream, PGLOG_STREAM_DATABASE_PREFIX);
+			for (p = (const unsigned char *) database; *p; p++)
+			{
+				if ((*p >= 'a' && *p <= 'z') || (*p >= '0' && *p <= '9') ||
+					*p == '_')
+					appendStringInfoChar(&stream, *p);
+				else
+					appendStringInfo(&stream, "%%%02X", *p);
+			}
+			break;
+	}
+
+	return stream.data;
+}
+
+/*
+ * Database of a stream routed by database, NULL if the name is not one
+ *
+ * Result is palloc'd.
+ */
+char *
+pglog_stream_database(const char *stream)
+{
+	StringInfoData database;
+	const char *p;
+	int			prefix_len = strlen(PGLOG_STREAM_DATABASE_PREFIX);
+
+	if (strncmp(stream, PGLOG_STREAM_DATABASE_PREFIX, prefix_len) != 0)
+		return NULL;
+
+	initStringInfo(&database);
+	for (p = stream + prefix_len; *p; p++)
+	{
+		if (*p == '%' && isxdigit((unsigned char) p[1]) &&
+			isxdigit((unsigned char) p[2]))
+		{
+			char		hex[3] = {p[1], p[2], '\0'};
+
+			appendStringInfoChar(&database, (char) strtol(hex, NULL, 16));
+			p += 2;
+		}
+		else
+			appendStringInfoChar(&database, *p);
+	}
+
+	return database.data;
+}
+
+/*
+ * Write a formatted record to the stream it is routed to
+ *
+ * With a fast tier, events less severe than pglog.persistent_min_messages
+ * are written there, to be moved to pglog.directory by the mover once
+ * their segment is complete.  The time spent writing is added to *elapsed.
+ * On failure, spooling is disabled and false is returned.
+ */
+static bool
+write_record(StringInfo buf, int elevel, const char *database,
+			 instr_time *elapsed)
+{
+	PgLogOpenStream *entry;
+	char	   *stream;
+	instr_time	start;
+	instr_time	end;
+	int			rc;
+
+	stream = pglog_stream_name(elevel, database);
+	entry = get_stream(stream,
+					   pglog_fast_tier_enabled() &&
+					   !is_log_level_output(elevel,
+											Pglog_persistent_min_messages));
+	pfree(stream);
+
+	/* Couldn't open the destination file; give up */
+	if (entry == NULL)
+		return false;
+
+	/* write the log line
+	 * TODO: this is not safe for concurrency
+	 */
+	INSTR_TIME_SET_CURRENT(start);
+	fseek(entry->fh, 0L, SEEK_END);
+	rc = fwrite(buf->data, 1, buf->len, entry->fh);
+	INSTR_TIME_SET_CURRENT(end);
+	INSTR_TIME_ACCUM_DIFF(*elapsed, end, start);
+
+	/* can't use ereport here because of possible recursion */
+	if (rc != buf->len) {
+		/*
+		 * We need to disable spooling to emit an error message here.
+		 */
+		Pglog_spooling_enabled = false;
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not write log file \"%s\": %m",
+						entry->filename)));
+		return false;
+	}
+
+	return true;
 }
 
 /*
@@ -245,25 +680,33 @@ static void
 setup_formatted_log_time(void)
 {
 	struct timeval tv;
-	pg_time_t	stamp_time;
-	char		msbuf[8];
 
 	gettimeofday(&tv, NULL);
-	stamp_time = (pg_time_t) tv.tv_sec;
+	format_log_time(formatted_log_time, (pg_time_t) tv.tv_sec,
+					(int) (tv.tv_usec / 1000));
+}
+
+/*
+ * format a timestamp with milliseconds, as the log_time column
+ */
+static void
+format_log_time(char *dst, pg_time_t stamp_time, int msec)
+{
+	char		msbuf[8];
 
 	/*
 	 * Note: we expect that guc.c will ensure that log_timezone is set up (at
 	 * least with a minimal GMT value) before Log_line_prefix can become
 	 * nonempty or CSV mode can be selected.
 	 */
-	pg_strftime(formatted_log_time, FORMATTED_TS_LEN,
+	pg_strftime(dst, FORMATTED_TS_LEN,
 	/* leave room for milliseconds... */
 				"%Y-%m-%d %H:%M:%S     %Z",
 				pg_localtime(&stamp_time, log_timezone));
 
 	/* 'paste' milliseconds into place... */
-	sprintf(msbuf, ".%03d", (int) (tv.tv_usec / 1000));
-	strncpy(formatted_log_time + 19, msbuf, 4);
+	sprintf(msbuf, ".%03d", msec);
+	strncpy(dst + 19, msbuf, 4);
 }
 
 /*
@@ -289,8 +732,8 @@ setup_formatted_start_time(void)
  * We use the PostgreSQL defaults for CSV, i.e. quote = escape = '"'
  * If it's NULL, append nothing.
  */
-static inline void
-appendCSVLiteral(StringInfo buf, const char *data)
+void
+pglog_append_csv_literal(StringInfo buf, const char *data)
 {
 	const char *p = data;
 	char		c;
@@ -311,10 +754,10 @@ appendCSVLiteral(StringInfo buf, const char *data)
 
 
 /*
- * error_severity --- get localized string representing elevel
+ * pglog_error_severity --- get localized string representing elevel
  */
-static const char *
-error_severity(int elevel)
+const char *
+pglog_error_severity(int elevel)
 {
 	const char *prefix;
 
@@ -357,6 +800,25 @@ error_severity(int elevel)
 	return prefix;
 }
 
+/*
+ * pglog_severity_index --- position of a severity label in the
+ * pglog_severity enum; unknown labels map to '???'
+ */
+int
+pglog_severity_index(const char *label)
+{
+	int			i;
+
+	if (label != NULL)
+	{
+		for (i = 0; i < PGLOG_NUM_SEVERITIES; i++)
+			if (strcmp(label, pglog_severity_labels[i]) == 0)
+				return i;
+	}
+
+	return PGLOG_NUM_SEVERITIES - 1;
+}
+
 /*
  * is_log_level_output -- is elevel logically >= log_min_level?
  *
@@ -386,8 +848,46 @@ is_log_level_output(int elevel, int log_min_level)
 	return false;
 }
 
+/*
+ * get_min_messages -- minimum level of the events spooled by this process
+ *
+ * Per-database and per-role values of pglog.min_messages are applied by
+ * the GUC machinery at backend start, so only the type of process is left
+ * to take into account.  That is done once, when the process has its
+ * PGPROC and thus knows what it is, and cached until the settings change,
+ * leaving a single comparison to the write path.
+ */
+static int
+get_min_messages(void)
+{
+	int			level;
+
+	if (effective_min_messages_pid == MyProcPid)
+		return effective_min_messages;
+
+	if (IsAutoVacuumLauncherProcess() || IsAutoVacuumWorkerProcess())
+		level = Pglog_autovacuum_min_messages;
+	else if (am_walsender)
+		level = Pglog_walsender_min_messages;
+	else if (IsBackgroundWorker)
+		level = Pglog_bgworker_min_messages;
+	else
+		level = -1;
+
+	if (level < 0)
+		level = Pglog_min_messages;
+
+	if (MyProc != NULL)
+	{
+		effective_min_messages = level;
+		effective_min_messages_pid = MyProcPid;
+	}
+
+	return level;
+}
+
 static void
-fmtLogLine(StringInfo buf, ErrorData *edata)
+fmtLogLine(StringInfo buf, ErrorData *edata, uint64 fingerprint)
 {
 	bool		print_stmt = false;
 
@@ -425,12 +925,12 @@ fmtLogLine(StringInfo buf, ErrorData *edata)
 
 	/* username */
 	if (MyProcPort)
-		appendCSVLiteral(buf, MyProcPort->user_name);
+		pglog_append_csv_literal(buf, MyProcPort->user_name);
 	appendStringInfoChar(buf, ',');
 
 	/* database name */
 	if (MyProcPort)
-		appendCSVLiteral(buf, MyProcPort->database_name);
+		pglog_append_csv_literal(buf, MyProcPort->database_name);
 	appendStringInfoChar(buf, ',');
 
 	/* Process id  */
@@ -471,7 +971,7 @@ fmtLogLine(StringInfo buf, ErrorData *edata)
 
 		psdisp = get_ps_display(&displen);
 		appendBinaryStringInfo(&msgbuf, psdisp, displen);
-		appendCSVLiteral(buf, msgbuf.data);
+		pglog_append_csv_literal(buf, msgbuf.data);
 
 		pfree(msgbuf.data);
 	}
@@ -494,7 +994,7 @@ fmtLogLine(StringInfo buf, ErrorData *edata)
 	appendStringInfoChar(buf, ',');
 
 	/* Error severity */
-	appendStringInfoString(buf, error_severity(edata->elevel));
+	appendStringInfoString(buf, pglog_error_severity(edata->elevel));
 	appendStringInfoChar(buf, ',');
 
 	/* SQL state code */
@@ -502,22 +1002,22 @@ fmtLogLine(StringInfo buf, ErrorData *edata)
 	appendStringInfoChar(buf, ',');
 
 	/* errmessage */
-	appendCSVLiteral(buf, edata->message);
+	pglog_append_csv_literal(buf, edata->message);
 	appendStringInfoChar(buf, ',');
 
 	/* errdetail or errdetail_log */
 	if (edata->detail_log)
-		appendCSVLiteral(buf, edata->detail_log);
+		pglog_append_csv_literal(buf, edata->detail_log);
 	else
-		appendCSVLiteral(buf, edata->detail);
+		pglog_append_csv_literal(buf, edata->detail);
 	appendStringInfoChar(buf, ',');
 
 	/* errhint */
-	appendCSVLiteral(buf, edata->hint);
+	pglog_append_csv_literal(buf, edata->hint);
 	appendStringInfoChar(buf, ',');
 
 	/* internal query */
-	appendCSVLiteral(buf, edata->internalquery);
+	pglog_append_csv_literal(buf, edata->internalquery);
 	appendStringInfoChar(buf, ',');
 
 	/* if printed internal query, print internal pos too */
@@ -526,7 +1026,7 @@ fmtLogLine(StringInfo buf, ErrorData *edata)
 	appendStringInfoChar(buf, ',');
 
 	/* errcontext */
-	appendCSVLiteral(buf, edata->context);
+	pglog_append_csv_literal(buf, edata->context);
 	appendStringInfoChar(buf, ',');
 
 	/* user query --- only reported if not disabled by the caller */
@@ -535,7 +1035,7 @@ fmtLogLine(StringInfo buf, ErrorData *edata)
 		!edata->hide_stmt)
 		print_stmt = true;
 	if (print_stmt)
-		appendCSVLiteral(buf, debug_query_string);
+		pglog_append_csv_literal(buf, debug_query_string);
 	appendStringInfoChar(buf, ',');
 	if (print_stmt && edata->cursorpos > 0)
 		appendStringInfo(buf, "%d", edata->cursorpos);
@@ -555,36 +1055,318 @@ fmtLogLine(StringInfo buf, ErrorData *edata)
 		else if (edata->filename)
 			appendStringInfo(&msgbuf, "%s:%d",
 							 edata->filename, edata->lineno);
-		appendCSVLiteral(buf, msgbuf.data);
+		pglog_append_csv_literal(buf, msgbuf.data);
 		pfree(msgbuf.data);
 	}
 	appendStringInfoChar(buf, ',');
 
 	/* application name */
 	if (application_name)
-		appendCSVLiteral(buf, application_name);
+		pglog_append_csv_literal(buf, application_name);
+	appendStringInfoChar(buf, ',');
+
+	/* message fingerprint */
+	appendStringInfo(buf, INT64_FORMAT, (int64) fingerprint);
+	appendStringInfoChar(buf, ',');
+
+	/* query fingerprint, even if the query itself is not printed */
+	if (debug_query_string != NULL && !edata->hide_stmt)
+		appendStringInfo(buf, INT64_FORMAT,
+						 (int64) pglog_fingerprint_query(debug_query_string,
+														 NULL, 0));
+
+	appendStringInfoChar(buf, '\n');
+}
+
+/*
+ * Format a record written by pglog itself rather than by an event
+ *
+ * Only the time, user, database, severity, SQLSTATE, message, detail and
+ * message fingerprint are filled; the other session fields are empty.
+ */
+static void
+fmtSyntheticLine(StringInfo buf, const char *log_time, const char *user,
+				 const char *database, int elevel, int sqlerrcode,
+				 const char *message, const char *detail,
+				 const uint64 *fingerprint)
+{
+	appendStringInfoString(buf, log_time);
+	appendStringInfoChar(buf, ',');
+
+	/* username and database name */
+	if (user && user[0] != '\0')
+		pglog_append_csv_literal(buf, user);
+	appendStringInfoChar(buf, ',');
+	if (database && database[0] != '\0')
+		pglog_append_csv_literal(buf, database);
+	appendStringInfoChar(buf, ',');
+
+	/*
+	 * Process id, remote host, session id, line number, PS display, session
+	 * start, virtual and top transaction ids
+	 */
+	appendStringInfoString(buf, ",,,,,,,,");
+
+	/* Error severity and SQL state code */
+	appendStringInfoString(buf, pglog_error_severity(elevel));
+	appendStringInfoChar(buf, ',');
+	appendStringInfoString(buf, unpack_sql_state(sqlerrcode));
+	appendStringInfoChar(buf, ',');
+
+	/* errmessage and errdetail */
+	pglog_append_csv_literal(buf, message);
+	appendStringInfoChar(buf, ',');
+	pglog_append_csv_literal(buf, detail);
+	appendStringInfoChar(buf, ',');
+
+	/*
+	 * errhint, internal query and position, errcontext, user query and
+	 * position, error location, application name
+	 */
+	appendStringInfoString(buf, ",,,,,,,,");
+
+	/* message fingerprint, no query fingerprint */
+	if (fingerprint)
+		appendStringInfo(buf, INT64_FORMAT, (int64) *fingerprint);
+	appendStringInfoChar(buf, ',');
 
 	appendStringInfoChar(buf, '\n');
 }
 
+/*
+ * Format the summary record of suppressed repeats
+ *
+ * The record carries the database, user, severity, SQLSTATE and message
+ * fingerprint of the repeated event, and is timestamped with the last
+ * repeat.
+ */
+static void
+fmtSummaryLine(StringInfo buf, PgLogDedupSummary *summary)
+{
+	char		first_time[FORMATTED_TS_LEN];
+	char		last_time[FORMATTED_TS_LEN];
+	StringInfoData message;
+	StringInfoData detail;
+
+	format_log_time(first_time, summary->first_time, summary->first_msec);
+	format_log_time(last_time, summary->last_time, summary->last_msec);
+
+	initStringInfo(&message);
+	appendStringInfo(&message, "message repeated " INT64_FORMAT " times",
+					 summary->repeats);
+	initStringInfo(&detail);
+	appendStringInfo(&detail, "Repeated message: %s\n"
+					 "First repeat at %s, last repeat at %s.",
+					 summary->message, first_time, last_time);
+
+	fmtSyntheticLine(buf, last_time, NameStr(summary->user),
+					 NameStr(summary->database), summary->elevel,
+					 summary->sqlerrcode, message.data, detail.data,
+					 &summary->fingerprint);
+
+	pfree(message.data);
+	pfree(detail.data);
+}
+
+/*
+ * Format the summary record of events dropped by a rate limit
+ *
+ * The record is timestamped with the last event dropped.
+ */
+static void
+fmtThrottleLine(StringInfo buf, PgLogThrottleSummary *summary)
+{
+	char		first_time[FORMATTED_TS_LEN];
+	char		last_time[FORMATTED_TS_LEN];
+	StringInfoData message;
+	StringInfoData detail;
+
+	format_log_time(first_time, summary->first_time, summary->first_msec);
+	format_log_time(last_time, summary->last_time, summary->last_msec);
+
+	initStringInfo(&message);
+	appendStringInfo(&message, INT64_FORMAT " events dropped by %s",
+					 summary->throttled, summary->limit);
+	initStringInfo(&detail);
+	appendStringInfo(&detail, "First dropped at %s, last dropped at %s.",
+					 first_time, last_time);
+
+	fmtSyntheticLine(buf, last_time, NULL, NameStr(summary->database),
+					 summary->elevel, 0, message.data, detail.data, NULL);
+
+	pfree(message.data);
+	pfree(detail.data);
+}
+
+/*
+ * Format the marker record of a change of the shedding level
+ */
+static void
+fmtShedLine(StringInfo buf, PgLogShedChange *change)
+{
+	char		log_time[FORMATTED_TS_LEN];
+	struct timeval tv;
+	StringInfoData message;
+	StringInfoData detail;
+
+	gettimeofday(&tv, NULL);
+	format_log_time(log_time, (pg_time_t) tv.tv_sec,
+					(int) (tv.tv_usec / 1000));
+
+	initStringInfo(&message);
+	if (change->new_level == 0)
+		appendStringInfo(&message,
+						 "pglog restored the minimum severity of spooled events to %s",
+						 pglog_error_severity(get_min_messages()));
+	else
+		appendStringInfo(&message,
+						 "pglog %s the minimum severity of spooled events to %s",
+						 (change->old_level == 0 ||
+						  change->new_level > change->old_level) ?
+						 "raised" : "lowered",
+						 pglog_error_severity(change->new_level));
+
+	initStringInfo(&detail);
+	if (change->latency < 0)
+		appendStringInfo(&detail, "No event was written for %d seconds.",
+						 PGLOG_SHED_HOLD_SECS);
+	else
+		appendStringInfo(&detail,
+						 "Average write latency is %.3f ms, pglog.shed_latency is %d ms.",
+						 change->latency, Pglog_shed_latency);
+
+	fmtSyntheticLine(buf, log_time, NULL, NULL, LOG, 0,
+					 message.data, detail.data, NULL);
+
+	pfree(message.data);
+	pfree(detail.data);
+}
+
+/*
+ * Write the summary records of closed dedup windows
+ *
+ * Summaries are removed from *summaries as they are written.  Returns
+ * false, after disabling spooling, if one could not be written; the caller
+ * has to put back those left.
+ */
+static bool
+write_summaries(StringInfo buf, List **summaries, instr_time *elapsed)
+{
+	while (*summaries != NIL)
+	{
+		PgLogDedupSummary *summary = (PgLogDedupSummary *) linitial(*summaries);
+
+		resetStringInfo(buf);
+		fmtSummaryLine(buf, summary);
+		if (!write_record(buf, summary->elevel, NameStr(summary->database),
+						  elapsed))
+			return false;
+
+		*summaries = list_delete_first(*summaries);
+		pfree(summary);
+	}
+
+	return true;
+}
+
+/*
+ * Write the summaries of the dedup windows that are over, and of the events
+ * dropped by rate limits that are not dropping any more
+ *
+ * Backends only write these when they spool an event; the mover calls this
+ * regularly so that the summary of a burst of repeats, or of a storm, that
+ * simply stopped is written too.
+ */
+void
+pglog_spool_flush_summaries(void)
+{
+	StringInfoData buf;
+	List	   *summaries = NIL;
+	List	   *throttles = NIL;
+	instr_time	elapsed;
+	int			save_errno = errno;
+	bool		ok = true;
+
+	if (!Pglog_spooling_enabled || pglog_spool_directories() == NIL)
+		return;
+
+	pglog_dedup_sweep(&summaries);
+	pglog_ratelimit_sweep(&throttles);
+	if (summaries == NIL && throttles == NIL)
+		return;
+
+	if ((pg_time_t) time(NULL) >= next_rotation_time)
+		rotation_requested = true;
+	if (rotation_requested)
+		rotate_spoolfile();
+
+	initStringInfo(&buf);
+	INSTR_TIME_SET_ZERO(elapsed);
+	while (ok && throttles != NIL)
+	{
+		PgLogThrottleSummary *throttle =
+			(PgLogThrottleSummary *) linitial(throttles);
+
+		resetStringInfo(&buf);
+		fmtThrottleLine(&buf, throttle);
+		if (!write_record(&buf, throttle->elevel,
+						  NameStr(throttle->database), &elapsed))
+			ok = false;
+		else
+		{
+			throttles = list_delete_first(throttles);
+			pfree(throttle);
+		}
+	}
+	if (!ok || !write_summaries(&buf, &summaries, &elapsed))
+	{
+		pglog_ratelimit_requeue(throttles);
+		pglog_dedup_requeue(summaries);
+	}
+
+	pfree(buf.data);
+	list_free_deep(throttles);
+	list_free_deep(summaries);
+	errno = save_errno;
+}
+
+/*
+ * Count a spooled event in the in-memory summaries
+ */
+static void
+count_event(ErrorData *edata, uint64 fingerprint)
+{
+	pglog_rollup_count(edata->elevel, edata->sqlerrcode);
+	pglog_hll_add(edata->elevel);
+	pglog_topk_count(edata->elevel, fingerprint, edata->message);
+}
+
 static void
 pglog_emit_log_hook(ErrorData *edata)
 {
 	int				save_errno;
 	StringInfoData	buf;
-	int				rc;
+	uint64			fingerprint = 0;
+	bool			write_event = true;
+	List		   *summaries = NIL;
+	PgLogThrottleSummary throttle_summary;
+	bool			throttle_summarized;
+	PgLogShedChange	shed_change;
+	int				shed_level;
+	int				min_messages;
+	const char	   *database = NULL;
+	instr_time		elapsed;
 
 	/*
 	 * Early exit if the spool directory path is not set
 	 */
-	if (!Pglog_spooling_enabled || Pglog_directory == NULL || strlen(Pglog_directory) <= 0)
+	if (!Pglog_spooling_enabled || pglog_spool_directories() == NIL)
 	{
 		/*
 		 * Unsetting the GUCs via SIGHUP would leave a dangling file
 		 * descriptor, if it exists, close it.
 		 */
-		if (current_spoolfile)
-			fclose(current_spoolfile);
+		close_streams();
 
 		goto quickExit;
 	}
@@ -592,7 +1374,50 @@ pglog_emit_log_hook(ErrorData *edata)
 	/*
 	 * Check if the log has to be written, if not just exit.
 	 */
-	if (! is_log_level_output(edata->elevel, Pglog_min_messages))
+	min_messages = get_min_messages();
+	if (! is_log_level_output(edata->elevel, min_messages))
+		goto quickExit;
+
+	/*
+	 * Then it must pass pglog.filter, evaluated from its compiled form.
+	 */
+	if (! pglog_filter_accept(edata))
+		goto quickExit;
+
+	/*
+	 * Events beyond their rate limit are dropped before any formatting
+	 * cost is paid; they are only counted, to be summarized with the next
+	 * event let through.
+	 */
+	if (pglog_ratelimit_check(edata->elevel, &throttle_summary,
+							  &throttle_summarized))
+		goto quickExit;
+
+	/*
+	 * Under overload, events below the shedding level are dropped too, but
+	 * a change of level must still be recorded.
+	 */
+	shed_level = pglog_shed_level(min_messages, &shed_change);
+	if (shed_level != 0 && !is_log_level_output(edata->elevel, shed_level))
+		write_event = false;
+
+	/*
+	 * Repeats of a recent event are only counted, to be summarized when
+	 * their window is over; the summaries of windows just closed still
+	 * have to be written.
+	 */
+	if (write_event)
+	{
+		fingerprint = pglog_fingerprint_message(edata->message, NULL, 0);
+		if (pglog_dedup_check(edata, fingerprint, &summaries))
+		{
+			count_event(edata, fingerprint);
+			write_event = false;
+		}
+	}
+
+	if (!write_event && summaries == NIL && !throttle_summarized &&
+		!shed_change.changed)
 		goto quickExit;
 
 	/* Do a logfile rotation if it's time */
@@ -608,40 +1433,61 @@ pglog_emit_log_hook(ErrorData *edata)
 	 */
 	initStringInfo(&buf);
 
-	if (current_spoolfile == NULL || rotation_requested)
-	{
-		rotate_spoolfile(Pglog_directory);
+	if (rotation_requested)
+		rotate_spoolfile();
+
+	if (MyProcPort)
+		database = MyProcPort->database_name;
 
-		/* Couldn't open the destination file; give up */
-		if (current_spoolfile == NULL)
+	/*
+	 * Write the records written by pglog itself, then the log line, each
+	 * to the stream it is routed to
+	 */
+	INSTR_TIME_SET_ZERO(elapsed);
+	if (shed_change.changed)
+	{
+		fmtShedLine(&buf, &shed_change);
+		if (!write_record(&buf, LOG, NULL, &elapsed))
 			goto exit;
 	}
+	if (throttle_summarized)
+	{
+		resetStringInfo(&buf);
+		fmtThrottleLine(&buf, &throttle_summary);
+		if (!write_record(&buf, throttle_summary.elevel,
+						  NameStr(throttle_summary.database), &elapsed))
+			goto exit;
+	}
+	if (!write_summaries(&buf, &summaries, &elapsed))
+		goto exit;
+	if (write_event)
+	{
+		resetStringInfo(&buf);
+		formatted_log_time[0] = '\0';
+		fmtLogLine(&buf, edata, fingerprint);
+		if (!write_record(&buf, edata->elevel, database, &elapsed))
+			goto exit;
 
-	/* format the log line */
-	fmtLogLine(&buf, edata);
-
-	/* write the log line
-	 * TODO: this is not safe for concurrency
-	 */
-	fseek(current_spoolfile, 0L, SEEK_END);
-	rc = fwrite(buf.data, 1, buf.len, current_spoolfile);
+		count_event(edata, fingerprint);
+	}
 
-	/* can't use ereport here because of possible recursion */
-	if (rc != buf.len) {
-		/*
-		 * We need to disable spooling to emit an error message here.
-		 */
-		Pglog_spooling_enabled = false;
-		ereport(LOG,
-				(errcode_for_file_access(),
-				 errmsg("could not write log file \"%s\": %m",
-						current_spoolfile_name)));
+	/* Raise or lower the shedding level, recording the change at once */
+	pglog_shed_sample(INSTR_TIME_GET_MILLISEC(elapsed), min_messages,
+					  &shed_change);
+	if (shed_change.changed)
+	{
+		resetStringInfo(&buf);
+		fmtShedLine(&buf, &shed_change);
+		write_record(&buf, LOG, NULL, &elapsed);
 	}
 
 	goto exit;
 
 exit:
+	/* Summaries not written because of a failure are put back */
+	pglog_dedup_requeue(summaries);
 	pfree(buf.data);
+	list_free_deep(summaries);
 	errno = save_errno;
 
 quickExit:
@@ -653,13 +1499,37 @@ quickExit:
 static void
 guc_assign_directory(const char *newval, void *extra)
 {
+	/* Parse the list again on next use */
+	spool_directories_valid = false;
+
 	/* Force a rotation, but only if there is an open file */
-	if (current_spoolfile)
+	if (num_open_streams > 0)
 		rotation_requested = true;
 }
 
 static bool
 guc_check_directory(char **newval, void **extra, GucSource source)
+{
+	List	   *directories = NIL;
+	char	   *rawstring;
+	bool		ok;
+
+	/* Need a modifiable copy of string */
+	rawstring = pstrdup(*newval);
+	ok = SplitDirectoriesString(rawstring, ',', &directories);
+	list_free_deep(directories);
+	pfree(rawstring);
+
+	if (!ok)
+	{
+		GUC_check_errdetail("List syntax is invalid.");
+		return false;
+	}
+	return true;
+}
+
+static bool
+guc_check_fast_directory(char **newval, void **extra, GucSource source)
 {
 	/*
 	 * Since canonicalize_path never enlarges the string, we can just modify
@@ -675,6 +1545,13 @@ guc_assign_rotation_age(int newval, void *extra)
 	set_next_rotation_time();
 }
 
+static void
+guc_assign_min_messages(int newval, void *extra)
+{
+	/* Resolve the level again on next use, once the new value is set */
+	effective_min_messages_pid = 0;
+}
+
 /*
  * Spooling initialization function
  */
@@ -684,7 +1561,7 @@ pglog_spool_init(void)
 	/* Set up GUCs */
 	DefineCustomStringVariable("pglog.directory",
 							   "Directory where to spool log data",
-							   NULL,
+							   "A comma-separated list of directories stripes the spool across them.",
 							   &Pglog_directory,
 							   "pglog_spool",
 							   PGC_SIGHUP,
@@ -693,6 +1570,29 @@ pglog_spool_init(void)
 							   guc_assign_directory,
 							   NULL);
 
+	DefineCustomStringVariable("pglog.fast_directory",
+							   "Directory where to spool low-severity events before moving them to pglog.directory",
+							   "Empty disables the fast tier.",
+							   &Pglog_fast_directory,
+							   "",
+							   PGC_POSTMASTER,
+							   GUC_NOT_IN_SAMPLE | GUC_SUPERUSER_ONLY,
+							   guc_check_fast_directory,
+							   NULL,
+							   NULL);
+
+	DefineCustomEnumVariable("pglog.persistent_min_messages",
+							 "Sets the message levels that are spooled straight to pglog.directory when there is a fast tier.",
+							 NULL,
+							 &Pglog_persistent_min_messages,
+							 ERROR,
+							 server_message_level_options,
+							 PGC_SIGHUP,
+							 GUC_NOT_IN_SAMPLE,
+							 NULL,
+							 NULL,
+							 NULL);
+
 	DefineCustomEnumVariable("pglog.min_messages",
 							 "Sets the message levels that are logged.",
 							 "Each level includes all the levels that follow it. The later"
@@ -703,6 +1603,55 @@ pglog_spool_init(void)
 							 PGC_SUSET,
 							 GUC_NOT_IN_SAMPLE,
 							 NULL,
+							 guc_assign_min_messages,
+							 NULL);
+
+	DefineCustomEnumVariable("pglog.autovacuum_min_messages",
+							 "Sets the message levels that are logged by autovacuum processes.",
+							 "\"default\" uses pglog.min_messages.",
+							 &Pglog_autovacuum_min_messages,
+							 -1,
+							 process_message_level_options,
+							 PGC_SIGHUP,
+							 GUC_NOT_IN_SAMPLE,
+							 NULL,
+							 guc_assign_min_messages,
+							 NULL);
+
+	DefineCustomEnumVariable("pglog.walsender_min_messages",
+							 "Sets the message levels that are logged by WAL sender processes.",
+							 "\"default\" uses pglog.min_messages.",
+							 &Pglog_walsender_min_messages,
+							 -1,
+							 process_message_level_options,
+							 PGC_SIGHUP,
+							 GUC_NOT_IN_SAMPLE,
+							 NULL,
+							 guc_assign_min_messages,
+							 NULL);
+
+	DefineCustomEnumVariable("pglog.bgworker_min_messages",
+							 "Sets the message levels that are logged by background workers.",
+							 "\"default\" uses pglog.min_messages.",
+							 &Pglog_bgworker_min_messages,
+							 -1,
+							 process_message_level_options,
+							 PGC_SIGHUP,
+							 GUC_NOT_IN_SAMPLE,
+							 NULL,
+							 guc_assign_min_messages,
+							 NULL);
+
+	DefineCustomEnumVariable("pglog.route",
+							 "Sets how events are routed to spool streams.",
+							 "\"severity\" separates ERROR and more severe events from"
+							 " the others, \"database\" separates the events of each database.",
+							 &Pglog_route,
+							 PGLOG_ROUTE_NONE,
+							 route_options,
+							 PGC_SIGHUP,
+							 GUC_NOT_IN_SAMPLE,
+							 NULL,
 							 NULL,
 							 NULL);
 
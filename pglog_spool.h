@@ -15,8 +15,36 @@
 
 #include "postgres.h"
 
+#include "lib/stringinfo.h"
+#include "nodes/pg_list.h"
+#include "pgtime.h"
+
+/* Number of labels of the pglog_severity enum */
+#define PGLOG_NUM_SEVERITIES 9
+
+/*
+ * Routing of events to spool streams, subdirectories of pglog.directory
+ */
+typedef enum PgLogRoute
+{
+	PGLOG_ROUTE_NONE, /* every event in pglog.directory itself */
+	PGLOG_ROUTE_SEVERITY, /* ERROR and above apart from the rest */
+	PGLOG_ROUTE_DATABASE /* one stream per database */
+} PgLogRoute;
+
+/* Streams of events routed by severity */
+#define PGLOG_STREAM_ERRORS "errors"
+#define PGLOG_STREAM_EVENTS "events"
+
+/* Prefix of the streams of events routed by database */
+#define PGLOG_STREAM_DATABASE_PREFIX "db-"
+
 /* GUC Variable */
 extern PGDLLIMPORT char *Pglog_directory;
+extern PGDLLIMPORT int Pglog_RotationAge;
+extern PGDLLIMPORT int Pglog_route;
+extern PGDLLIMPORT char *Pglog_fast_directory;
+extern PGDLLIMPORT int Pglog_persistent_min_messages;
 
 /* Is event spooling working? */
 extern PGDLLIMPORT bool Pglog_spooling_enabled;
@@ -25,4 +53,29 @@ extern PGDLLIMPORT bool Pglog_spooling_enabled;
 extern void pglog_spool_init(void);
 extern void pglog_spool_fini(void);
 
+/* Spool directories */
+extern List *pglog_split_directories(const char *value);
+extern List *pglog_spool_directories(void);
+extern const char *pglog_spool_primary_directory(void);
+extern const char *pglog_spool_stripe_directory(void);
+
+/* Spool file naming */
+extern char *pglog_spool_file_name(const char *path, pg_time_t timestamp,
+					  const char *suffix);
+extern pg_time_t pglog_segment_start(pg_time_t timestamp);
+extern FILE *pglog_spool_fopen(const char *path, const char *filename);
+
+/* Spool streams */
+extern char *pglog_stream_name(int elevel, const char *database);
+extern char *pglog_stream_database(const char *stream);
+
+/* Writing of the summaries of closed dedup windows, by the mover */
+extern void pglog_spool_flush_summaries(void);
+
+/* Spool record formatting */
+extern const char *const pglog_severity_labels[PGLOG_NUM_SEVERITIES];
+extern const char *pglog_error_severity(int elevel);
+extern int pglog_severity_index(const char *label);
+extern void pglog_append_csv_literal(StringInfo buf, const char *data);
+
 #endif
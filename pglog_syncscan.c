@@ -0,0 +1,200 @@
+/*-------------------------------------------------------------------------
+ *
+ * pglog_syncscan.c
+ *		  Synchronized scans of spool segments for pglog extension
+ *
+ * This is the counterpart of the synchronized heap scans of syncscan.c,
+ * for spool segments.  Scans of large segments report, every
+ * PGLOG_SYNCSCAN_REPORT_INTERVAL bytes, the offset of the record they are
+ * at; a scan starting to read a segment starts at the last offset reported
+ * for it, reads to its end, and wraps around to read its beginning up to
+ * the offset it started at.  Scans running concurrently then read the same
+ * parts of the segment at the same time, and share the page cache instead
+ * of competing for it.
+ *
+ * Locations are kept for the PGLOG_SYNCSCAN_NELEM segments used most
+ * recently, in an array kept in LRU order; segments are identified by
+ * device and inode, and by a hash of their leading bytes, as the inode of
+ * a removed segment may be reused by a new one.  Like the heap, this obeys
+ * synchronize_seqscans, and only concerns segments larger than a quarter
+ * of shared_buffers.
+ *
+ * Copyright (c) 2014, 2ndQuadrant Ltd
+ *
+ * IDENTIFICATION
+ *		  pglog/pglog_syncscan.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "pglog_syncscan.h"
+
+#include <unistd.h>
+
+#include "access/hash.h"
+#include "miscadmin.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+
+/* Defined in heapam.c, but not declared in any header */
+extern bool synchronize_seqscans;
+
+/*
+ * Last location reported for a segment
+ */
+typedef struct pglogScanLocation
+{
+	uint64 dev; /* device of the segment */
+	uint64 ino; /* inode of the segment, 0 if the entry is unused */
+	uint32 generation; /* hash of the leading bytes of the segment */
+	off_t offset; /* offset of a record of the segment */
+} PgLogScanLocation;
+
+/*
+ * Global shared state
+ */
+typedef struct pglogSyncScanShared
+{
+	LWLockId lock; /* protects the locations */
+	PgLogScanLocation locations[PGLOG_SYNCSCAN_NELEM]; /* in LRU order */
+} PgLogSyncScanShared;
+
+/* Link to shared memory state */
+static PgLogSyncScanShared *syncscan_shared = NULL;
+
+static PgLogScanLocation *find_location(uint64 dev, uint64 ino,
+			  uint32 generation);
+
+/*
+ * Shared memory needed for the scan locations
+ */
+Size
+pglog_syncscan_shmem_size(void)
+{
+	return MAXALIGN(sizeof(PgLogSyncScanShared));
+}
+
+/*
+ * Allocate or attach to the scan locations
+ *
+ * Called from the shared memory startup hook, holding AddinShmemInitLock.
+ */
+void
+pglog_syncscan_shmem_startup(void)
+{
+	bool		found;
+
+	syncscan_shared = ShmemInitStruct("pglog syncscan",
+									  sizeof(PgLogSyncScanShared),
+									  &found);
+	if (!found)
+	{
+		memset(syncscan_shared, 0, sizeof(PgLogSyncScanShared));
+		syncscan_shared->lock = LWLockAssign();
+	}
+}
+
+/*
+ * Should a scan of a segment of this size be synchronized?
+ */
+bool
+pglog_syncscan_wanted(off_t size)
+{
+	return synchronize_seqscans && syncscan_shared != NULL &&
+		MyProc != NULL && size / BLCKSZ > NBuffers / 4;
+}
+
+/*
+ * Generation of the segment open as fd: a hash of its leading bytes
+ *
+ * Returns false if the segment is too short to have one.
+ */
+bool
+pglog_syncscan_generation(int fd, uint32 *generation)
+{
+	char		buf[PGLOG_SYNCSCAN_GENERATION_BYTES];
+
+	if (pread(fd, buf, sizeof(buf), 0) != sizeof(buf))
+		return false;
+
+	*generation = DatumGetUInt32(hash_any((unsigned char *) buf,
+										  sizeof(buf)));
+	return true;
+}
+
+/*
+ * Offset a scan of the segment open as fd should start at, 0 if not
+ * scanned recently
+ *
+ * The offset reported must follow a newline, otherwise it is not used.
+ */
+off_t
+pglog_syncscan_start(int fd, uint64 dev, uint64 ino, uint32 generation)
+{
+	off_t		offset;
+	char		c;
+
+	LWLockAcquire(syncscan_shared->lock, LW_EXCLUSIVE);
+	offset = find_location(dev, ino, generation)->offset;
+	LWLockRelease(syncscan_shared->lock);
+
+	if (offset > 0 && (pread(fd, &c, 1, offset - 1) != 1 || c != '\n'))
+		return 0;
+
+	return offset;
+}
+
+/*
+ * Report the offset of the record a scan of a segment is at
+ *
+ * As in ss_report_location(), the report is simply skipped if another
+ * backend holds the lock, as a later one will do as well.
+ */
+void
+pglog_syncscan_report(uint64 dev, uint64 ino, uint32 generation,
+					  off_t offset)
+{
+	if (LWLockConditionalAcquire(syncscan_shared->lock, LW_EXCLUSIVE))
+	{
+		find_location(dev, ino, generation)->offset = offset;
+		LWLockRelease(syncscan_shared->lock);
+	}
+}
+
+/*
+ * Find the location of a segment, moving it first in LRU order
+ *
+ * A segment not found takes the place of the least recently used one, with
+ * an offset of 0; the entry of a former file of the same inode is that of
+ * another segment.  Caller must hold the lock exclusively.
+ */
+static PgLogScanLocation *
+find_location(uint64 dev, uint64 ino, uint32 generation)
+{
+	PgLogScanLocation *locations = syncscan_shared->locations;
+	PgLogScanLocation location;
+	int			i;
+
+	for (i = 0; i < PGLOG_SYNCSCAN_NELEM - 1; i++)
+		if (locations[i].dev == dev && locations[i].ino == ino &&
+			locations[i].generation == generation)
+			break;
+
+	if (locations[i].dev == dev && locations[i].ino == ino &&
+		locations[i].generation == generation)
+		location = locations[i];
+	else
+	{
+		location.dev = dev;
+		location.ino = ino;
+		location.generation = generation;
+		location.offset = 0;
+	}
+
+	memmove(&locations[1], &locations[0], i * sizeof(PgLogScanLocation));
+	locations[0] = location;
+
+	return &locations[0];
+}
@@ -0,0 +1,39 @@
+/*-------------------------------------------------------------------------
+ *
+ * pglog_syncscan.h
+ *		  Synchronized scans of spool segments for pglog extension
+ *
+ * Copyright (c) 2014, 2ndQuadrant Ltd
+ *
+ * IDENTIFICATION
+ *		  pglog/pglog_syncscan.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGLOG_SYNCSCAN_H
+#define PGLOG_SYNCSCAN_H
+
+#include "postgres.h"
+
+/* Number of segments whose scan location is remembered */
+#define PGLOG_SYNCSCAN_NELEM 20
+
+/* Bytes read between two reports of the location of a scan */
+#define PGLOG_SYNCSCAN_REPORT_INTERVAL (128 * 1024)
+
+/* Leading bytes of a segment telling it from a former file of its inode */
+#define PGLOG_SYNCSCAN_GENERATION_BYTES 256
+
+/* Shared memory setup */
+extern Size pglog_syncscan_shmem_size(void);
+extern void pglog_syncscan_shmem_startup(void);
+
+/* Called by scans */
+extern bool pglog_syncscan_wanted(off_t size);
+extern bool pglog_syncscan_generation(int fd, uint32 *generation);
+extern off_t pglog_syncscan_start(int fd, uint64 dev, uint64 ino,
+					 uint32 generation);
+extern void pglog_syncscan_report(uint64 dev, uint64 ino, uint32 generation,
+					  off_t offset);
+
+#endif
@@ -0,0 +1,457 @@
+/*-------------------------------------------------------------------------
+ *
+ * pglog_topk.c
+ *		  Most frequent error fingerprints for pglog extension
+ *
+ * The fingerprints of spooled warnings and errors are counted with the
+ * Space-Saving algorithm (Metwally, Agrawal and El Abbadi, 2005): a fixed
+ * number of counters is kept in shared memory and, when an unknown
+ * fingerprint arrives while all of them are in use, the smallest counter is
+ * taken over by the new fingerprint, inheriting its count as an error bound.
+ * The count of a fingerprint is therefore never underestimated, and
+ * overestimated by at most its error; every fingerprint occurring more than
+ * N / pglog.topk_size times in a window of N events is guaranteed to be
+ * tracked.
+ *
+ * Counters are kept for the current window of pglog.topk_window seconds and
+ * for the previous one, so that pglog_top_errors() still has something to
+ * say just after a window starts.
+ *
+ * Copyright (c) 2014, 2ndQuadrant Ltd
+ *
+ * IDENTIFICATION
+ *		  pglog/pglog_topk.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "pglog_topk.h"
+#include "pglog_fingerprint.h"
+#include "pglog_spool.h"
+
+#include <time.h>
+
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/timestamp.h"
+
+/* GUC Variables */
+int			Pglog_topk_window = 300;
+int			Pglog_topk_size = 100;
+
+/* Bytes of the normalized message kept as a sample of a fingerprint */
+#define PGLOG_TOPK_MESSAGE_LEN 128
+
+/* Number of windows kept: the current one and the previous one */
+#define PGLOG_TOPK_WINDOWS 2
+
+/*
+ * A counter of the sketch; unused if count is zero
+ */
+typedef struct pglogTopKEntry
+{
+	uint64 fingerprint; /* fingerprint of the message */
+	slock_t mutex; /* protects count and severity */
+	int64 count; /* occurrences, possibly overestimated */
+	int64 error; /* maximum overestimation of count */
+	int severity; /* index in pglog_severity_labels, of the last event */
+	char message[PGLOG_TOPK_MESSAGE_LEN]; /* normalized message */
+} PgLogTopKEntry;
+
+/*
+ * Global shared state
+ */
+typedef struct pglogTopKShared
+{
+	LWLockId lock; /* protects the counters set of each window */
+	int current; /* index of the current window */
+	pg_time_t window_start[PGLOG_TOPK_WINDOWS]; /* start of each window */
+	PgLogTopKEntry entries[1]; /* VARIABLE LENGTH ARRAY - MUST BE LAST */
+} PgLogTopKShared;
+
+/* Counters of window w */
+#define TOPK_WINDOW(w) \
+	(&topk_shared->entries[(w) * Pglog_topk_size])
+
+/* Number of columns returned by pglog_top_errors() */
+#define PGLOG_TOPK_COLS 6
+
+/* Links to shared memory state */
+static PgLogTopKShared *topk_shared = NULL;
+
+/* Is this backend already updating the counters? */
+static bool topk_busy = false;
+
+/*
+ * SQL functions
+ */
+extern Datum pglog_top_errors(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(pglog_top_errors);
+
+static void advance_window(pg_time_t window_start);
+static int entry_cmp(const void *a, const void *b);
+
+/*
+ * Define the top-K GUCs
+ *
+ * Must be called before pglog_topk_shmem_size(), which depends on them.
+ */
+void
+pglog_topk_init(void)
+{
+	DefineCustomIntVariable("pglog.topk_window",
+							"Sets the length of the windows over which the most frequent errors are counted.",
+							"Zero disables counting.",
+							&Pglog_topk_window,
+							300,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_NOT_IN_SAMPLE | GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pglog.topk_size",
+							"Sets the number of error fingerprints tracked in each window.",
+							NULL,
+							&Pglog_topk_size,
+							100,
+							10,
+							10000,
+							PGC_POSTMASTER,
+							GUC_NOT_IN_SAMPLE,
+							NULL,
+							NULL,
+							NULL);
+}
+
+/*
+ * Shared memory needed for the counters
+ */
+Size
+pglog_topk_shmem_size(void)
+{
+	return add_size(offsetof(PgLogTopKShared, entries),
+					mul_size(PGLOG_TOPK_WINDOWS * Pglog_topk_size,
+							 sizeof(PgLogTopKEntry)));
+}
+
+/*
+ * Allocate or attach to the counters
+ *
+ * Called from the shared memory startup hook, holding AddinShmemInitLock.
+ */
+void
+pglog_topk_shmem_startup(void)
+{
+	bool		found;
+	int			i;
+
+	topk_shared = ShmemInitStruct("pglog topk",
+								  pglog_topk_shmem_size(),
+								  &found);
+	if (found)
+		return;
+
+	topk_shared->lock = LWLockAssign();
+	topk_shared->current = 0;
+	for (i = 0; i < PGLOG_TOPK_WINDOWS; i++)
+		topk_shared->window_start[i] = 0;
+	for (i = 0; i < PGLOG_TOPK_WINDOWS * Pglog_topk_size; i++)
+	{
+		memset(&topk_shared->entries[i], 0, sizeof(PgLogTopKEntry));
+		SpinLockInit(&topk_shared->entries[i].mutex);
+	}
+}
+
+/*
+ * Count an event in the counters of the current window
+ *
+ * fingerprint is the fingerprint of message, which is only normalized again
+ * when a counter is taken over.
+ *
+ * Only warnings and more severe events are counted.  As with the rollups,
+ * a known fingerprint is counted under a shared lock; the exclusive lock is
+ * needed to take a counter over or to start a new window.
+ */
+void
+pglog_topk_count(int elevel, uint64 fingerprint, const char *message)
+{
+	PgLogTopKEntry *entries;
+	PgLogTopKEntry *victim;
+	pg_time_t	now;
+	pg_time_t	window_start;
+	int			severity;
+	int			i;
+
+	/* Safety check, and no recursion from errors reported below */
+	if (Pglog_topk_window <= 0 || !topk_shared || MyProc == NULL ||
+		topk_busy || elevel < WARNING)
+		return;
+
+	now = (pg_time_t) time(NULL);
+	window_start = now - now % Pglog_topk_window;
+	severity = pglog_severity_index(pglog_error_severity(elevel));
+
+	topk_busy = true;
+
+	/* Lookup the fingerprint using a shared lock */
+	LWLockAcquire(topk_shared->lock, LW_SHARED);
+
+	if (topk_shared->window_start[topk_shared->current] == window_start)
+	{
+		entries = TOPK_WINDOW(topk_shared->current);
+		for (i = 0; i < Pglog_topk_size; i++)
+		{
+			volatile PgLogTopKEntry *e = (volatile PgLogTopKEntry *) &entries[i];
+
+			if (e->fingerprint != fingerprint)
+				continue;
+
+			SpinLockAcquire(&e->mutex);
+			if (e->count > 0)
+			{
+				e->count++;
+				e->severity = severity;
+				SpinLockRelease(&e->mutex);
+
+				LWLockRelease(topk_shared->lock);
+				topk_busy = false;
+				return;
+			}
+			SpinLockRelease(&e->mutex);
+		}
+	}
+
+	/* Need exclusive lock to start a window or take a counter over */
+	LWLockRelease(topk_shared->lock);
+	LWLockAcquire(topk_shared->lock, LW_EXCLUSIVE);
+
+	if (topk_shared->window_start[topk_shared->current] < window_start)
+		advance_window(window_start);
+
+	/*
+	 * Find the fingerprint, which could have been added by someone else
+	 * meanwhile, or else the smallest counter.  Nobody else can change the
+	 * counters while the lock is held exclusively.
+	 */
+	entries = TOPK_WINDOW(topk_shared->current);
+	victim = &entries[0];
+	for (i = 0; i < Pglog_topk_size; i++)
+	{
+		if (entries[i].count > 0 && entries[i].fingerprint == fingerprint)
+		{
+			victim = &entries[i];
+			break;
+		}
+		if (entries[i].count < victim->count)
+			victim = &entries[i];
+	}
+
+	if (victim->count == 0 || victim->fingerprint != fingerprint)
+	{
+		victim->fingerprint = fingerprint;
+		victim->error = victim->count;
+		pglog_fingerprint_message(message, victim->message,
+								  PGLOG_TOPK_MESSAGE_LEN);
+	}
+	victim->count++;
+	victim->severity = severity;
+
+	LWLockRelease(topk_shared->lock);
+
+	topk_busy = false;
+}
+
+/*
+ * Make the window starting at window_start the current one
+ *
+ * The current window becomes the previous one if it immediately precedes
+ * the new one, and is discarded otherwise.  Caller must hold the lock
+ * exclusively.
+ */
+static void
+advance_window(pg_time_t window_start)
+{
+	int			current = topk_shared->current;
+	PgLogTopKEntry *entries;
+	int			i;
+
+	if (topk_shared->window_start[current] == window_start - Pglog_topk_window)
+		current = (current + 1) % PGLOG_TOPK_WINDOWS;
+	else
+	{
+		/* No previous window either */
+		int			previous = (current + 1) % PGLOG_TOPK_WINDOWS;
+
+		entries = TOPK_WINDOW(previous);
+		for (i = 0; i < Pglog_topk_size; i++)
+			entries[i].count = 0;
+		topk_shared->window_start[previous] = 0;
+	}
+
+	entries = TOPK_WINDOW(current);
+	for (i = 0; i < Pglog_topk_size; i++)
+		entries[i].count = 0;
+
+	topk_shared->current = current;
+	topk_shared->window_start[current] = window_start;
+}
+
+/*
+ * Order counters by decreasing count
+ */
+static int
+entry_cmp(const void *a, const void *b)
+{
+	int64		ca = ((const PgLogTopKEntry *) a)->count;
+	int64		cb = ((const PgLogTopKEntry *) b)->count;
+
+	if (ca > cb)
+		return -1;
+	if (ca < cb)
+		return 1;
+	return 0;
+}
+
+/*
+ * pglog_top_errors
+ *		Return the k most frequent error fingerprints of the current and of
+ *		the previous window
+ *
+ * The true number of occurrences of a fingerprint in a window lies between
+ * events - max_overcount and events.
+ */
+Datum
+pglog_top_errors(PG_FUNCTION_ARGS)
+{
+	int32		k = PG_GETARG_INT32(0);
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	PgLogTopKEntry *entries;
+	pg_time_t	window_start[PGLOG_TOPK_WINDOWS];
+	FmgrInfo	severity_in;
+	Oid			severity_ioparam;
+	Oid			in_func_oid;
+	int			w;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	if (!topk_shared)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pglog must be loaded via shared_preload_libraries")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* Take a copy of both windows, most recent first */
+	entries = palloc(PGLOG_TOPK_WINDOWS * Pglog_topk_size *
+					 sizeof(PgLogTopKEntry));
+
+	LWLockAcquire(topk_shared->lock, LW_SHARED);
+
+	for (w = 0; w < PGLOG_TOPK_WINDOWS; w++)
+	{
+		int			src = (topk_shared->current + PGLOG_TOPK_WINDOWS - w) %
+			PGLOG_TOPK_WINDOWS;
+		PgLogTopKEntry *dst = &entries[w * Pglog_topk_size];
+		int			i;
+
+		window_start[w] = topk_shared->window_start[src];
+		for (i = 0; i < Pglog_topk_size; i++)
+		{
+			volatile PgLogTopKEntry *e =
+				(volatile PgLogTopKEntry *) &TOPK_WINDOW(src)[i];
+
+			SpinLockAcquire(&e->mutex);
+			dst[i].fingerprint = e->fingerprint;
+			dst[i].count = e->count;
+			dst[i].error = e->error;
+			dst[i].severity = e->severity;
+			SpinLockRelease(&e->mutex);
+			memcpy(dst[i].message, (char *) e->message,
+				   PGLOG_TOPK_MESSAGE_LEN);
+		}
+	}
+
+	LWLockRelease(topk_shared->lock);
+
+	/* Severities are returned as pglog_severity values */
+	getTypeInputInfo(tupdesc->attrs[2]->atttypid, &in_func_oid,
+					 &severity_ioparam);
+	fmgr_info(in_func_oid, &severity_in);
+
+	for (w = 0; w < PGLOG_TOPK_WINDOWS; w++)
+	{
+		PgLogTopKEntry *window = &entries[w * Pglog_topk_size];
+		int			i;
+
+		if (window_start[w] == 0)
+			continue;
+
+		qsort(window, Pglog_topk_size, sizeof(PgLogTopKEntry), entry_cmp);
+
+		for (i = 0; i < Pglog_topk_size && i < k && window[i].count > 0; i++)
+		{
+			Datum		values[PGLOG_TOPK_COLS];
+			bool		nulls[PGLOG_TOPK_COLS];
+			int			j = 0;
+
+			memset(nulls, 0, sizeof(nulls));
+
+			values[j++] = TimestampTzGetDatum(time_t_to_timestamptz(window_start[w]));
+			values[j++] = Int64GetDatum((int64) window[i].fingerprint);
+			values[j++] = InputFunctionCall(&severity_in,
+							(char *) pglog_severity_labels[window[i].severity],
+											severity_ioparam, -1);
+			values[j++] = CStringGetTextDatum(window[i].message);
+			values[j++] = Int64GetDatum(window[i].count);
+			values[j++] = Int64GetDatum(window[i].error);
+
+			Assert(j == PGLOG_TOPK_COLS);
+
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+
+	pfree(entries);
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
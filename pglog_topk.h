@@ -0,0 +1,31 @@
+/*-------------------------------------------------------------------------
+ *
+ * pglog_topk.h
+ *		  Most frequent error fingerprints for pglog extension
+ *
+ * Copyright (c) 2014, 2ndQuadrant Ltd
+ *
+ * IDENTIFICATION
+ *		  pglog/pglog_topk.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGLOG_TOPK_H
+#define PGLOG_TOPK_H
+
+#include "postgres.h"
+
+/* GUC Variables */
+extern PGDLLIMPORT int Pglog_topk_window;
+extern PGDLLIMPORT int Pglog_topk_size;
+
+/* Initialization and shared memory setup */
+extern void pglog_topk_init(void);
+extern Size pglog_topk_shmem_size(void);
+extern void pglog_topk_shmem_startup(void);
+
+/* Called by the write path for every spooled event */
+extern void pglog_topk_count(int elevel, uint64 fingerprint,
+				 const char *message);
+
+#endif
@@ -0,0 +1,56 @@
+--
+-- Parsing of pglog.filter expressions
+--
+LOAD 'pglog';
+SHOW pglog.filter;
+
+-- AND binds tighter than OR, NOT tighter than AND
+SET pglog.filter = 'severity >= error OR sqlstate = ''42P01'' AND NOT database = ''postgres''';
+SHOW pglog.filter;
+SET pglog.filter = 'NOT (Severity < WARNING OR application ^= "psql") and User != ''batch''';
+SHOW pglog.filter;
+
+-- IN lists
+SET pglog.filter = 'sqlstate NOT IN (''57014'', ''40001'') AND user IN ("app", ''batch'')';
+SHOW pglog.filter;
+SET pglog.filter = 'severity in (error, fatal, panic)';
+SHOW pglog.filter;
+
+-- Doubled quotes stand for themselves
+SET pglog.filter = 'message ^= ''it''''s'' OR message = "say ""hi"""';
+SHOW pglog.filter;
+
+-- Errors leave the previous filter in place
+SET pglog.filter = 'message = ''oops';
+SET pglog.filter = 'message = ''it''''s';
+SET pglog.filter = 'message = "it''''s''';
+SHOW pglog.filter;
+SET pglog.filter = 'sqlstate = ''42P01'' # 1';
+SET pglog.filter = 'hostname = ''localhost''';
+SET pglog.filter = 'severity = fatalish';
+SET pglog.filter = 'severity = ''???''';
+SET pglog.filter = 'severity ^= error';
+SET pglog.filter = 'sqlstate < ''42''';
+SET pglog.filter = 'database = postgres';
+SET pglog.filter = 'user LIKE ''app%''';
+SET pglog.filter = 'sqlstate IN ''42P01''';
+SET pglog.filter = 'sqlstate NOT IN (''42P01'', ''40001''';
+SET pglog.filter = '(severity = error OR severity = fatal';
+SET pglog.filter = 'severity = error AND';
+SET pglog.filter = 'severity = error sqlstate = ''42P01''';
+
+-- At most 32 comparisons can be pending; long chains only need two
+SET pglog.filter = 'severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log AND severity = log';
+SHOW pglog.filter;
+SET pglog.filter = 'severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log)))))))))))))))))))))))))))))))';
+SHOW pglog.filter;
+SET pglog.filter = 'severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log))))))))))))))))))))))))))))))))';
+
+-- Precedence decides the depth: the first one needs 33 pending results
+SET pglog.filter = 'severity = log OR severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log)))))))))))))))))))))))))))))))';
+SET pglog.filter = '(severity = log OR severity = log) AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log AND (severity = log)))))))))))))))))))))))))))))))';
+SHOW pglog.filter;
+
+SET pglog.filter = '  ';
+RESET pglog.filter;
+SHOW pglog.filter;